@@ -2,6 +2,55 @@
 #define TRINKET_POWERBOLT_H
 
 #include "powerbolt-protocol.h"
+#include "powerbolt-decoder.h"
+
+// Longest key sequence accepted by a single asynchronous write
+#define TRINKET_POWERBOLT_MAX_SEQUENCE  20
+
+// Locks one ESP32 can drive, each takes two of the eight RMT channels for its readers and all of them
+// share one channel for writing
+#define TRINKET_POWERBOLT_MAX_LOCKS     3
+
+// Raw runs passed to the trace callback, in reader ticks (0.01ms), longer runs are truncated
+#define TRINKET_POWERBOLT_READ_TICK_NS  10000
+#define TRINKET_POWERBOLT_MAX_RUN       32
+
+// Receive profile defaults, see trinket_powerbolt_rx_profile_t
+#define TRINKET_POWERBOLT_RX_FILTER_TICKS   255     // 3.2us, the longest pulse the RMT filter can drop
+#define TRINKET_POWERBOLT_RX_IDLE_TICKS     POWERBOLT_DECODER_IDLE_TICKS
+#define TRINKET_POWERBOLT_RX_NOISE_TICKS    10      // 0.1ms, under the shortest data level at the fastest bit period
+
+// Receive quality, the deadbolt and keypad send every frame twice and the driver merges the copies
+// Ack timeouts are paced keys the deadbolt did not answer, ack gap is the learned wait after an ack
+// Decode errors are frames that ended in a stop bit but could not be decoded, the bit period is
+// calibrated from the last good frame in reader ticks (0.01ms)
+// Runs are copied out of the receive interrupt for the engine task, dropped runs found the queue full
+// and truncated runs were longer than the engine copies. Engine busy time and stack space left (bytes)
+// measure the protocol engine task, which serves every lock. ULP edges and runs were captured during
+// deep sleep and replayed at setup. Spurious runs are receive interrupts that only held noise, they
+// are dropped in the interrupt.
+// Port 0 is the deadbolt and port 1 is the keypad
+typedef struct {
+    uint32_t frames;
+    uint32_t repeats_seen;
+    uint32_t repeats_missing;
+    uint32_t decode_errors;
+    uint32_t symbols_discarded;
+    uint32_t ack_timeouts;
+    uint32_t ack_gap_ms;
+    uint32_t ack_gap_floor_ms;
+    uint32_t runs_dropped;
+    uint32_t runs_truncated;
+    uint32_t run_queue_watermark;
+    uint32_t engine_busy_us;
+    uint32_t engine_wakeups;
+    uint32_t engine_stack_free;
+    uint32_t ulp_edges;
+    uint32_t ulp_runs;
+    uint32_t runs_spurious[2];
+    bool last_repeat_seen[2];
+    uint16_t bit_period[2];
+} trinket_powerbolt_stats_t;
 
 // Stolen from esp32-hal-rmt.c
 // Required for finding pin and channel data from the RMT object
@@ -13,10 +62,60 @@ struct rmt_obj_s
     int channel;
 };
 
+// One lock, its readers, decoders and write state
+typedef struct trinket_powerbolt_s trinket_powerbolt_t;
+
+// Receive settings for both readers of a lock, fields left at 0 take the defaults
+// The glitch filter drops pulses shorter than filter_ticks APB clock cycles (12.5ns, at most 255)
+// before the RMT sees them. A run ends once a level has lasted idle_ticks reader ticks, see
+// POWERBOLT_DECODER_IDLE_TICKS. Runs with levels that all ended before noise_ticks reader ticks are
+// counted as spurious and never reach the engine
+typedef struct {
+    uint8_t filter_ticks;
+    uint16_t idle_ticks;
+    uint16_t noise_ticks;
+} trinket_powerbolt_rx_profile_t;
+
+// Pins and callbacks for one lock, every callback gets arg back
+// The read callback runs on the engine task, it must not block
+// The done callback runs from the esp_timer task once the pin is released back to the keypad
+// The trace callback gets every raw run from both readers but the spurious ones (port, symbols, length,
+// timestamp in us) before it is decoded, for recording traces. It runs on the engine task and must not block
+typedef struct {
+    int keypad_read_pin;
+    int powerbolt_read_write_pin;
+    void *arg;
+    void (*on_read)(void *arg, uint8_t port, powerbolt_read_t received);
+    void (*on_write_done)(void *arg);
+    void (*on_trace)(void *arg, uint8_t port, const uint32_t *symbols, size_t len, int64_t timestamp);
+    trinket_powerbolt_rx_profile_t rx_profile;
+} trinket_powerbolt_config_t;
+
 extern "C" {
-    void trinket_powerbolt_setup(int keypad_read_pin, int powerbolt_read_write_pin);
-    void trinket_powerbolt_write(POWERBOLT_KEY_CODES key_code);
-    void trinket_powerbolt_on_read(void (*callback)(uint8_t, powerbolt_read_t));
+    // Sets up the RMT channels for one more lock, the first call starts the protocol engine task on
+    // core 0, which owns the channels. Returns NULL when TRINKET_POWERBOLT_MAX_LOCKS are already set up
+    // or the RMT has run out of channels
+    trinket_powerbolt_t *trinket_powerbolt_setup(const trinket_powerbolt_config_t *config);
+
+    // Arms the ULP to capture both lines of one lock while the main cores are in deep sleep, it wakes
+    // them once a frame has arrived. Setup replays the capture through that lock's read callback.
+    // False when the pins are not GPIO35 and GPIO32, the only pair one ULP register read covers
+    bool trinket_powerbolt_ulp_arm(trinket_powerbolt_t *powerbolt);
+
+    // Writes return immediately and play the whole sequence as one RMT transmission
+    // Paced writes send one key at a time, each as soon as the deadbolt acks the previous one
+    // Locks take turns on the shared writer, a write waits while another lock is transmitting
+    // Cancelling drops the keys a paced write has not sent yet, it still finishes with the done callback
+    bool trinket_powerbolt_write(trinket_powerbolt_t *powerbolt, POWERBOLT_KEY_CODES key_code);
+    bool trinket_powerbolt_write_async(trinket_powerbolt_t *powerbolt, const POWERBOLT_KEY_CODES key_codes[], size_t count,
+        uint32_t key_gap_ms);
+    bool trinket_powerbolt_write_paced_async(trinket_powerbolt_t *powerbolt, const POWERBOLT_KEY_CODES key_codes[], size_t count);
+    bool trinket_powerbolt_write_raw_async(trinket_powerbolt_t *powerbolt, const uint8_t commands[], size_t count,
+        uint32_t key_gap_ms);
+    bool trinket_powerbolt_write_cancel(trinket_powerbolt_t *powerbolt);
+    bool trinket_powerbolt_write_busy(trinket_powerbolt_t *powerbolt);
+
+    void trinket_powerbolt_get_stats(trinket_powerbolt_t *powerbolt, trinket_powerbolt_stats_t *stats);
 }
 
 #endif
\ No newline at end of file
@@ -1,2 +1,3 @@
 #define WIFI_SSID               ""
-#define WIFI_PASSWORD           ""
\ No newline at end of file
+#define WIFI_PASSWORD           ""
+#define LOCAL_ENDPOINT_PSK      ""      // Pre-shared key for local commands, empty leaves the local endpoint off
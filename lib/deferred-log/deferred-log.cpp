@@ -0,0 +1,52 @@
+#include "deferred-log.h"
+
+#include <stdio.h>
+#include "mpsc-ring.h"
+
+static const char deferred_log_levels[] = { '-', 'E', 'W', 'I', 'D' };
+
+#if LOG_LEVEL > LOG_LEVEL_NONE
+static mpsc_ring<deferred_log_record_t, DEFERRED_LOG_QUEUE_SIZE> deferred_log_records;
+
+void deferred_log_push(const deferred_log_record_t *record) {
+    deferred_log_records.push(*record);
+}
+
+bool deferred_log_pop(deferred_log_record_t *record) {
+    return deferred_log_records.pop(*record);
+}
+
+uint32_t deferred_log_dropped() {
+    return deferred_log_records.overflow_count();
+}
+#else
+void deferred_log_push(const deferred_log_record_t *) {
+}
+
+bool deferred_log_pop(deferred_log_record_t *) {
+    return false;
+}
+
+uint32_t deferred_log_dropped() {
+    return 0;
+}
+#endif
+
+// Lines start with the time in seconds and the level
+//      12.345 I Bolt locked
+size_t deferred_log_format(const deferred_log_record_t *record, char buffer[], size_t size) {
+    uintptr_t args[DEFERRED_LOG_MAX_ARGS];
+    for (uint8_t i = 0; i < DEFERRED_LOG_MAX_ARGS; i++)
+        args[i] = record->text_args & 1 << i ? (uintptr_t) &record->text[record->args[i]] : record->args[i];
+
+    char level = record->level < sizeof(deferred_log_levels) ? deferred_log_levels[record->level] : '?';
+    int written = snprintf(buffer, size, "%u.%03u %c ", (unsigned) (record->timestamp / 1000),
+        (unsigned) (record->timestamp % 1000), level);
+    if (written < 0 || (size_t) written >= size)
+        return written < 0 ? 0 : size - 1;
+
+    int message = snprintf(&buffer[written], size - written, record->format, args[0], args[1], args[2], args[3]);
+    if (message < 0)
+        return written;
+    return (size_t) (written + message) >= size ? size - 1 : written + message;
+}
@@ -0,0 +1,120 @@
+#ifndef DEFERRED_LOG_H
+#define DEFERRED_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Deferred logging, cheap enough for ISRs and the protocol engine
+// A log call copies the format pointer, its arguments and a timestamp into a lock-free buffer, nothing
+// is formatted or printed by the caller. Whoever drains the buffer (a low priority task on the device)
+// formats the records and writes them out later, in order.
+// Formats are printf style with integer (%d %u %x %c) and string (%s) conversions, no floats
+// Strings have to outlive the record (literals, names and topics), anything else goes through log_text()
+// which copies it into the record, up to DEFERRED_LOG_TEXT_SIZE bytes between all the texts of one record
+// LOG_LEVEL is a build flag so that this library sees it too, calls above it compile to nothing,
+// arguments included. LOG_LEVEL_NONE also leaves out the buffer
+#define LOG_LEVEL_NONE          0
+#define LOG_LEVEL_ERROR         1
+#define LOG_LEVEL_WARN          2
+#define LOG_LEVEL_INFO          3
+#define LOG_LEVEL_DEBUG         4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL               LOG_LEVEL_INFO
+#endif
+
+#define DEFERRED_LOG_MAX_ARGS   4
+#define DEFERRED_LOG_TEXT_SIZE  96
+#define DEFERRED_LOG_QUEUE_SIZE 32      // Must be a power of two
+#define DEFERRED_LOG_LINE_SIZE  160     // Longest formatted line, longer ones are cut short
+
+// Timestamps are millis(), which is safe from ISRs
+#define LOG_AT(level, ...)      do { if (LOG_LEVEL >= (level)) deferred_log_write(millis(), (level), __VA_ARGS__); } while (0)
+#define LOG_ERROR(...)          LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...)           LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...)           LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...)          LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+// Arguments marked in text_args hold an offset into text rather than a value
+typedef struct {
+    const char *format;
+    uint32_t timestamp;
+    uint8_t level;
+    uint8_t text_args;
+    uint8_t text_length;
+    uintptr_t args[DEFERRED_LOG_MAX_ARGS];
+    char text[DEFERRED_LOG_TEXT_SIZE];
+} deferred_log_record_t;
+
+typedef struct {
+    const char *text;
+    size_t length;
+} deferred_log_text_t;
+
+extern "C" {
+    // Safe from ISRs and any task, a full buffer drops the record and counts it
+    // With LOG_LEVEL_NONE there is no buffer, nothing is kept and nothing comes out
+    void deferred_log_push(const deferred_log_record_t *record);
+
+    // Drain side, one caller at a time
+    bool deferred_log_pop(deferred_log_record_t *record);
+    size_t deferred_log_format(const deferred_log_record_t *record, char buffer[], size_t size);
+    uint32_t deferred_log_dropped();
+}
+
+inline deferred_log_text_t log_text(const char *text, size_t length) {
+    deferred_log_text_t copy = { text, length };
+    return copy;
+}
+
+inline deferred_log_text_t log_text(const char *text) {
+    return log_text(text, strlen(text));
+}
+
+template <typename T>
+inline void deferred_log_pack(deferred_log_record_t *record, uint8_t index, T value) {
+    record->args[index] = (uintptr_t) value;
+}
+
+// Texts that no longer fit come out empty
+inline void deferred_log_pack(deferred_log_record_t *record, uint8_t index, deferred_log_text_t value) {
+    size_t room = DEFERRED_LOG_TEXT_SIZE - record->text_length;
+    if (room == 0) {
+        record->args[index] = (uintptr_t) "";
+        return;
+    }
+
+    size_t length = value.length < room - 1 ? value.length : room - 1;
+    memcpy(&record->text[record->text_length], value.text, length);
+    record->text[record->text_length + length] = '\0';
+    record->args[index] = record->text_length;
+    record->text_args |= 1 << index;
+    record->text_length += length + 1;
+}
+
+inline void deferred_log_pack_all(deferred_log_record_t *, uint8_t) {
+}
+
+template <typename T, typename... Args>
+inline void deferred_log_pack_all(deferred_log_record_t *record, uint8_t index, T value, Args... args) {
+    deferred_log_pack(record, index, value);
+    deferred_log_pack_all(record, index + 1, args...);
+}
+
+template <typename... Args>
+inline void deferred_log_write(uint32_t timestamp, uint8_t level, const char *format, Args... args) {
+    static_assert(sizeof...(Args) <= DEFERRED_LOG_MAX_ARGS, "Too many arguments for one log record");
+    deferred_log_record_t record;
+    record.format = format;
+    record.timestamp = timestamp;
+    record.level = level;
+    record.text_args = 0;
+    record.text_length = 0;
+    for (uint8_t i = 0; i < DEFERRED_LOG_MAX_ARGS; i++)
+        record.args[i] = 0;
+    deferred_log_pack_all(&record, 0, args...);
+    deferred_log_push(&record);
+}
+
+#endif
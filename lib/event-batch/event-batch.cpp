@@ -0,0 +1,80 @@
+#include "event-batch.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Longest encoding of a single event
+#define EVENT_BATCH_MAX_BINARY_EVENT    7
+#define EVENT_BATCH_MAX_TEXT_EVENT      28
+
+void event_batch_begin(event_batch_t *batch, EVENT_BATCH_ENCODING encoding) {
+    batch->encoding = encoding;
+    batch->length = 0;
+    batch->count = 0;
+    batch->last_timestamp = 0;
+
+    if (encoding == EVENT_BATCH_TEXT)
+        batch->buffer[batch->length++] = '>';
+}
+
+static void event_batch_add_binary(event_batch_t *batch, EVENT_BATCH_TYPES type, uint8_t data, uint32_t delta) {
+    batch->buffer[batch->length++] = type;
+    batch->buffer[batch->length++] = data;
+
+    // Deltas under 128ms (most of a key press) take a single byte
+    do {
+        uint8_t delta_byte = delta & 0x7F;
+        delta >>= 7;
+        batch->buffer[batch->length++] = delta_byte | (delta ? 0x80 : 0);
+    } while (delta);
+}
+
+static void event_batch_add_text(event_batch_t *batch, EVENT_BATCH_TYPES type, uint8_t data, uint32_t delta) {
+    char *text = (char *) &batch->buffer[batch->length];
+    const char *separator = batch->count == 0 ? " " : ", ";
+    int written;
+
+    if (type == EVENT_FRAME_DEADBOLT || type == EVENT_FRAME_KEYPAD)
+        written = sprintf(text, "%s%c %02x +%u", separator, type == EVENT_FRAME_DEADBOLT ? 'D' : 'K', data, (unsigned) delta);
+    else if (type == EVENT_OVERFLOW)
+        written = sprintf(text, "%soverflow %u +%u", separator, data, (unsigned) delta);
+    else
+        written = sprintf(text, "%s%s +%u", separator, type == EVENT_BOLT_LOCKED ? "locked" : "unlocked", (unsigned) delta);
+
+    batch->length += written;
+}
+
+// Returns false without changing the batch when the event does not fit, the caller should flush and retry
+bool event_batch_add(event_batch_t *batch, EVENT_BATCH_TYPES type, uint8_t data, uint32_t timestamp) {
+    if (batch->encoding == EVENT_BATCH_BINARY) {
+        size_t header = batch->count == 0 ? 5 : 0;
+        if (batch->length + header + EVENT_BATCH_MAX_BINARY_EVENT > EVENT_BATCH_MAX_SIZE)
+            return false;
+
+        // The first event carries the absolute timestamp in the header
+        if (batch->count == 0) {
+            batch->buffer[batch->length++] = EVENT_BATCH_BINARY_VERSION;
+            for (uint8_t i = 0; i < 4; i++)
+                batch->buffer[batch->length++] = timestamp >> (8 * i);
+            batch->last_timestamp = timestamp;
+        }
+    } else {
+        // sprintf also writes a terminator
+        if (batch->length + EVENT_BATCH_MAX_TEXT_EVENT + 1 > EVENT_BATCH_MAX_SIZE)
+            return false;
+
+        if (batch->count == 0)
+            batch->last_timestamp = timestamp;
+    }
+
+    uint32_t delta = timestamp - batch->last_timestamp;
+    batch->last_timestamp = timestamp;
+
+    if (batch->encoding == EVENT_BATCH_BINARY)
+        event_batch_add_binary(batch, type, data, delta);
+    else
+        event_batch_add_text(batch, type, data, delta);
+
+    batch->count++;
+    return true;
+}
@@ -0,0 +1,37 @@
+#ifndef EVENT_BATCH_H
+#define EVENT_BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Largest batch payload, sized so a batch plus topic fits PubSubClient's default 128 byte packet
+#define EVENT_BATCH_MAX_SIZE        96
+#define EVENT_BATCH_BINARY_VERSION  0x01
+
+enum EVENT_BATCH_ENCODING {
+    EVENT_BATCH_TEXT, EVENT_BATCH_BINARY
+};
+
+enum EVENT_BATCH_TYPES {
+    EVENT_FRAME_DEADBOLT, EVENT_FRAME_KEYPAD, EVENT_BOLT_LOCKED, EVENT_BOLT_UNLOCKED, EVENT_OVERFLOW
+};
+
+// Binary layout:
+//      version (1), first timestamp in ms (4, little endian)
+//      per event: type (1), data (1), ms since previous event (LEB128 varint, 1-5)
+// Text layout, for debugging:
+//      > D c4 +0, K 05 +52, locked +10
+typedef struct {
+    EVENT_BATCH_ENCODING encoding;
+    uint8_t buffer[EVENT_BATCH_MAX_SIZE];
+    size_t length;
+    size_t count;
+    uint32_t last_timestamp;
+} event_batch_t;
+
+extern "C" {
+    void event_batch_begin(event_batch_t *batch, EVENT_BATCH_ENCODING encoding);
+    bool event_batch_add(event_batch_t *batch, EVENT_BATCH_TYPES type, uint8_t data, uint32_t timestamp);
+}
+
+#endif
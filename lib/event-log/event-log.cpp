@@ -0,0 +1,94 @@
+#include "event-log.h"
+
+#include <string.h>
+
+// The oldest chunk is kept in memory while it is being read back
+static event_log_entry_t chunk_cache[EVENT_LOG_RTC_ENTRIES];
+static uint32_t chunk_cache_number = 0;
+static bool chunk_cache_valid = false;
+
+void event_log_init(event_log_t *log) {
+    if (log->magic == EVENT_LOG_MAGIC && log->count <= EVENT_LOG_RTC_ENTRIES
+        && log->next_chunk - log->first_chunk <= EVENT_LOG_FLASH_SLOTS && log->chunk_offset < EVENT_LOG_RTC_ENTRIES)
+        return;
+
+    memset(log, 0, sizeof(event_log_t));
+    log->magic = EVENT_LOG_MAGIC;
+}
+
+size_t event_log_pending(const event_log_t *log) {
+    return (log->next_chunk - log->first_chunk) * EVENT_LOG_RTC_ENTRIES - log->chunk_offset + log->count;
+}
+
+static void event_log_drop_chunk(event_log_t *log) {
+    log->dropped += EVENT_LOG_RTC_ENTRIES - log->chunk_offset;
+    log->first_chunk++;
+    log->chunk_offset = 0;
+}
+
+// Moves the RTC buffer to the next flash slot, overwriting the oldest chunk when every slot is used
+static void event_log_spill(event_log_t *log, const event_log_storage_t *storage) {
+    if (log->next_chunk - log->first_chunk >= EVENT_LOG_FLASH_SLOTS)
+        event_log_drop_chunk(log);
+
+    if (storage->write(log->next_chunk % EVENT_LOG_FLASH_SLOTS, log->entries, log->count)) {
+        log->next_chunk++;
+        log->count = 0;
+        return;
+    }
+
+    // Flash is not available, lose the oldest entry instead of the newest
+    memmove(log->entries, log->entries + 1, (log->count - 1) * sizeof(event_log_entry_t));
+    log->count--;
+    log->dropped++;
+}
+
+void event_log_append(event_log_t *log, const event_log_storage_t *storage, uint8_t source, uint8_t type, uint8_t data,
+    uint32_t timestamp) {
+    if (log->count >= EVENT_LOG_RTC_ENTRIES)
+        event_log_spill(log, storage);
+
+    event_log_entry_t *entry = &log->entries[log->count++];
+    entry->timestamp = timestamp;
+    entry->source = source;
+    entry->type = type;
+    entry->data = data;
+}
+
+size_t event_log_peek(event_log_t *log, const event_log_storage_t *storage, event_log_entry_t entries[], size_t max_count) {
+    // Flash chunks are older than anything in RTC memory
+    while (log->first_chunk != log->next_chunk) {
+        if (!chunk_cache_valid || chunk_cache_number != log->first_chunk) {
+            chunk_cache_valid = storage->read(log->first_chunk % EVENT_LOG_FLASH_SLOTS, chunk_cache, EVENT_LOG_RTC_ENTRIES) == EVENT_LOG_RTC_ENTRIES;
+            chunk_cache_number = log->first_chunk;
+        }
+        if (!chunk_cache_valid) {
+            event_log_drop_chunk(log);
+            continue;
+        }
+
+        size_t count = EVENT_LOG_RTC_ENTRIES - log->chunk_offset;
+        count = count < max_count ? count : max_count;
+        memcpy(entries, chunk_cache + log->chunk_offset, count * sizeof(event_log_entry_t));
+        return count;
+    }
+
+    size_t count = log->count < max_count ? log->count : max_count;
+    memcpy(entries, log->entries, count * sizeof(event_log_entry_t));
+    return count;
+}
+
+void event_log_consume(event_log_t *log, size_t count) {
+    if (log->first_chunk != log->next_chunk) {
+        log->chunk_offset += count;
+        if (log->chunk_offset >= EVENT_LOG_RTC_ENTRIES) {
+            log->first_chunk++;
+            log->chunk_offset = 0;
+        }
+        return;
+    }
+
+    count = count < log->count ? count : log->count;
+    memmove(log->entries, log->entries + count, (log->count - count) * sizeof(event_log_entry_t));
+    log->count -= count;
+}
@@ -0,0 +1,56 @@
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Append-only event log that survives deep sleep and network outages
+// New entries go to a small buffer that lives in RTC memory, a full buffer is written to flash as
+// one chunk. Chunks rotate through EVENT_LOG_FLASH_SLOTS slots so no slot is written more often
+// than the others, and flash is only written once per EVENT_LOG_RTC_ENTRIES events rather than on
+// every wake. Entries are read back oldest first and only removed once the caller has sent them.
+// The source tells entries from different producers apart, on the device it is the lock
+#define EVENT_LOG_RTC_ENTRIES       128
+#define EVENT_LOG_FLASH_SLOTS       16
+#define EVENT_LOG_MAGIC             0x6c6f6702
+
+typedef struct {
+    uint32_t timestamp;
+    uint8_t source;
+    uint8_t type;
+    uint8_t data;
+} event_log_entry_t;
+
+// Flash access, implemented by the caller (NVS on the device)
+// Chunks are always EVENT_LOG_RTC_ENTRIES long, read returns the number of entries read
+typedef struct {
+    bool (*write)(uint32_t slot, const event_log_entry_t entries[], size_t count);
+    size_t (*read)(uint32_t slot, event_log_entry_t entries[], size_t max_count);
+} event_log_storage_t;
+
+// Chunks first_chunk to next_chunk - 1 are in flash, chunk n is stored in slot n % EVENT_LOG_FLASH_SLOTS
+// Dropped counts entries lost to a full log or an unreadable chunk, the caller resets it once reported
+typedef struct {
+    uint32_t magic;
+    uint32_t first_chunk;
+    uint32_t next_chunk;
+    uint32_t chunk_offset;
+    uint32_t count;
+    uint32_t dropped;
+    event_log_entry_t entries[EVENT_LOG_RTC_ENTRIES];
+} event_log_t;
+
+extern "C" {
+    // Keeps the entries of a log that survived deep sleep, anything else starts empty
+    void event_log_init(event_log_t *log);
+    void event_log_append(event_log_t *log, const event_log_storage_t *storage, uint8_t source, uint8_t type, uint8_t data,
+        uint32_t timestamp);
+    size_t event_log_pending(const event_log_t *log);
+
+    // Copies up to max_count of the oldest entries without removing them
+    size_t event_log_peek(event_log_t *log, const event_log_storage_t *storage, event_log_entry_t entries[], size_t max_count);
+    // Removes entries returned by the last peek, once they have been sent
+    void event_log_consume(event_log_t *log, size_t count);
+}
+
+#endif
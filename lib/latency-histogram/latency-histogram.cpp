@@ -0,0 +1,58 @@
+#include "latency-histogram.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Longest bucket:count pair, " 15:65535"
+#define LATENCY_HISTOGRAM_MAX_BUCKET_TEXT   9
+
+void latency_histogram_clear(latency_histogram_t *histogram) {
+    memset(histogram, 0, sizeof(latency_histogram_t));
+}
+
+static uint8_t latency_histogram_bucket(uint32_t latency_ms) {
+    uint8_t bucket = 0;
+    while (latency_ms > 0 && bucket < LATENCY_HISTOGRAM_BUCKETS - 1) {
+        latency_ms >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+// Counts saturate rather than wrap, a histogram that is never published still says where time went
+void latency_histogram_record(latency_histogram_t *histogram, uint32_t latency_ms) {
+    uint16_t *bucket = &histogram->buckets[latency_histogram_bucket(latency_ms)];
+    if (*bucket < UINT16_MAX)
+        (*bucket)++;
+    if (histogram->count < UINT32_MAX)
+        histogram->count++;
+    histogram->sum_ms = UINT32_MAX - histogram->sum_ms < latency_ms ? UINT32_MAX : histogram->sum_ms + latency_ms;
+    if (latency_ms > histogram->max_ms)
+        histogram->max_ms = latency_ms;
+}
+
+size_t latency_histogram_format(const latency_histogram_t *histogram, const char *name, char buffer[], size_t size,
+    uint8_t *next_bucket) {
+    int written;
+    if (*next_bucket == 0)
+        written = snprintf(buffer, size, "> latency %s n=%u sum=%u max=%u", name, (unsigned) histogram->count,
+            (unsigned) histogram->sum_ms, (unsigned) histogram->max_ms);
+    else
+        written = snprintf(buffer, size, "> latency %s", name);
+    if (written < 0 || (size_t) written + LATENCY_HISTOGRAM_MAX_BUCKET_TEXT >= size) {
+        *next_bucket = LATENCY_HISTOGRAM_BUCKETS;
+        return written < 0 ? 0 : strnlen(buffer, size);
+    }
+
+    size_t length = written;
+    uint8_t bucket = *next_bucket;
+    for (; bucket < LATENCY_HISTOGRAM_BUCKETS; bucket++) {
+        if (histogram->buckets[bucket] == 0)
+            continue;
+        if (length + LATENCY_HISTOGRAM_MAX_BUCKET_TEXT >= size)
+            break;
+        length += sprintf(&buffer[length], " %u:%u", bucket, histogram->buckets[bucket]);
+    }
+    *next_bucket = bucket;
+    return length;
+}
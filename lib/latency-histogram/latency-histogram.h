@@ -0,0 +1,34 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Log2 histogram of latencies in ms, small enough to keep in RTC memory across deep sleep
+// Bucket 0 counts latencies under 1ms and bucket n counts [2^(n-1), 2^n) ms, the last bucket also
+// takes everything longer (16s and up). Histograms from different devices or periods add up bucket by bucket.
+#define LATENCY_HISTOGRAM_BUCKETS   16
+
+typedef struct {
+    uint32_t count;
+    uint32_t sum_ms;
+    uint32_t max_ms;
+    uint16_t buckets[LATENCY_HISTOGRAM_BUCKETS];
+} latency_histogram_t;
+
+// Text layout, one histogram per message with only the buckets that are not empty, as bucket:count
+//      > latency result n=12 sum=15800 max=2150 9:3 10:7 11:2
+// Buckets that do not fit go into further messages without the totals
+//      > latency result 12:1 13:4
+extern "C" {
+    void latency_histogram_clear(latency_histogram_t *histogram);
+    void latency_histogram_record(latency_histogram_t *histogram, uint32_t latency_ms);
+
+    // Writes one message starting at *next_bucket (0 for the first) and moves it past the buckets that
+    // were written, the histogram is done once it reaches LATENCY_HISTOGRAM_BUCKETS
+    // The size must leave room for the totals and one bucket, 80 bytes is plenty
+    size_t latency_histogram_format(const latency_histogram_t *histogram, const char *name, char buffer[], size_t size,
+        uint8_t *next_bucket);
+}
+
+#endif
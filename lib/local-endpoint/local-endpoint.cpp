@@ -0,0 +1,179 @@
+#include "local-endpoint.h"
+
+#include <string.h>
+#include "mbedtls/md.h"
+
+static const char local_hex[] = "0123456789abcdef";
+
+static int8_t local_hex_digit(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+size_t local_session_begin(local_session_t *session, const uint8_t nonce[LOCAL_NONCE_SIZE], char challenge[]) {
+    session->state = LOCAL_SESSION_CHALLENGED;
+    memcpy(session->nonce, nonce, LOCAL_NONCE_SIZE);
+    session->received_lines = 0;
+    session->sent_lines = 0;
+    session->line_length = 0;
+    session->line_overflow = false;
+    session->line_complete = false;
+
+    size_t length = 0;
+    memcpy(challenge, "> challenge ", 12);
+    length += 12;
+    for (size_t i = 0; i < LOCAL_NONCE_SIZE; i++) {
+        challenge[length++] = local_hex[nonce[i] >> 4];
+        challenge[length++] = local_hex[nonce[i] & 0xF];
+    }
+    challenge[length++] = '\n';
+    return length;
+}
+
+bool local_session_feed(local_session_t *session, uint8_t byte) {
+    if (session->line_complete) {
+        session->line_length = 0;
+        session->line_complete = false;
+    }
+    if (byte == '\r')
+        return false;
+
+    if (byte != '\n') {
+        if (session->line_length < LOCAL_LINE_MAX)
+            session->line[session->line_length++] = byte;
+        else
+            session->line_overflow = true;
+        return false;
+    }
+
+    session->line[session->line_length] = '\0';
+    session->line_complete = true;
+    bool overflow = session->line_overflow;
+    session->line_overflow = false;
+    return !overflow;
+}
+
+// Every byte is compared whatever the result, so the time taken says nothing about how much matched
+bool local_session_authenticate(local_session_t *session, const char *psk) {
+    const char *text = session->line;
+    if (session->line_length != 5 + LOCAL_HMAC_SIZE * 2 || strncmp(text, "auth ", 5) != 0)
+        return false;
+
+    uint8_t expected[LOCAL_HMAC_SIZE];
+    const mbedtls_md_info_t *sha256 = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+    if (sha256 == NULL || psk[0] == '\0'
+        || mbedtls_md_hmac(sha256, (const unsigned char *) psk, strlen(psk), session->nonce, LOCAL_NONCE_SIZE, expected) != 0)
+        return false;
+
+    uint8_t difference = 0;
+    for (size_t i = 0; i < LOCAL_HMAC_SIZE; i++) {
+        int8_t high = local_hex_digit(text[5 + i * 2]);
+        int8_t low = local_hex_digit(text[5 + i * 2 + 1]);
+        if (high < 0 || low < 0)
+            return false;
+        difference |= expected[i] ^ (high << 4 | low);
+    }
+    if (difference != 0)
+        return false;
+
+    session->state = LOCAL_SESSION_AUTHENTICATED;
+    return true;
+}
+
+// HMAC of the nonce, the direction, the line number and the line, cut to LOCAL_TAG_SIZE
+static bool local_line_tag(const local_session_t *session, const char *psk, char direction, uint32_t number,
+    const char *line, size_t length, uint8_t tag[LOCAL_TAG_SIZE]) {
+    uint8_t message[LOCAL_NONCE_SIZE + 5 + LOCAL_TAGGED_MAX];
+    if (length > LOCAL_TAGGED_MAX)
+        return false;
+    memcpy(message, session->nonce, LOCAL_NONCE_SIZE);
+    message[LOCAL_NONCE_SIZE] = direction;
+    for (uint8_t i = 0; i < 4; i++)
+        message[LOCAL_NONCE_SIZE + 1 + i] = number >> (24 - i * 8);
+    memcpy(&message[LOCAL_NONCE_SIZE + 5], line, length);
+
+    uint8_t hmac[LOCAL_HMAC_SIZE];
+    const mbedtls_md_info_t *sha256 = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+    if (sha256 == NULL || psk[0] == '\0'
+        || mbedtls_md_hmac(sha256, (const unsigned char *) psk, strlen(psk), message, LOCAL_NONCE_SIZE + 5 + length, hmac) != 0)
+        return false;
+    memcpy(tag, hmac, LOCAL_TAG_SIZE);
+    return true;
+}
+
+// Compared in constant time like the auth line
+const char *local_session_verify(local_session_t *session, const char *psk) {
+    const char *text = session->line;
+    const size_t tag_length = LOCAL_TAG_SIZE * 2 + 1;
+    if (session->state != LOCAL_SESSION_AUTHENTICATED || session->line_length < tag_length || text[tag_length - 1] != ' ')
+        return NULL;
+
+    uint8_t expected[LOCAL_TAG_SIZE];
+    if (!local_line_tag(session, psk, 'c', session->received_lines, &text[tag_length], session->line_length - tag_length, expected))
+        return NULL;
+
+    uint8_t difference = 0;
+    for (size_t i = 0; i < LOCAL_TAG_SIZE; i++) {
+        int8_t high = local_hex_digit(text[i * 2]);
+        int8_t low = local_hex_digit(text[i * 2 + 1]);
+        if (high < 0 || low < 0)
+            return NULL;
+        difference |= expected[i] ^ (high << 4 | low);
+    }
+    if (difference != 0)
+        return NULL;
+
+    session->received_lines++;
+    return &text[tag_length];
+}
+
+size_t local_session_seal(local_session_t *session, const char *psk, const char *line, size_t length, char out[]) {
+    if (length > LOCAL_TAGGED_MAX)
+        length = LOCAL_TAGGED_MAX;
+
+    uint8_t tag[LOCAL_TAG_SIZE];
+    if (!local_line_tag(session, psk, 'd', session->sent_lines, line, length, tag))
+        return 0;
+    session->sent_lines++;
+
+    size_t used = 0;
+    for (size_t i = 0; i < LOCAL_TAG_SIZE; i++) {
+        out[used++] = local_hex[tag[i] >> 4];
+        out[used++] = local_hex[tag[i] & 0xF];
+    }
+    out[used++] = ' ';
+    memcpy(&out[used], line, length);
+    used += length;
+    out[used++] = '\n';
+    return used;
+}
+
+size_t local_format_message(const char *topic, const uint8_t *payload, size_t length, char out[], size_t size) {
+    bool printable = true;
+    for (size_t i = 0; i < length && printable; i++)
+        printable = payload[i] >= ' ' && payload[i] < 0x7F;
+
+    // Room is kept for the \n
+    size_t used = 0;
+    for (const char *c = topic; *c != '\0' && used + 2 < size; c++)
+        out[used++] = *c;
+    if (used + 2 < size)
+        out[used++] = ' ';
+    if (!printable && used + 2 < size)
+        out[used++] = '#';
+    for (size_t i = 0; i < length; i++) {
+        if (printable && used + 2 < size)
+            out[used++] = payload[i];
+        else if (!printable && used + 3 < size) {
+            out[used++] = local_hex[payload[i] >> 4];
+            out[used++] = local_hex[payload[i] & 0xF];
+        }
+    }
+    out[used++] = '\n';
+    return used;
+}
@@ -0,0 +1,66 @@
+#ifndef LOCAL_ENDPOINT_H
+#define LOCAL_ENDPOINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Line protocol for commands over the local network, next to the MQTT broker
+// Every line ends in \n, lines from the device start with > or a topic
+//      device: > challenge <nonce, 32 hex digits>
+//      client: auth <HMAC-SHA256 of the 16 nonce bytes keyed with the pre-shared key, 64 hex digits>
+//      device: > ok                        (or > denied, then the connection is closed)
+//      client: <tag> DB1234@7              (command for the first lock, same syntax as MQTT)
+//      client: <tag> back DB1234@8         (command for the lock named back)
+//      device: <tag> trinket-esp32-1 > result code accepted @7
+// After auth the device sends everything it publishes on the lock topics as <topic> <payload>, binary
+// payloads as # and hex digits
+// Every line after auth starts with a tag, 32 hex digits: the first 16 bytes of the HMAC-SHA256 keyed
+// with the pre-shared key of the nonce, c (client) or d (device), the number of lines already sent that
+// way in the session as 4 bytes big endian, and the line. A line with a bad tag ends the session, so
+// lines can not be injected, changed, replayed or reordered
+#define LOCAL_NONCE_SIZE        16
+#define LOCAL_LINE_MAX          128     // Fits the auth line and a tagged command
+#define LOCAL_HMAC_SIZE         32
+#define LOCAL_TAG_SIZE          16
+#define LOCAL_TAGGED_MAX        256     // Longest line that is tagged, without the tag
+#define LOCAL_CHALLENGE_SIZE    (12 + LOCAL_NONCE_SIZE * 2 + 1)
+
+enum LOCAL_SESSION_STATES {
+    LOCAL_SESSION_CHALLENGED, LOCAL_SESSION_AUTHENTICATED
+};
+
+// Lines longer than LOCAL_LINE_MAX are dropped whole, a complete line stays until the next byte
+typedef struct {
+    LOCAL_SESSION_STATES state;
+    uint8_t nonce[LOCAL_NONCE_SIZE];
+    uint32_t received_lines;
+    uint32_t sent_lines;
+    char line[LOCAL_LINE_MAX + 1];
+    size_t line_length;
+    bool line_overflow;
+    bool line_complete;
+} local_session_t;
+
+extern "C" {
+    // Starts a session on a new connection, the challenge line (LOCAL_CHALLENGE_SIZE bytes, not terminated)
+    // is written to challenge[] and its length returned
+    size_t local_session_begin(local_session_t *session, const uint8_t nonce[LOCAL_NONCE_SIZE], char challenge[]);
+
+    // Collects one received byte, returns true once a line is complete in session->line (without \r\n)
+    bool local_session_feed(local_session_t *session, uint8_t byte);
+
+    // Checks an auth line against the nonce, the session is authenticated when it matches
+    bool local_session_authenticate(local_session_t *session, const char *psk);
+
+    // Checks the tag on the received line, returns the text after it or NULL when the tag is wrong
+    const char *local_session_verify(local_session_t *session, const char *psk);
+
+    // Puts the tag in front of a line (without \n, cut to LOCAL_TAGGED_MAX) and ends it with \n
+    // out[] needs LOCAL_TAG_SIZE * 2 + 2 bytes more than the line, returns the length written
+    size_t local_session_seal(local_session_t *session, const char *psk, const char *line, size_t length, char out[]);
+
+    // Formats a published message as one line, cut short when it does not fit
+    size_t local_format_message(const char *topic, const uint8_t *payload, size_t length, char out[], size_t size);
+}
+
+#endif
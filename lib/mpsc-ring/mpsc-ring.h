@@ -0,0 +1,88 @@
+#ifndef MPSC_RING_H
+#define MPSC_RING_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Lock-free multi-producer/single-consumer ring buffer
+// Producers can be ISRs on either core and any task, they claim a slot with a compare and swap and never
+// wait for each other or for the consumer. Each slot carries a sequence number that says whether it is
+// free, being written or ready, so a producer interrupted halfway only holds up the consumer at that slot.
+// Indices run freely and are only wrapped when indexing, so SIZE must be a power of two
+template <typename T, size_t SIZE>
+class mpsc_ring {
+    static_assert(SIZE > 0 && (SIZE & (SIZE - 1)) == 0, "mpsc_ring size must be a power of two");
+
+public:
+    mpsc_ring() : head(0), tail(0), overflows(0) {
+        for (size_t i = 0; i < SIZE; i++)
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    // Producer: returns false and counts an overflow when the ring is full
+    bool push(const T &value) {
+        uint32_t position = head.load(std::memory_order_relaxed);
+        slot_t *slot;
+        for (;;) {
+            slot = &slots[position & (SIZE - 1)];
+            int32_t difference = slot->sequence.load(std::memory_order_acquire) - position;
+            if (difference == 0) {
+                if (head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (difference < 0) {
+                overflows.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            else
+                position = head.load(std::memory_order_relaxed);
+        }
+
+        slot->value = value;
+
+        // Publish the slot only after it has been written
+        slot->sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer: returns false when the ring is empty or the oldest slot is still being written
+    bool pop(T &value) {
+        uint32_t position = tail.load(std::memory_order_relaxed);
+        slot_t *slot = &slots[position & (SIZE - 1)];
+        if (slot->sequence.load(std::memory_order_acquire) != position + 1)
+            return false;
+
+        value = slot->value;
+
+        // Hand the slot back to the producers for the next lap only after it has been copied
+        slot->sequence.store(position + SIZE, std::memory_order_release);
+        tail.store(position + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    bool empty() const {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+
+    size_t capacity() const {
+        return SIZE;
+    }
+
+    uint32_t overflow_count() const {
+        return overflows.load(std::memory_order_relaxed);
+    }
+
+private:
+    typedef struct {
+        std::atomic<uint32_t> sequence;
+        T value;
+    } slot_t;
+
+    slot_t slots[SIZE];
+    std::atomic<uint32_t> head;
+    std::atomic<uint32_t> tail;
+    std::atomic<uint32_t> overflows;
+};
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef NATIVE_HAL_ARDUINO_H
+#define NATIVE_HAL_ARDUINO_H
+
+// Thin host stand-in for Arduino.h/esp32-hal.h, only what the protocol libraries use
+// Only built by the native environment, see library.json
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t byte;
+
+// Same layout as esp32-hal-rmt.h
+typedef struct {
+    union {
+        struct {
+            uint32_t duration0 :15;
+            uint32_t level0 :1;
+            uint32_t duration1 :15;
+            uint32_t level1 :1;
+        };
+        uint32_t val;
+    };
+} rmt_data_t;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+
+#endif
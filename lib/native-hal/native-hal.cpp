@@ -0,0 +1,18 @@
+#include "Arduino.h"
+
+#include <chrono>
+#include <thread>
+
+static const std::chrono::steady_clock::time_point native_hal_start = std::chrono::steady_clock::now();
+
+unsigned long millis() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - native_hal_start).count();
+}
+
+unsigned long micros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - native_hal_start).count();
+}
+
+void delay(unsigned long ms) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
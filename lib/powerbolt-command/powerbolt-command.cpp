@@ -0,0 +1,174 @@
+#include "powerbolt-command.h"
+
+// Keypad buttons carry two digits each
+static const POWERBOLT_KEY_CODES command_key_map[] = {
+    KEY_90, KEY_12, KEY_12, KEY_34, KEY_34, KEY_56, KEY_56, KEY_78, KEY_78, KEY_90
+};
+
+static int8_t command_hex_digit(uint8_t c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+// Raw command bytes as hex pairs (DB#D4), for probing codes that have no key
+static void command_parse_raw(const uint8_t *payload, size_t length, powerbolt_command_t *command) {
+    command->type = COMMAND_RAW;
+    for (size_t i = 3; i + 1 < length && command->count < POWERBOLT_COMMAND_MAX_KEYS; i += 2) {
+        int8_t high = command_hex_digit(payload[i]);
+        int8_t low = command_hex_digit(payload[i + 1]);
+        if (high < 0 || low < 0)
+            break;
+        command->raw[command->count++] = high << 4 | low;
+    }
+}
+
+static void command_parse_keys(const uint8_t *payload, size_t length, powerbolt_command_t *command) {
+    command->type = COMMAND_KEYS;
+    for (size_t i = 2; i < length && command->count < POWERBOLT_COMMAND_MAX_KEYS; i++) {
+        const uint8_t payload_byte = payload[i];
+        // 0 - 9, L, X (Deadbolt)
+        if (payload_byte >= '0' && payload_byte <= '9')
+            command->keys[command->count++] = command_key_map[payload_byte - '0'];
+        else if (payload_byte == 'L') {
+            command->keys[command->count++] = KEY_LOCK;
+            command->priority = COMMAND_PRIORITY_LOCK;
+        }
+        else if (payload_byte == 'X')
+            command->keys[command->count++] = KEY_HIDDEN;
+
+        // Get status, don't continue processing
+        else if (payload_byte == '?') {
+            command->status = true;
+            break;
+        }
+
+        // If a character can not be processed, do not continue processing
+        else
+            break;
+    }
+
+    // A bare status query is its own command so it does not wait behind writes
+    if (command->count == 0 && command->status) {
+        command->type = COMMAND_STATUS;
+        command->priority = COMMAND_PRIORITY_STATUS;
+    }
+}
+
+// Splits off the @<id> suffix, returns the length of the payload before it
+static size_t command_parse_id(const uint8_t *payload, size_t length, powerbolt_command_t *command) {
+    size_t at = 2;
+    while (at < length && payload[at] != '@')
+        at++;
+    if (at >= length || at + 1 >= length)
+        return at;
+
+    uint32_t id = 0;
+    for (size_t i = at + 1; i < length; i++) {
+        if (payload[i] < '0' || payload[i] > '9' || id > 6553)
+            return at;
+        id = id * 10 + payload[i] - '0';
+    }
+    if (id > 0xFFFF)
+        return at;
+
+    command->id = id;
+    command->has_id = true;
+    return at;
+}
+
+bool powerbolt_command_parse(const uint8_t *payload, size_t length, powerbolt_command_t *command) {
+    command->type = COMMAND_NONE;
+    command->priority = COMMAND_PRIORITY_KEYS;
+    command->id = 0;
+    command->has_id = false;
+    command->count = 0;
+    command->status = false;
+    command->received = 0;
+
+    if (length < 2 || length > POWERBOLT_COMMAND_MAX_LENGTH || payload[0] != 'D' || payload[1] != 'B')
+        return false;
+
+    length = command_parse_id(payload, length, command);
+
+    if (length > 2 && payload[2] == '#')
+        command_parse_raw(payload, length, command);
+    else if (length > 2 && payload[2] == '!')
+        command->type = COMMAND_CANCEL;
+    else
+        command_parse_keys(payload, length, command);
+
+    return true;
+}
+
+bool powerbolt_command_is_write(const powerbolt_command_t *command) {
+    return (command->type == COMMAND_KEYS || command->type == COMMAND_RAW) && command->count > 0;
+}
+
+void powerbolt_command_queue_init(powerbolt_command_queue_t *queue) {
+    queue->count = 0;
+    queue->next_arrival = 0;
+}
+
+static void command_queue_remove(powerbolt_command_queue_t *queue, size_t index) {
+    queue->count--;
+    for (size_t i = index; i < queue->count; i++) {
+        queue->commands[i] = queue->commands[i + 1];
+        queue->arrivals[i] = queue->arrivals[i + 1];
+    }
+}
+
+bool powerbolt_command_queue_push(powerbolt_command_queue_t *queue, const powerbolt_command_t *command,
+    uint16_t superseded[], size_t *superseded_count) {
+    *superseded_count = 0;
+
+    bool write = powerbolt_command_is_write(command);
+    for (size_t i = 0; i < queue->count;) {
+        const powerbolt_command_t *queued = &queue->commands[i];
+        if ((write && powerbolt_command_is_write(queued)) || (command->type == COMMAND_STATUS && queued->type == COMMAND_STATUS)) {
+            superseded[(*superseded_count)++] = queued->id;
+            command_queue_remove(queue, i);
+        }
+        else
+            i++;
+    }
+
+    if (queue->count >= POWERBOLT_COMMAND_QUEUE_SIZE)
+        return false;
+
+    queue->commands[queue->count] = *command;
+    queue->arrivals[queue->count] = queue->next_arrival++;
+    queue->count++;
+    return true;
+}
+
+bool powerbolt_command_queue_pop(powerbolt_command_queue_t *queue, bool allow_writes, powerbolt_command_t *command) {
+    size_t best = queue->count;
+    for (size_t i = 0; i < queue->count; i++) {
+        const powerbolt_command_t *queued = &queue->commands[i];
+        if (!allow_writes && powerbolt_command_is_write(queued))
+            continue;
+        if (best == queue->count || queued->priority > queue->commands[best].priority
+            || (queued->priority == queue->commands[best].priority && (int32_t) (queue->arrivals[i] - queue->arrivals[best]) < 0))
+            best = i;
+    }
+
+    if (best == queue->count)
+        return false;
+
+    *command = queue->commands[best];
+    command_queue_remove(queue, best);
+    return true;
+}
+
+size_t powerbolt_command_queue_clear(powerbolt_command_queue_t *queue, uint16_t cancelled[]) {
+    size_t count = queue->count;
+    for (size_t i = 0; i < count; i++)
+        cancelled[i] = queue->commands[i].id;
+    queue->count = 0;
+    return count;
+}
@@ -0,0 +1,69 @@
+#ifndef POWERBOLT_COMMAND_H
+#define POWERBOLT_COMMAND_H
+
+#include "powerbolt-protocol.h"
+
+// Longest MQTT command payload and the most keys or raw bytes one command can hold
+#define POWERBOLT_COMMAND_MAX_LENGTH    20
+#define POWERBOLT_COMMAND_MAX_KEYS      20
+#define POWERBOLT_COMMAND_QUEUE_SIZE    8
+
+enum POWERBOLT_COMMAND_TYPES {
+    COMMAND_NONE, COMMAND_KEYS, COMMAND_RAW, COMMAND_STATUS, COMMAND_CANCEL
+};
+
+// Higher runs first, a lock request goes ahead of codes and both go ahead of status queries
+enum POWERBOLT_COMMAND_PRIORITIES {
+    COMMAND_PRIORITY_STATUS, COMMAND_PRIORITY_KEYS, COMMAND_PRIORITY_LOCK
+};
+
+// Protocol, every command starts with DB for deadbolt so responses in the channel are never commands:
+//      Deadbolt: 0 - 9, L = lock button, X = unpressable button, #XX.. = raw command bytes
+//      General: ? = locked status, ! = cancel everything queued and the write in progress
+//      Any command can end in @<id> (0 - 65535), the id is echoed in its results
+// Keys are collected up to the first character that can not be processed, ? stops processing too
+// Received is the time in ms the command arrived, set by the caller and kept through the queue for tracing
+typedef struct {
+    POWERBOLT_COMMAND_TYPES type;
+    POWERBOLT_COMMAND_PRIORITIES priority;
+    uint16_t id;
+    bool has_id;
+    size_t count;
+    POWERBOLT_KEY_CODES keys[POWERBOLT_COMMAND_MAX_KEYS];
+    uint8_t raw[POWERBOLT_COMMAND_MAX_KEYS];
+    bool status;
+    uint32_t received;
+} powerbolt_command_t;
+
+// Bounded queue of parsed commands, ordered by priority then arrival
+// Not thread safe, callers serialise access
+typedef struct {
+    powerbolt_command_t commands[POWERBOLT_COMMAND_QUEUE_SIZE];
+    uint32_t arrivals[POWERBOLT_COMMAND_QUEUE_SIZE];
+    size_t count;
+    uint32_t next_arrival;
+} powerbolt_command_queue_t;
+
+extern "C" {
+    // Returns false for payloads that are not commands
+    bool powerbolt_command_parse(const uint8_t *payload, size_t length, powerbolt_command_t *command);
+
+    // Commands that write to the deadbolt
+    bool powerbolt_command_is_write(const powerbolt_command_t *command);
+
+    void powerbolt_command_queue_init(powerbolt_command_queue_t *queue);
+
+    // A new write supersedes every queued write and a new status query supersedes a queued one, only the
+    // latest intent is kept. The ids of superseded commands are written to superseded[] (up to the queue
+    // size) and their count to superseded_count. Returns false when the queue is full.
+    bool powerbolt_command_queue_push(powerbolt_command_queue_t *queue, const powerbolt_command_t *command,
+        uint16_t superseded[], size_t *superseded_count);
+
+    // Takes the highest priority command, writes are skipped while allow_writes is false
+    bool powerbolt_command_queue_pop(powerbolt_command_queue_t *queue, bool allow_writes, powerbolt_command_t *command);
+
+    // Empties the queue, the ids of the dropped commands are written to cancelled[]
+    size_t powerbolt_command_queue_clear(powerbolt_command_queue_t *queue, uint16_t cancelled[]);
+}
+
+#endif
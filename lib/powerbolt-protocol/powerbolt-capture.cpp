@@ -0,0 +1,86 @@
+#include "powerbolt-capture.h"
+
+typedef struct {
+    uint8_t level;
+    bool receiving;
+    uint32_t elapsed_ticks;
+    uint64_t edge_ns;
+    uint32_t symbols[POWERBOLT_CAPTURE_MAX_RUN];
+    size_t items;
+} capture_port_t;
+
+// Appends one level/duration item, two items make one 32 bit RMT symbol
+static void capture_item(capture_port_t *port, uint8_t level, uint32_t ticks) {
+    size_t word = port->items / 2;
+    if (word >= POWERBOLT_CAPTURE_MAX_RUN)
+        return;
+
+    uint32_t item = (ticks > POWERBOLT_MAX_DURATION_TICKS ? POWERBOLT_MAX_DURATION_TICKS : ticks) | (uint32_t) level << 15;
+    if (port->items % 2 == 0)
+        port->symbols[word] = item;
+    else
+        port->symbols[word] |= item << 16;
+    port->items++;
+}
+
+// The receiver stores the level that timed out with a duration of 0 and ends the run
+static size_t capture_end_run(capture_port_t *port, uint8_t number, uint64_t end_ns, powerbolt_capture_run_t callback) {
+    capture_item(port, port->level, 0);
+    port->receiving = false;
+    callback(number, port->symbols, (port->items + 1) / 2, end_ns);
+    port->items = 0;
+    return 1;
+}
+
+size_t powerbolt_capture_runs(const uint32_t records[], size_t count, uint32_t sample_ns, uint32_t tick_ns,
+    uint32_t idle_ticks, powerbolt_capture_run_t callback) {
+    static const uint32_t level_bits[2] = { POWERBOLT_CAPTURE_PORT0, POWERBOLT_CAPTURE_PORT1 };
+    capture_port_t ports[2];
+    memset(ports, 0, sizeof(ports));
+
+    size_t runs = 0;
+    uint64_t time_ns = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t record = records[i] & 0xFFFF;
+        uint32_t samples = record & POWERBOLT_CAPTURE_SAMPLES_MAX;
+        uint32_t ticks = samples >= POWERBOLT_CAPTURE_SAMPLES_MAX ? UINT32_MAX : (uint64_t) samples * sample_ns / tick_ns;
+        time_ns += (uint64_t) samples * sample_ns;
+
+        for (uint8_t n = 0; n < 2; n++) {
+            capture_port_t *port = &ports[n];
+            port->elapsed_ticks = ticks == UINT32_MAX || port->elapsed_ticks + ticks < port->elapsed_ticks ?
+                UINT32_MAX : port->elapsed_ticks + ticks;
+
+            // The receiver gave up idle_ticks after the last edge
+            if (port->receiving && port->elapsed_ticks > idle_ticks)
+                runs += capture_end_run(port, n, port->edge_ns + (uint64_t) idle_ticks * tick_ns, callback);
+
+            uint8_t level = (record & level_bits[n]) != 0;
+            if (level == port->level)
+                continue;
+
+            // A run starts on an edge, the level before it is not part of the run
+            if (port->receiving)
+                capture_item(port, port->level, port->elapsed_ticks == 0 ? 1 : port->elapsed_ticks);
+            port->receiving = true;
+            port->level = level;
+            port->elapsed_ticks = 0;
+            port->edge_ns = time_ns;
+        }
+    }
+
+    // Whatever was still being received when capture stopped ends as if the line went idle
+    for (uint8_t n = 0; n < 2; n++) {
+        if (ports[n].receiving)
+            runs += capture_end_run(&ports[n], n, time_ns, callback);
+    }
+
+    return runs;
+}
+
+uint64_t powerbolt_capture_duration_ns(const uint32_t records[], size_t count, uint32_t sample_ns) {
+    uint64_t samples = 0;
+    for (size_t i = 0; i < count; i++)
+        samples += records[i] & POWERBOLT_CAPTURE_SAMPLES_MAX;
+    return samples * sample_ns;
+}
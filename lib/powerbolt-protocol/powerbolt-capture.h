@@ -0,0 +1,39 @@
+#ifndef POWERBOLT_CAPTURE_H
+#define POWERBOLT_CAPTURE_H
+
+#include "powerbolt-protocol.h"
+
+// Edge records sampled by the ULP while the main cores are in deep sleep
+// Each record holds the level of both lines after an edge and the number of samples since the
+// previous edge, in the low 16 bits (the ULP can only store half words)
+//      bits 0-10   samples, saturates at POWERBOLT_CAPTURE_SAMPLES_MAX
+//      bit 11      port 0 level (deadbolt)
+//      bit 15      port 1 level (keypad)
+#define POWERBOLT_CAPTURE_SAMPLES_MAX   0x7FF
+#define POWERBOLT_CAPTURE_LEVEL_SHIFT   11
+#define POWERBOLT_CAPTURE_PORT0         (1 << 11)
+#define POWERBOLT_CAPTURE_PORT1         (1 << 15)
+#define POWERBOLT_CAPTURE_MAX_RUN       32
+#define POWERBOLT_CAPTURE_SAMPLE_NS     6000    // One pass of the capture loop, 8 instructions at the 8MHz RTC clock
+// Idle threshold for replaying records, in 10us reader ticks. The RTC clock can be 30% off either way,
+// which stretches the longest data level (0.7ms) to 1.02ms and shrinks the start low (1.4ms) to 1.08ms
+#define POWERBOLT_CAPTURE_IDLE_TICKS    104
+
+// Called for every run, in the order the runs ended
+// end_ns is when the receiver would have delivered the run, counted from the first record
+typedef void (*powerbolt_capture_run_t)(uint8_t port, uint32_t *symbols, size_t len, uint64_t end_ns);
+
+extern "C" {
+    // Turns edge records into the runs an RMT receiver with the same idle threshold would have
+    // delivered, so they can go through the normal decoder. A saturated count is treated as idle.
+    // Returns the number of runs
+    size_t powerbolt_capture_runs(const uint32_t records[], size_t count, uint32_t sample_ns, uint32_t tick_ns,
+        uint32_t idle_ticks, powerbolt_capture_run_t callback);
+
+    // Time covered by the records, the ULP has no clock so this is the sample counts times the sample
+    // period. A saturated count only adds POWERBOLT_CAPTURE_SAMPLES_MAX samples, the ULP slept through
+    // the rest of that gap
+    uint64_t powerbolt_capture_duration_ns(const uint32_t records[], size_t count, uint32_t sample_ns);
+}
+
+#endif
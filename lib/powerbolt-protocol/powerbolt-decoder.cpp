@@ -0,0 +1,126 @@
+#include "powerbolt-decoder.h"
+
+#define SYMBOL_LEVEL0(symbol)       (((symbol) >> 15) & 1)
+#define SYMBOL_DURATION0(symbol)    ((symbol) & 0x7FFF)
+#define SYMBOL_LEVEL1(symbol)       (((symbol) >> 31) & 1)
+#define SYMBOL_DURATION1(symbol)    (((symbol) >> 16) & 0x7FFF)
+
+// Start bit is 30ms high, anything this long resynchronises the decoder
+#define START_MIN_TICKS             (8 * POWERBOLT_DECODER_NOMINAL_PERIOD)
+
+void powerbolt_decoder_init(powerbolt_decoder_t *decoder) {
+    memset(decoder, 0, sizeof(powerbolt_decoder_t));
+    decoder->bit_period = POWERBOLT_DECODER_NOMINAL_PERIOD;
+}
+
+// Stop bit is a short high followed by a low that is either too long for the receiver (0) or
+// much longer than a bit when two frames were merged into one run
+static bool powerbolt_decoder_is_stop(uint32_t symbol, uint16_t bit_period) {
+    uint32_t duration0 = SYMBOL_DURATION0(symbol);
+    uint32_t duration1 = SYMBOL_DURATION1(symbol);
+    return SYMBOL_LEVEL0(symbol) == 1 && duration0 > 0 && duration0 < bit_period
+        && (duration1 == 0 || duration1 > 3 * (uint32_t) bit_period);
+}
+
+// Decodes the 8 buffered data bits using their own average period
+static powerbolt_read_t powerbolt_decoder_decode(powerbolt_decoder_t *decoder, uint32_t stop_symbol) {
+    powerbolt_read_t result;
+    result.data = 0;
+    result.valid = false;
+    result.confidence = 0;
+
+    uint32_t total = 0;
+    for (uint8_t i = 0; i < 8; i++)
+        total += SYMBOL_DURATION0(decoder->symbols[i]) + SYMBOL_DURATION1(decoder->symbols[i]);
+    uint32_t period = total / 8;
+    if (period < POWERBOLT_DECODER_MIN_PERIOD || period > POWERBOLT_DECODER_MAX_PERIOD)
+        return result;
+
+    // Stop bit high is a short half
+    if (SYMBOL_DURATION0(stop_symbol) * 2 > period)
+        return result;
+
+    // Every bit must be within 25% of the period, its value is whichever half is longer
+    // Confidence is the smallest high/low split, scaled so the nominal 30/70 split is 127
+    uint32_t min_margin = period;
+    uint8_t data = 0;
+    for (uint8_t i = 0; i < 8; i++) {
+        uint32_t duration0 = SYMBOL_DURATION0(decoder->symbols[i]);
+        uint32_t duration1 = SYMBOL_DURATION1(decoder->symbols[i]);
+        uint32_t bit_total = duration0 + duration1;
+        if (bit_total * 4 < period * 3 || bit_total * 4 > period * 5)
+            return result;
+
+        uint32_t margin = duration0 > duration1 ? duration0 - duration1 : duration1 - duration0;
+        margin = margin * period / bit_total;
+        if (margin < min_margin)
+            min_margin = margin;
+
+        data = (data << 1) | (duration0 > duration1);
+    }
+
+    // A split closer than 60/40 is not a bit
+    if (min_margin * 5 < period)
+        return result;
+
+    uint32_t confidence = min_margin * 127 * 10 / (period * 4);
+    result.data = data;
+    result.valid = true;
+    result.confidence = confidence > 127 ? 127 : confidence;
+    decoder->bit_period = period;
+    return result;
+}
+
+size_t powerbolt_decoder_feed(powerbolt_decoder_t *decoder, const uint32_t *data, size_t len, powerbolt_read_t frames[], size_t max_frames) {
+    size_t frame_count = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        uint32_t symbol = data[i];
+
+        // Start bit, whatever came before it was not a frame
+        if (SYMBOL_LEVEL0(symbol) == 1 && SYMBOL_DURATION0(symbol) >= START_MIN_TICKS) {
+            decoder->discarded += decoder->count;
+            decoder->count = 0;
+            continue;
+        }
+
+        if (powerbolt_decoder_is_stop(symbol, decoder->bit_period)) {
+            if (decoder->count == 8) {
+                powerbolt_read_t frame = powerbolt_decoder_decode(decoder, symbol);
+                if (frame.valid)
+                    decoder->frames++;
+                else
+                    decoder->errors++;
+                if (frame_count < max_frames)
+                    frames[frame_count++] = frame;
+            }
+            // A short run ending like a stop bit is a partial frame or a glitch
+            else if (decoder->count > 0) {
+                decoder->errors++;
+                decoder->discarded += decoder->count;
+            }
+            else
+                decoder->discarded++;
+
+            decoder->count = 0;
+            continue;
+        }
+
+        // Anything that is not high then low cannot be part of a frame
+        if (SYMBOL_LEVEL0(symbol) != 1 || SYMBOL_LEVEL1(symbol) != 0 || SYMBOL_DURATION1(symbol) == 0) {
+            decoder->discarded += decoder->count + 1;
+            decoder->count = 0;
+            continue;
+        }
+
+        // Keep the last 8 candidates, older ones were noise in front of the frame
+        if (decoder->count == 8) {
+            memmove(decoder->symbols, decoder->symbols + 1, 7 * sizeof(uint32_t));
+            decoder->count = 7;
+            decoder->discarded++;
+        }
+        decoder->symbols[decoder->count++] = symbol;
+    }
+
+    return frame_count;
+}
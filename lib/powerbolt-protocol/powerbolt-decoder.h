@@ -0,0 +1,40 @@
+#ifndef POWERBOLT_DECODER_H
+#define POWERBOLT_DECODER_H
+
+#include "powerbolt-protocol.h"
+
+// Nominal bit period in reader ticks (0.01ms), a data bit is 0.3ms and 0.7ms in either order
+#define POWERBOLT_DECODER_NOMINAL_PERIOD    100
+#define POWERBOLT_DECODER_MIN_PERIOD        40
+#define POWERBOLT_DECODER_MAX_PERIOD        250
+
+// Reader idle threshold in ticks, between the longest data level (0.7ms) and the start bit low (1.4ms)
+// Every level longer than it ends a run, so the start bit low always does and the run after it starts
+// on the first data bit with its symbols aligned, for clocks from 0.72x to 1.4x. The HAL default of
+// 128 ticks is too close to the start bit low for a fast clock
+#define POWERBOLT_DECODER_IDLE_TICKS        100
+
+// Streaming decoder for arbitrary runs of RMT symbols
+// Frames can be split across runs, merged into one run or preceded by noise. The decoder keeps the
+// last 8 data bit candidates and decodes them whenever a stop bit arrives, using the frame's own
+// average bit period so that timing drift from low batteries does not matter.
+typedef struct {
+    uint32_t symbols[8];
+    uint8_t count;
+
+    // Calibrated bit period of the last decoded frame, in ticks
+    uint16_t bit_period;
+
+    uint32_t frames;
+    uint32_t errors;
+    uint32_t discarded;
+} powerbolt_decoder_t;
+
+extern "C" {
+    void powerbolt_decoder_init(powerbolt_decoder_t *decoder);
+
+    // Returns the number of frames written to frames[], invalid frames are reported with valid = 0
+    size_t powerbolt_decoder_feed(powerbolt_decoder_t *decoder, const uint32_t *data, size_t len, powerbolt_read_t frames[], size_t max_frames);
+}
+
+#endif
@@ -0,0 +1,105 @@
+#include "powerbolt-pacing.h"
+
+void powerbolt_pacing_init(powerbolt_pacing_t *pacing, powerbolt_pacing_gap_t *gap) {
+    memset(pacing, 0, sizeof(powerbolt_pacing_t));
+    pacing->gap = gap;
+    if (gap->gap_ms == 0)
+        gap->gap_ms = POWERBOLT_ACK_INITIAL_GAP_MS;
+}
+
+void powerbolt_pacing_start(powerbolt_pacing_t *pacing, size_t len) {
+    pacing->len = len;
+    pacing->pos = 0;
+    pacing->ack_received = false;
+    pacing->ack_missed = false;
+    pacing->ended = false;
+    pacing->resends = 0;
+}
+
+bool powerbolt_pacing_done(const powerbolt_pacing_t *pacing) {
+    return pacing->ended || pacing->pos >= pacing->len;
+}
+
+size_t powerbolt_pacing_next_key(powerbolt_pacing_t *pacing) {
+    pacing->ack_received = false;
+    return pacing->pos++;
+}
+
+static POWERBOLT_PACING_ACTIONS powerbolt_pacing_gap(powerbolt_pacing_t *pacing, int64_t time_us) {
+    if (powerbolt_pacing_done(pacing))
+        return POWERBOLT_PACING_FINISH;
+    pacing->gap_start_us = time_us;
+    return POWERBOLT_PACING_GAP;
+}
+
+POWERBOLT_PACING_ACTIONS powerbolt_pacing_sent(powerbolt_pacing_t *pacing, int64_t time_us) {
+    if (pacing->ended)
+        return POWERBOLT_PACING_FINISH;
+
+    // The ack can arrive before the end bit has finished playing
+    if (pacing->ack_received)
+        return powerbolt_pacing_gap(pacing, time_us);
+    return POWERBOLT_PACING_WAIT_ACK;
+}
+
+POWERBOLT_PACING_ACTIONS powerbolt_pacing_ack_timeout(powerbolt_pacing_t *pacing) {
+    if (pacing->ended)
+        return POWERBOLT_PACING_FINISH;
+
+    // No ack, the deadbolt dropped the key. Skipping it would enter the code with a digit missing
+    pacing->timeouts++;
+    pacing->ack_missed = true;
+    powerbolt_pacing_gap_t *gap = pacing->gap;
+    if (pacing->pos > 1 && gap->gap_ms + POWERBOLT_ACK_GAP_STEP_MS > gap->floor_ms)
+        gap->floor_ms = gap->gap_ms + POWERBOLT_ACK_GAP_STEP_MS;
+    gap->gap_ms = gap->gap_ms * 2 > POWERBOLT_ACK_MAX_GAP_MS ? POWERBOLT_ACK_MAX_GAP_MS : gap->gap_ms * 2;
+
+    // A deadbolt that takes nothing is busy with something else, the rest of the code would be wrong
+    if (pacing->resends >= POWERBOLT_ACK_RESENDS) {
+        pacing->ended = true;
+        return POWERBOLT_PACING_FINISH;
+    }
+    pacing->resends++;
+    pacing->pos--;
+    return POWERBOLT_PACING_NEXT_KEY;
+}
+
+POWERBOLT_PACING_ACTIONS powerbolt_pacing_gap_elapsed(powerbolt_pacing_t *pacing, int64_t time_us) {
+    if (powerbolt_pacing_done(pacing))
+        return POWERBOLT_PACING_FINISH;
+    if (time_us - pacing->gap_start_us >= (int64_t) pacing->gap->gap_ms * 1000)
+        return POWERBOLT_PACING_NEXT_KEY;
+    return POWERBOLT_PACING_NONE;
+}
+
+POWERBOLT_PACING_ACTIONS powerbolt_pacing_response(powerbolt_pacing_t *pacing, uint8_t data, bool transmitting,
+    bool waiting_ack, int64_t time_us) {
+    if (data == POWERBOLT_ACK_RESPONSE) {
+        // Every key that was acked after the learned gap shows the gap can shrink, down to the floor
+        powerbolt_pacing_gap_t *gap = pacing->gap;
+        uint32_t floor_ms = gap->floor_ms > POWERBOLT_ACK_MIN_GAP_MS ? gap->floor_ms : POWERBOLT_ACK_MIN_GAP_MS;
+        if (!pacing->ack_missed && pacing->pos > 1 && gap->gap_ms > floor_ms)
+            gap->gap_ms = gap->gap_ms - POWERBOLT_ACK_GAP_STEP_MS < floor_ms ? floor_ms : gap->gap_ms - POWERBOLT_ACK_GAP_STEP_MS;
+        pacing->ack_missed = false;
+        pacing->resends = 0;
+
+        if (waiting_ack)
+            return powerbolt_pacing_gap(pacing, time_us);
+        if (transmitting)
+            pacing->ack_received = true;
+    }
+    // Red flashes mean the lock gave up on the code, the rest of it is pointless
+    else if (data == POWERBOLT_ACK_REJECTED) {
+        pacing->ended = true;
+        if (!transmitting)
+            return POWERBOLT_PACING_FINISH;
+    }
+    return POWERBOLT_PACING_NONE;
+}
+
+bool powerbolt_pacing_cancel(powerbolt_pacing_t *pacing) {
+    if (pacing->ended)
+        return false;
+    pacing->ended = true;
+    return true;
+}
@@ -0,0 +1,80 @@
+#ifndef POWERBOLT_PACING_H
+#define POWERBOLT_PACING_H
+
+#include "powerbolt-protocol.h"
+
+// Fixed gap between the keys of a write that is not paced
+#define POWERBOLT_WRITE_WAIT_MS         750
+
+// Ack pacing: the deadbolt answers every accepted key with C4, so the next key can go out as soon as
+// it arrives plus a learned gap. A key without an ack was dropped by the deadbolt, so it is sent again
+// after a timeout and the gap doubles. The gap that lost it plus a step becomes a floor the gap never
+// shrinks below again.
+#define POWERBOLT_ACK_RESPONSE          0xC4
+#define POWERBOLT_ACK_REJECTED          0xC3
+#define POWERBOLT_ACK_TIMEOUT_MS        750
+#define POWERBOLT_ACK_INITIAL_GAP_MS    200
+#define POWERBOLT_ACK_MIN_GAP_MS        20
+#define POWERBOLT_ACK_MAX_GAP_MS        750
+#define POWERBOLT_ACK_GAP_STEP_MS       10
+#define POWERBOLT_ACK_RESENDS           2       // Resends of one key before the write gives up
+
+// What the writer does next, it owns the wire and the timers
+enum POWERBOLT_PACING_ACTIONS {
+    POWERBOLT_PACING_NONE,
+    POWERBOLT_PACING_WAIT_ACK,      // Wait up to POWERBOLT_ACK_TIMEOUT_MS for the ack
+    POWERBOLT_PACING_GAP,           // (Re)start the learned gap, then send the next key
+    POWERBOLT_PACING_NEXT_KEY,      // Send the next key now
+    POWERBOLT_PACING_FINISH         // The sequence is over
+};
+
+// What a lock has learned about its gap, the driver keeps it in RTC memory
+typedef struct {
+    uint32_t gap_ms;
+    uint32_t floor_ms;
+} powerbolt_pacing_gap_t;
+
+// Paced write state for one lock. Shared by the driver and the host simulator so both pace the
+// same way, times are passed in by the caller
+typedef struct {
+    size_t len;
+    size_t pos;             // Keys sent so far, a resent key counts once
+    bool ack_received;      // The ack arrived while the key was still playing
+    bool ack_missed;
+    bool ended;             // Rejected, cancelled or out of resends
+    uint8_t resends;
+    int64_t gap_start_us;
+    powerbolt_pacing_gap_t *gap;
+    uint32_t timeouts;
+} powerbolt_pacing_t;
+
+extern "C" {
+    // An unset (0) gap starts at POWERBOLT_ACK_INITIAL_GAP_MS
+    void powerbolt_pacing_init(powerbolt_pacing_t *pacing, powerbolt_pacing_gap_t *gap);
+    void powerbolt_pacing_start(powerbolt_pacing_t *pacing, size_t len);
+    bool powerbolt_pacing_done(const powerbolt_pacing_t *pacing);
+
+    // The writer is about to send a key, returns its index in the sequence
+    size_t powerbolt_pacing_next_key(powerbolt_pacing_t *pacing);
+
+    // The key finished playing, returns POWERBOLT_PACING_FINISH, _GAP or _WAIT_ACK. The last key is
+    // waited for like the others
+    POWERBOLT_PACING_ACTIONS powerbolt_pacing_sent(powerbolt_pacing_t *pacing, int64_t time_us);
+    // No ack within POWERBOLT_ACK_TIMEOUT_MS, returns POWERBOLT_PACING_NEXT_KEY to send the same key
+    // again or POWERBOLT_PACING_FINISH when it has been resent POWERBOLT_ACK_RESENDS times
+    POWERBOLT_PACING_ACTIONS powerbolt_pacing_ack_timeout(powerbolt_pacing_t *pacing);
+    // The gap timer fired, returns POWERBOLT_PACING_NONE when the gap was restarted since it was armed
+    POWERBOLT_PACING_ACTIONS powerbolt_pacing_gap_elapsed(powerbolt_pacing_t *pacing, int64_t time_us);
+
+    // A frame from the deadbolt while a paced write is in progress. transmitting and waiting_ack are
+    // the writer's state. Returns POWERBOLT_PACING_GAP when an awaited ack arrived and
+    // POWERBOLT_PACING_FINISH when the last key was acked or a rejection ended the sequence, with
+    // nothing on the wire
+    POWERBOLT_PACING_ACTIONS powerbolt_pacing_response(powerbolt_pacing_t *pacing, uint8_t data, bool transmitting,
+        bool waiting_ack, int64_t time_us);
+
+    // Stops after the key being sent, false when the write had already ended
+    bool powerbolt_pacing_cancel(powerbolt_pacing_t *pacing);
+}
+
+#endif
@@ -1,70 +1,103 @@
 #include "powerbolt-protocol.h"
+#include "powerbolt-tables.h"
 
-static void powerbolt_write_buffer_bit(rmt_data_t *rmt_buffer_bit, uint32_t high_duration, uint32_t low_duration) {
-    rmt_buffer_bit->level0 = 1;
-    rmt_buffer_bit->duration0 = high_duration;
-    rmt_buffer_bit->level1 = 0;
-    rmt_buffer_bit->duration1 = low_duration;
-}
+// Complete waveform for every key code, generated at compile time
+static constexpr powerbolt_waveform_table_t<sizeof(powerbolt_key_codes)> powerbolt_key_waveforms =
+    powerbolt_make_key_waveforms(powerbolt_make_indices<sizeof(powerbolt_key_codes)>::type());
 
-static void powerbolt_write_buffer_bit_high(rmt_data_t *rmt_buffer_bit) {
-    powerbolt_write_buffer_bit(rmt_buffer_bit, 7, 3);
-}
+// Decoding tables, see powerbolt-tables.h
+static constexpr powerbolt_duration_table_t powerbolt_duration_classes =
+    powerbolt_make_duration_table(powerbolt_make_indices<256>::type());
+static constexpr powerbolt_bit_table_t powerbolt_bit_values =
+    powerbolt_make_bit_table(powerbolt_make_indices<16>::type());
 
-static void powerbolt_write_buffer_bit_low(rmt_data_t *rmt_buffer_bit) {
-    powerbolt_write_buffer_bit(rmt_buffer_bit, 3, 7);
+// Returns the precomputed 20 bit waveform for a key (start, 8 data, end, repeated twice)
+const rmt_data_t *powerbolt_key_waveform(POWERBOLT_KEY_CODES key_code) {
+    return (const rmt_data_t *) powerbolt_key_waveforms.waveforms[key_code].symbols;
 }
 
 // Writes 20 bits to the RMT output buffer (repeated twice: 1 start, 8 data, 1 end)
 void powerbolt_write_buffer(rmt_data_t rmt_buffer[], POWERBOLT_KEY_CODES key_code) {
-    uint8_t bit_num = 0;
-
-    // Write everything twice
-    for (uint8_t write_cnt = 0; write_cnt < 2; write_cnt++) {
-        // Start bit (30ms high, 1.4ms low)
-        powerbolt_write_buffer_bit(&rmt_buffer[bit_num++], 300, 14);
-
-        // 8 command bits (MSB to LSB)
-        for (uint8_t i = 0; i < 8; i++) {
-            if ((powerbolt_key_codes[key_code] & (0x80 >> i)) == 0) {
-                powerbolt_write_buffer_bit_low(&rmt_buffer[bit_num++]);
-            } else {
-                powerbolt_write_buffer_bit_high(&rmt_buffer[bit_num++]);
-            }
-        }
-
-        // End bit
-        powerbolt_write_buffer_bit(&rmt_buffer[bit_num++], 3, 100);
+    memcpy(rmt_buffer, powerbolt_key_waveform(key_code), POWERBOLT_KEY_SYMBOLS * sizeof(rmt_data_t));
+}
+
+// Writes 20 bits for any command byte, for codes that are not part of POWERBOLT_KEY_CODES
+void powerbolt_write_buffer_raw(rmt_data_t rmt_buffer[], uint8_t command) {
+    uint32_t *symbols = (uint32_t *) rmt_buffer;
+    for (uint8_t i = 0; i < POWERBOLT_KEY_SYMBOLS; i++)
+        symbols[i] = powerbolt_waveform_symbol(command, i);
+}
+
+// Stretches the low half of the last end bit to cover the gap before the next key
+static void powerbolt_write_sequence_gap(rmt_data_t *rmt_end_bit, uint32_t gap_ticks) {
+    // A single RMT duration is 15 bits wide
+    if (gap_ticks > POWERBOLT_MAX_DURATION_TICKS)
+        gap_ticks = POWERBOLT_MAX_DURATION_TICKS;
+
+    if (gap_ticks > rmt_end_bit->duration1)
+        rmt_end_bit->duration1 = gap_ticks;
+}
+
+// Writes a whole key sequence as one RMT item stream (20 bits per key)
+// The low half of each key's last end bit is stretched to cover the gap before the next key,
+// so the hardware plays back the full code without any CPU involvement between keys
+size_t powerbolt_write_sequence_buffer(rmt_data_t rmt_buffer[], const POWERBOLT_KEY_CODES key_codes[], size_t count, uint32_t gap_ticks) {
+    size_t bit_num = 0;
+    for (size_t i = 0; i < count; i++) {
+        powerbolt_write_buffer(&rmt_buffer[bit_num], key_codes[i]);
+        bit_num += POWERBOLT_KEY_SYMBOLS;
+
+        if (i + 1 < count)
+            powerbolt_write_sequence_gap(&rmt_buffer[bit_num - 1], gap_ticks);
     }
+
+    return bit_num;
+}
+
+// Same as powerbolt_write_sequence_buffer for raw command bytes
+size_t powerbolt_write_raw_sequence_buffer(rmt_data_t rmt_buffer[], const uint8_t commands[], size_t count, uint32_t gap_ticks) {
+    size_t bit_num = 0;
+    for (size_t i = 0; i < count; i++) {
+        powerbolt_write_buffer_raw(&rmt_buffer[bit_num], commands[i]);
+        bit_num += POWERBOLT_KEY_SYMBOLS;
+
+        if (i + 1 < count)
+            powerbolt_write_sequence_gap(&rmt_buffer[bit_num - 1], gap_ticks);
+    }
+
+    return bit_num;
 }
 
 // Reads 9 bits from an RMT input buffer into a char and checks validity
+// Every bit is decoded through the lookup tables and validity is accumulated instead of branching
 powerbolt_read_t powerbolt_parse_buffer(uint32_t *data) {
-    powerbolt_read_t result;
-    result.valid = false;
-    result.data = 0;
+    uint32_t valid = 1;
+    uint32_t value = 0;
 
     // Look for 8 bits of logical 0 or 1
     for (uint8_t i = 0; i < 8; i++) {
-        rmt_data_t *rmt_data = (rmt_data_t *) &data[i];
-
-        if (rmt_data->level0 != 1 || rmt_data->level1 != 0)
-            return result;
-
-        // "0" bit
-        if (rmt_data->duration0 >= 27 && rmt_data->duration0 <= 33 && rmt_data->duration1 >= 67 && rmt_data->duration1 <= 73)
-            ;
-        // "1" bit
-        else if (rmt_data->duration0 >= 67 && rmt_data->duration0 <= 73 && rmt_data->duration1 >= 27 && rmt_data->duration1 <= 33)
-            result.data |= 0x80 >> i;
-        else
-            return result;
+        uint32_t duration0 = data[i] & 0x7FFF;
+        uint32_t duration1 = (data[i] >> 16) & 0x7FFF;
+        uint8_t classes = powerbolt_duration_classes.classes[duration0 & 0xFF]
+            | powerbolt_duration_classes.classes[duration1 & 0xFF] << 2;
+        uint8_t bit = powerbolt_bit_values.bits[classes];
+
+        // Levels must be high then low and neither duration can be outside the table
+        valid &= (data[i] & 0x80008000) == 0x8000;
+        valid &= ((duration0 | duration1) >> 8) == 0;
+        valid &= bit >> 1;
+        value = (value << 1) | (bit & 1);
     }
 
     // Stop bit has a duration1 that is too long for the pulse timer to receive
-    rmt_data_t *rmt_data = (rmt_data_t *) &data[8];
-    if (rmt_data->level0 == 1 && rmt_data->level1 == 0 && rmt_data->duration0 >= 27 && rmt_data->duration0 <= 33 && rmt_data->duration1 == 0)
-        result.valid = true;
+    uint32_t stop_duration0 = data[8] & 0x7FFF;
+    valid &= (data[8] & 0xFFFF8000) == 0x8000;
+    valid &= (stop_duration0 >> 8) == 0;
+    valid &= powerbolt_duration_classes.classes[stop_duration0 & 0xFF] == DURATION_SHORT;
 
+    powerbolt_read_t result;
+    result.data = valid ? value : 0;
+    result.valid = valid;
+    result.confidence = valid ? POWERBOLT_CONFIDENCE_MAX : 0;
     return result;
 }
\ No newline at end of file
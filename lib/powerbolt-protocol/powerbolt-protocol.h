@@ -3,10 +3,14 @@
 
 #include "Arduino.h"
 
+// RMT symbols needed to write one key (start, 8 data, end, sent twice)
+#define POWERBOLT_KEY_SYMBOLS       20
+#define POWERBOLT_MAX_DURATION_TICKS 0x7FFF
+
 enum POWERBOLT_KEY_CODES { 
     KEY_12, KEY_34, KEY_56, KEY_78, KEY_90, KEY_HIDDEN, KEY_LOCK, KEY_CLEAR_D2, KEY_CLEAR_D4
 };
-const uint8_t powerbolt_key_codes[] = {
+constexpr uint8_t powerbolt_key_codes[] = {
     0x01,   // 12
     0x02,   // 34
     0x03,   // 56
@@ -22,10 +26,10 @@ const uint8_t powerbolt_key_codes[] = {
 };
 
 enum POWERBOLT_RESP_CODES { 
-    GREEN_SHORT_1, GREEN_LONG_1, RED_SHORT_3, GREEN_BLIP_1, GREEN_LONG_2, YELLOW_LONG_1, 
+    GREEN_SHORT_1, GREEN_LONG_1, RED_SHORT_3, GREEN_BLIP_1, GREEN_LONG_2, LIGHTS_OFF, YELLOW_LONG_1, 
     YELLOW_SHORT_3, YELLOW_SHORT_1, RED_SHORT_5, RED_SHORT_10 
 };
-const uint8_t powerbolt_response_codes[] = {
+constexpr uint8_t powerbolt_response_codes[] = {
     //0xC0  // 1 green short (unused)
     0xC1,   // 1 green short
     0xC2,   // 1 green long
@@ -44,13 +48,21 @@ const uint8_t powerbolt_response_codes[] = {
     //0xCF  // nothing
 };
 
+// Confidence runs from 0 to 127, a frame with nominal timing has full confidence
+#define POWERBOLT_CONFIDENCE_MAX    127
+
 typedef struct {
     uint8_t data :8;
     uint8_t valid :1;
+    uint8_t confidence :7;
 } powerbolt_read_t;
 
 extern "C" {
+    const rmt_data_t *powerbolt_key_waveform(POWERBOLT_KEY_CODES key_code);
     void powerbolt_write_buffer(rmt_data_t rmt_buffer[], POWERBOLT_KEY_CODES key_code);
+    void powerbolt_write_buffer_raw(rmt_data_t rmt_buffer[], uint8_t command);
+    size_t powerbolt_write_sequence_buffer(rmt_data_t rmt_buffer[], const POWERBOLT_KEY_CODES key_codes[], size_t count, uint32_t gap_ticks);
+    size_t powerbolt_write_raw_sequence_buffer(rmt_data_t rmt_buffer[], const uint8_t commands[], size_t count, uint32_t gap_ticks);
     powerbolt_read_t powerbolt_parse_buffer(uint32_t *data);
 }
 
@@ -0,0 +1,51 @@
+#include "powerbolt-receiver.h"
+
+void powerbolt_receiver_init(powerbolt_receiver_t *receiver) {
+    memset(receiver, 0, sizeof(powerbolt_receiver_t));
+    powerbolt_decoder_init(&receiver->decoder);
+    receiver->last_repeat_seen = true;
+}
+
+// Returns true when the frame is the repeated copy of the previous frame
+static bool powerbolt_receiver_is_repeat(powerbolt_receiver_t *receiver, powerbolt_read_t received, int64_t timestamp) {
+    bool in_window = receiver->awaiting_repeat && timestamp - receiver->timestamp <= POWERBOLT_REPEAT_WINDOW_US;
+
+    if (in_window && (received.data == receiver->data || !received.valid)) {
+        // A corrupted copy inside the window is the repeat, but it does not count as seen
+        receiver->awaiting_repeat = false;
+        receiver->last_repeat_seen = received.valid;
+        if (received.valid)
+            receiver->repeats_seen++;
+        else
+            receiver->repeats_missing++;
+        return true;
+    }
+
+    // The previous frame never got its repeat
+    if (receiver->awaiting_repeat) {
+        receiver->last_repeat_seen = false;
+        receiver->repeats_missing++;
+    }
+
+    receiver->awaiting_repeat = received.valid;
+    receiver->data = received.data;
+    receiver->timestamp = timestamp;
+    return false;
+}
+
+size_t powerbolt_receiver_feed(powerbolt_receiver_t *receiver, const uint32_t *data, size_t len, int64_t timestamp_us,
+    powerbolt_read_t frames[], size_t max_frames) {
+    powerbolt_read_t decoded[4];
+    size_t decoded_count = powerbolt_decoder_feed(&receiver->decoder, data, len, decoded, 4);
+
+    size_t count = 0;
+    for (size_t i = 0; i < decoded_count; i++) {
+        if (!powerbolt_receiver_is_repeat(receiver, decoded[i], timestamp_us) && count < max_frames)
+            frames[count++] = decoded[i];
+    }
+    return count;
+}
+
+bool powerbolt_receiver_repeat_expired(const powerbolt_receiver_t *receiver, int64_t timestamp_us) {
+    return receiver->awaiting_repeat && timestamp_us - receiver->timestamp > POWERBOLT_REPEAT_WINDOW_US;
+}
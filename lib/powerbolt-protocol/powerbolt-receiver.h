@@ -0,0 +1,36 @@
+#ifndef POWERBOLT_RECEIVER_H
+#define POWERBOLT_RECEIVER_H
+
+#include "powerbolt-decoder.h"
+
+// Every frame is sent twice, the repeat starts about 50ms after the first copy is received, well
+// within this window
+#define POWERBOLT_REPEAT_WINDOW_US  100000
+
+// Receive path for one reader: the streaming decoder, then merging the repeated copy into one
+// logical frame. Shared by the driver and the host replay tool so both decode runs the same way.
+typedef struct {
+    powerbolt_decoder_t decoder;
+
+    // Last frame, for spotting its repeat
+    bool awaiting_repeat;
+    uint8_t data;
+    int64_t timestamp;
+
+    bool last_repeat_seen;
+    uint32_t repeats_seen;
+    uint32_t repeats_missing;
+} powerbolt_receiver_t;
+
+extern "C" {
+    void powerbolt_receiver_init(powerbolt_receiver_t *receiver);
+
+    // Decodes one run, returns the logical frames with repeated copies removed
+    size_t powerbolt_receiver_feed(powerbolt_receiver_t *receiver, const uint32_t *data, size_t len, int64_t timestamp_us,
+        powerbolt_read_t frames[], size_t max_frames);
+
+    // True when the last frame's window has closed without a repeat, even if nothing has arrived since
+    bool powerbolt_receiver_repeat_expired(const powerbolt_receiver_t *receiver, int64_t timestamp_us);
+}
+
+#endif
@@ -0,0 +1,87 @@
+#include "powerbolt-sequence.h"
+
+static const char *powerbolt_event_names[] = {
+    "none",
+    "code_accepted",
+    "code_rejected",
+    "locking",
+    "locked_while_locked",
+    "master_menu",
+    "reset",
+    "reset_cancelled",
+    "timeout",
+    "menu_timeout"
+};
+
+void powerbolt_sequence_init(powerbolt_sequence_t *sequence) {
+    memset(sequence, 0, sizeof(powerbolt_sequence_t));
+}
+
+static POWERBOLT_EVENTS powerbolt_sequence_decide(powerbolt_sequence_t *sequence, POWERBOLT_EVENTS event) {
+    sequence->decided = true;
+    return event;
+}
+
+// Keys sent to the deadbolt, by the keypad or by this device on the same wire
+static POWERBOLT_EVENTS powerbolt_sequence_feed_key(powerbolt_sequence_t *sequence, uint8_t data) {
+    if (data == powerbolt_key_codes[KEY_LOCK])
+        sequence->lock_key = true;
+    else if (data == powerbolt_key_codes[KEY_CLEAR_D4])
+        sequence->keypad_timeout = true;
+    // The master menu timeout has no response from the deadbolt, so it ends the sequence here
+    else if (data == powerbolt_key_codes[KEY_CLEAR_D2]) {
+        powerbolt_sequence_init(sequence);
+        return POWERBOLT_EVENT_MENU_TIMEOUT;
+    }
+    else
+        sequence->digit_key = true;
+
+    return POWERBOLT_EVENT_NONE;
+}
+
+static POWERBOLT_EVENTS powerbolt_sequence_feed_response(powerbolt_sequence_t *sequence, uint8_t data) {
+    // Lights off ends every sequence
+    if (data == powerbolt_response_codes[LIGHTS_OFF]) {
+        bool cancelled = sequence->reset_pressed && !sequence->decided;
+        powerbolt_sequence_init(sequence);
+        return cancelled ? POWERBOLT_EVENT_RESET_CANCELLED : POWERBOLT_EVENT_NONE;
+    }
+
+    if (sequence->decided)
+        return POWERBOLT_EVENT_NONE;
+
+    if (data == powerbolt_response_codes[YELLOW_SHORT_1])
+        sequence->reset_pressed = true;
+    else if (data == powerbolt_response_codes[YELLOW_SHORT_3] && sequence->reset_pressed)
+        return powerbolt_sequence_decide(sequence, POWERBOLT_EVENT_RESET);
+    else if (data == powerbolt_response_codes[YELLOW_LONG_1])
+        return powerbolt_sequence_decide(sequence, POWERBOLT_EVENT_MASTER_MENU);
+
+    // Red flashes after a keypad timeout are the timeout itself, otherwise the code was wrong
+    else if (data == powerbolt_response_codes[RED_SHORT_3]) {
+        if (sequence->keypad_timeout)
+            return powerbolt_sequence_decide(sequence, sequence->lock_key ? POWERBOLT_EVENT_LOCKED_WHILE_LOCKED : POWERBOLT_EVENT_TIMEOUT);
+        return powerbolt_sequence_decide(sequence, POWERBOLT_EVENT_CODE_REJECTED);
+    }
+
+    // Green (other than the per-key blip) means the deadbolt is turning
+    else if (data == powerbolt_response_codes[GREEN_SHORT_1] || data == powerbolt_response_codes[GREEN_LONG_1]
+            || data == powerbolt_response_codes[GREEN_LONG_2]) {
+        if (sequence->lock_key)
+            return powerbolt_sequence_decide(sequence, POWERBOLT_EVENT_LOCKING);
+        if (sequence->digit_key)
+            return powerbolt_sequence_decide(sequence, POWERBOLT_EVENT_CODE_ACCEPTED);
+    }
+
+    return POWERBOLT_EVENT_NONE;
+}
+
+POWERBOLT_EVENTS powerbolt_sequence_feed(powerbolt_sequence_t *sequence, uint8_t port, uint8_t data) {
+    if (port == 0)
+        return powerbolt_sequence_feed_response(sequence, data);
+    return powerbolt_sequence_feed_key(sequence, data);
+}
+
+const char *powerbolt_event_name(POWERBOLT_EVENTS event) {
+    return powerbolt_event_names[event];
+}
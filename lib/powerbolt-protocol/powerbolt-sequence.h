@@ -0,0 +1,39 @@
+#ifndef POWERBOLT_SEQUENCE_H
+#define POWERBOLT_SEQUENCE_H
+
+#include "powerbolt-protocol.h"
+
+// High level events recognised from the documented deadbolt/keypad sequences (see readme)
+enum POWERBOLT_EVENTS {
+    POWERBOLT_EVENT_NONE,
+    POWERBOLT_EVENT_CODE_ACCEPTED,      // digits then green
+    POWERBOLT_EVENT_CODE_REJECTED,      // digits then C3 without a keypad timeout
+    POWERBOLT_EVENT_LOCKING,            // lock key then green while the bolt turns
+    POWERBOLT_EVENT_LOCKED_WHILE_LOCKED,// lock key, D4 timeout, C3
+    POWERBOLT_EVENT_MASTER_MENU,        // C8 yellow after the master code
+    POWERBOLT_EVENT_RESET,              // CB, CC, CA when the reset button is held
+    POWERBOLT_EVENT_RESET_CANCELLED,    // CB then C7 when the reset button is released early
+    POWERBOLT_EVENT_TIMEOUT,            // D4 from the keypad, C3 from the deadbolt
+    POWERBOLT_EVENT_MENU_TIMEOUT        // D2 from the keypad
+};
+
+// Sequence state, everything between two C7 (lights off) responses is one sequence
+// An event is emitted as soon as the sequence is decided, the rest of it up to C7 is ignored
+typedef struct {
+    bool digit_key;
+    bool lock_key;
+    bool keypad_timeout;
+    bool reset_pressed;
+    bool decided;
+} powerbolt_sequence_t;
+
+extern "C" {
+    void powerbolt_sequence_init(powerbolt_sequence_t *sequence);
+
+    // Feeds one valid frame (port 0 from the deadbolt, port 1 from the keypad)
+    POWERBOLT_EVENTS powerbolt_sequence_feed(powerbolt_sequence_t *sequence, uint8_t port, uint8_t data);
+
+    const char *powerbolt_event_name(POWERBOLT_EVENTS event);
+}
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef POWERBOLT_TABLES_H
+#define POWERBOLT_TABLES_H
+
+#include "powerbolt-protocol.h"
+
+// Compile-time lookup tables for encoding and decoding
+// Everything here is constexpr so the tables are generated by the compiler and live in flash
+// Written for C++11 (single-expression constexpr, hand-rolled index sequences)
+
+// Raw RMT symbol word with the same layout as rmt_data_t.val
+// duration0:15, level0:1, duration1:15, level1:1 with level0 = 1 and level1 = 0
+constexpr uint32_t powerbolt_symbol(uint32_t high_duration, uint32_t low_duration) {
+    return (high_duration & 0x7FFF) | (1UL << 15) | ((low_duration & 0x7FFF) << 16);
+}
+
+// Write durations in writer ticks (0.1ms)
+constexpr uint32_t POWERBOLT_SYMBOL_START = powerbolt_symbol(300, 14);
+constexpr uint32_t POWERBOLT_SYMBOL_HIGH = powerbolt_symbol(7, 3);
+constexpr uint32_t POWERBOLT_SYMBOL_LOW = powerbolt_symbol(3, 7);
+constexpr uint32_t POWERBOLT_SYMBOL_END = powerbolt_symbol(3, 100);
+
+// Symbol n of the 20 symbol waveform for a command byte
+constexpr uint32_t powerbolt_waveform_symbol(uint8_t command, size_t n) {
+    return n % 10 == 0 ? POWERBOLT_SYMBOL_START :
+        n % 10 == 9 ? POWERBOLT_SYMBOL_END :
+        (command & (0x80 >> (n % 10 - 1))) ? POWERBOLT_SYMBOL_HIGH : POWERBOLT_SYMBOL_LOW;
+}
+
+// Index sequence for expanding tables (std::index_sequence is C++14)
+template <size_t... I> struct powerbolt_indices {};
+template <size_t N, size_t... I> struct powerbolt_make_indices : powerbolt_make_indices<N - 1, N - 1, I...> {};
+template <size_t... I> struct powerbolt_make_indices<0, I...> {
+    typedef powerbolt_indices<I...> type;
+};
+
+typedef struct {
+    uint32_t symbols[POWERBOLT_KEY_SYMBOLS];
+} powerbolt_waveform_t;
+
+template <size_t COUNT>
+struct powerbolt_waveform_table_t {
+    powerbolt_waveform_t waveforms[COUNT];
+};
+
+template <size_t... N>
+constexpr powerbolt_waveform_t powerbolt_make_waveform(uint8_t command, powerbolt_indices<N...>) {
+    return {{ powerbolt_waveform_symbol(command, N)... }};
+}
+
+template <size_t... K>
+constexpr powerbolt_waveform_table_t<sizeof...(K)> powerbolt_make_key_waveforms(powerbolt_indices<K...>) {
+    return {{ powerbolt_make_waveform(powerbolt_key_codes[K], powerbolt_make_indices<POWERBOLT_KEY_SYMBOLS>::type())... }};
+}
+
+// Read durations in reader ticks (0.01ms), a bit is a short and a long half in either order
+enum POWERBOLT_DURATION_CLASS {
+    DURATION_INVALID = 0, DURATION_SHORT = 1, DURATION_LONG = 2
+};
+
+constexpr uint8_t powerbolt_duration_class(size_t duration) {
+    return duration >= 27 && duration <= 33 ? DURATION_SHORT :
+        duration >= 67 && duration <= 73 ? DURATION_LONG : DURATION_INVALID;
+}
+
+typedef struct {
+    uint8_t classes[256];
+} powerbolt_duration_table_t;
+
+template <size_t... D>
+constexpr powerbolt_duration_table_t powerbolt_make_duration_table(powerbolt_indices<D...>) {
+    return {{ powerbolt_duration_class(D)... }};
+}
+
+// Data bit lookup indexed by (high class | low class << 2)
+// Bit 1 is set for a valid data bit, bit 0 is the data bit value
+constexpr uint8_t powerbolt_bit_decode(size_t classes) {
+    return classes == (DURATION_SHORT | DURATION_LONG << 2) ? 0x2 :
+        classes == (DURATION_LONG | DURATION_SHORT << 2) ? 0x3 : 0x0;
+}
+
+typedef struct {
+    uint8_t bits[16];
+} powerbolt_bit_table_t;
+
+template <size_t... C>
+constexpr powerbolt_bit_table_t powerbolt_make_bit_table(powerbolt_indices<C...>) {
+    return {{ powerbolt_bit_decode(C)... }};
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,331 @@
+#include "powerbolt-sim.h"
+#include "powerbolt-decoder.h"
+#include "powerbolt-capture.h"
+
+// Idle threshold the driver programs into every reader
+#define DEFAULT_IDLE_THRESHOLD_US   (POWERBOLT_DECODER_IDLE_TICKS * POWERBOLT_SIM_READ_TICK_US)
+#define MAX_SEGMENTS                (4 * POWERBOLT_SIM_MAX_SYMBOLS)
+#define GLITCH_MIN_US               10
+#define GLITCH_MAX_US               40
+#define GLITCH_LOW_MIN_US           2500    // Stop bit lows and the gaps between frames, not start bit lows
+
+// Deadbolt timing, measured roughly from the readme sequences
+#define DEADBOLT_ACK_DELAY_US       20000
+#define DEADBOLT_MIN_KEY_GAP_US     100000
+#define DEADBOLT_REJECT_US          1500000
+#define DEADBOLT_BOLT_TURN_US       3000000
+#define DEADBOLT_LIGHTS_OFF_US      500000
+
+typedef struct {
+    uint8_t level;
+    double duration;
+} sim_segment_t;
+
+// xorshift32, the wire has to be reproducible for a given seed
+static uint32_t sim_random(powerbolt_sim_wire_t *wire) {
+    uint32_t x = wire->seed ? wire->seed : 0x2545F491;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    wire->seed = x;
+    return x;
+}
+
+static double sim_random_unit(powerbolt_sim_wire_t *wire) {
+    return (sim_random(wire) & 0xFFFFFF) / (double) 0x1000000;
+}
+
+void powerbolt_sim_wire_init(powerbolt_sim_wire_t *wire, double drift, uint32_t jitter_us, uint32_t seed) {
+    wire->drift = drift;
+    wire->jitter_us = jitter_us;
+    wire->idle_threshold_us = DEFAULT_IDLE_THRESHOLD_US;
+    wire->glitch_rate = 0;
+    wire->seed = seed;
+}
+
+uint64_t powerbolt_sim_duration_us(const rmt_data_t tx[], size_t len, uint32_t tx_tick_us) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < len; i++)
+        total += (uint64_t) (tx[i].duration0 + tx[i].duration1) * tx_tick_us;
+    return total;
+}
+
+// Converts transmit symbols to line levels, merging neighbours with the same level
+static size_t sim_segments(powerbolt_sim_wire_t *wire, const rmt_data_t tx[], size_t len, uint32_t tx_tick_us, sim_segment_t segments[]) {
+    size_t count = 0;
+    for (size_t i = 0; i < len && count + 3 < MAX_SEGMENTS; i++) {
+        const uint32_t levels[2] = { tx[i].level0, tx[i].level1 };
+        const uint32_t durations[2] = { tx[i].duration0, tx[i].duration1 };
+        for (uint8_t half = 0; half < 2; half++) {
+            if (durations[half] == 0)
+                continue;
+
+            double duration = durations[half] * tx_tick_us * wire->drift;
+            if (count > 0 && segments[count - 1].level == levels[half]) {
+                segments[count - 1].duration += duration;
+                continue;
+            }
+            segments[count].level = levels[half];
+            segments[count].duration = duration;
+            count++;
+        }
+    }
+
+    // Noise pulses land in the long lows between frames
+    for (size_t i = 0; i < count && count + 2 < MAX_SEGMENTS; i++) {
+        if (segments[i].level != 0 || segments[i].duration < GLITCH_LOW_MIN_US)
+            continue;
+        if (sim_random_unit(wire) >= wire->glitch_rate)
+            continue;
+
+        double before = segments[i].duration * (0.25 + 0.5 * sim_random_unit(wire));
+        double glitch = GLITCH_MIN_US + (GLITCH_MAX_US - GLITCH_MIN_US) * sim_random_unit(wire);
+        memmove(&segments[i + 3], &segments[i + 1], (count - i - 1) * sizeof(sim_segment_t));
+        segments[i + 2].level = 0;
+        segments[i + 2].duration = segments[i].duration - before - glitch;
+        segments[i + 1].level = 1;
+        segments[i + 1].duration = glitch;
+        segments[i].duration = before;
+        count += 2;
+        i += 2;
+    }
+
+    // Every edge moves by up to +/- jitter, without letting two edges cross
+    if (wire->jitter_us > 0) {
+        for (size_t i = 0; i + 1 < count; i++) {
+            double shift = ((double) sim_random_unit(wire) * 2 - 1) * wire->jitter_us;
+            if (shift < 1 - segments[i].duration)
+                shift = 1 - segments[i].duration;
+            if (shift > segments[i + 1].duration - 1)
+                shift = segments[i + 1].duration - 1;
+            segments[i].duration += shift;
+            segments[i + 1].duration -= shift;
+        }
+    }
+
+    return count;
+}
+
+static uint32_t sim_ticks(double duration_us) {
+    uint32_t ticks = (uint32_t) (duration_us / POWERBOLT_SIM_READ_TICK_US + 0.5);
+    if (ticks == 0)
+        ticks = 1;
+    return ticks > POWERBOLT_MAX_DURATION_TICKS ? POWERBOLT_MAX_DURATION_TICKS : ticks;
+}
+
+// Appends one level/duration item to a run, two items make one 32 bit RMT symbol
+static void sim_run_item(powerbolt_sim_run_t *run, size_t *items, uint8_t level, uint32_t ticks) {
+    size_t word = *items / 2;
+    if (word >= POWERBOLT_SIM_MAX_RUN)
+        return;
+
+    uint32_t item = (ticks & 0x7FFF) | ((uint32_t) level << 15);
+    if (*items % 2 == 0) {
+        run->symbols[word] = item;
+        run->len = word + 1;
+    }
+    else
+        run->symbols[word] |= item << 16;
+    (*items)++;
+}
+
+// The receiver starts on an edge and stops once a level lasts longer than the idle threshold,
+// the level that timed out is stored with a duration of 0
+size_t powerbolt_sim_wire_transmit(powerbolt_sim_wire_t *wire, const rmt_data_t tx[], size_t len, uint32_t tx_tick_us,
+    powerbolt_sim_run_t runs[], size_t max_runs) {
+    sim_segment_t segments[MAX_SEGMENTS];
+    size_t segment_count = sim_segments(wire, tx, len, tx_tick_us, segments);
+
+    size_t run_count = 0;
+    size_t items = 0;
+    bool receiving = false;
+    double time = 0;
+    for (size_t i = 0; i < segment_count && run_count < max_runs; i++) {
+        const sim_segment_t *segment = &segments[i];
+        bool last = i + 1 == segment_count;
+
+        // The line idles low, so a low at the very start is not an edge
+        if (!receiving && !(i == 0 && segment->level == 0)) {
+            receiving = true;
+            items = 0;
+            runs[run_count].len = 0;
+        }
+
+        if (receiving) {
+            if (last || segment->duration > wire->idle_threshold_us) {
+                sim_run_item(&runs[run_count], &items, segment->level, 0);
+                runs[run_count].end_us = (uint64_t) (time + wire->idle_threshold_us);
+                run_count++;
+                receiving = false;
+            }
+            else
+                sim_run_item(&runs[run_count], &items, segment->level, sim_ticks(segment->duration));
+        }
+
+        time += segment->duration;
+    }
+
+    return run_count;
+}
+
+size_t powerbolt_sim_wire_capture(powerbolt_sim_wire_t *wire, const rmt_data_t tx[], size_t len, uint32_t tx_tick_us,
+    double sample_us, uint32_t level_bit, uint32_t records[], size_t max_records) {
+    sim_segment_t segments[MAX_SEGMENTS];
+    size_t segment_count = sim_segments(wire, tx, len, tx_tick_us, segments);
+
+    // Like the ULP, the count starts saturated so the idle line before the first edge reads as a gap,
+    // and it stops counting once saturated
+    size_t record_count = 0;
+    uint8_t level = 0;
+    uint32_t samples = POWERBOLT_CAPTURE_SAMPLES_MAX;
+    double segment_end = 0;
+    size_t i = 0;
+    for (double time = 0; i < segment_count && record_count < max_records; time += sample_us) {
+        while (i < segment_count && time >= segment_end + segments[i].duration) {
+            segment_end += segments[i].duration;
+            i++;
+        }
+        if (i == segment_count)
+            break;
+
+        if (segments[i].level == level) {
+            if (samples < POWERBOLT_CAPTURE_SAMPLES_MAX)
+                samples++;
+            continue;
+        }
+
+        level = segments[i].level;
+        records[record_count++] = samples | (level ? level_bit : 0);
+        samples = 0;
+    }
+
+    return record_count;
+}
+
+void powerbolt_sim_schedule_init(powerbolt_sim_schedule_t *schedule) {
+    schedule->count = 0;
+}
+
+bool powerbolt_sim_schedule_add(powerbolt_sim_schedule_t *schedule, uint64_t time_us, uint8_t port, uint8_t data) {
+    if (schedule->count >= POWERBOLT_SIM_MAX_FRAMES)
+        return false;
+
+    // Kept sorted by time, frames at the same time stay in the order they were added
+    size_t i = schedule->count;
+    while (i > 0 && schedule->frames[i - 1].time_us > time_us) {
+        schedule->frames[i] = schedule->frames[i - 1];
+        i--;
+    }
+    schedule->frames[i].time_us = time_us;
+    schedule->frames[i].port = port;
+    schedule->frames[i].data = data;
+    schedule->count++;
+    return true;
+}
+
+const powerbolt_sim_frame_t *powerbolt_sim_schedule_peek(const powerbolt_sim_schedule_t *schedule) {
+    return schedule->count > 0 ? &schedule->frames[0] : NULL;
+}
+
+bool powerbolt_sim_schedule_next(powerbolt_sim_schedule_t *schedule, powerbolt_sim_frame_t *frame) {
+    if (schedule->count == 0)
+        return false;
+
+    *frame = schedule->frames[0];
+    schedule->count--;
+    memmove(&schedule->frames[0], &schedule->frames[1], schedule->count * sizeof(powerbolt_sim_frame_t));
+    return true;
+}
+
+void powerbolt_sim_deadbolt_init(powerbolt_sim_deadbolt_t *deadbolt, const uint8_t code[], uint8_t code_length, bool locked) {
+    memset(deadbolt, 0, sizeof(powerbolt_sim_deadbolt_t));
+    if (code_length > sizeof(deadbolt->code))
+        code_length = sizeof(deadbolt->code);
+    memcpy(deadbolt->code, code, code_length);
+    deadbolt->code_length = code_length;
+    deadbolt->locked = locked;
+    deadbolt->min_key_gap_us = DEADBOLT_MIN_KEY_GAP_US;
+}
+
+// Sends a response, then turns the lights off once the deadbolt is done
+static void sim_deadbolt_finish(powerbolt_sim_deadbolt_t *deadbolt, uint8_t response, uint64_t time_us, uint32_t lights_off_us,
+    powerbolt_sim_schedule_t *schedule) {
+    powerbolt_sim_schedule_add(schedule, time_us, 0, response);
+    powerbolt_sim_schedule_add(schedule, time_us + lights_off_us, 0, 0xC7);
+    deadbolt->busy_until_us = time_us + lights_off_us;
+    deadbolt->entered_length = 0;
+    deadbolt->lights_on = false;
+}
+
+// Red flashes then lights off, the entered code is forgotten
+static void sim_deadbolt_reject(powerbolt_sim_deadbolt_t *deadbolt, uint64_t time_us, powerbolt_sim_schedule_t *schedule) {
+    sim_deadbolt_finish(deadbolt, 0xC3, time_us + DEADBOLT_ACK_DELAY_US, DEADBOLT_REJECT_US, schedule);
+}
+
+void powerbolt_sim_deadbolt_key(powerbolt_sim_deadbolt_t *deadbolt, uint8_t key, uint64_t time_us, powerbolt_sim_schedule_t *schedule) {
+    if (time_us < deadbolt->busy_until_us)
+        return;
+
+    // Still busy with the previous key, the deadbolt never sees this one
+    if (deadbolt->lights_on && time_us - deadbolt->last_ack_us < deadbolt->min_key_gap_us)
+        return;
+
+    if (key == 0xD4) {
+        sim_deadbolt_reject(deadbolt, time_us, schedule);
+        return;
+    }
+    if (key == 0xD2) {
+        deadbolt->entered_length = 0;
+        deadbolt->lights_on = false;
+        return;
+    }
+
+    uint64_t ack_us = time_us + DEADBOLT_ACK_DELAY_US;
+    powerbolt_sim_schedule_add(schedule, ack_us, 0, 0xC4);
+    deadbolt->last_ack_us = ack_us;
+    deadbolt->lights_on = true;
+
+    // Green stays on while the bolt turns, locking while locked waits for the keypad to time out
+    if (key == 0x0E) {
+        if (!deadbolt->locked) {
+            deadbolt->locked = true;
+            sim_deadbolt_finish(deadbolt, 0xC1, ack_us + DEADBOLT_BOLT_TURN_US, DEADBOLT_LIGHTS_OFF_US, schedule);
+        }
+        return;
+    }
+
+    if (deadbolt->entered_length < sizeof(deadbolt->entered))
+        deadbolt->entered[deadbolt->entered_length++] = key;
+    if (deadbolt->entered_length < deadbolt->code_length)
+        return;
+
+    if (memcmp(deadbolt->entered, deadbolt->code, deadbolt->code_length) == 0) {
+        deadbolt->locked = false;
+        sim_deadbolt_finish(deadbolt, 0xC2, ack_us + DEADBOLT_ACK_DELAY_US, DEADBOLT_BOLT_TURN_US, schedule);
+    }
+    else
+        sim_deadbolt_reject(deadbolt, ack_us, schedule);
+}
+
+void powerbolt_sim_keypad_init(powerbolt_sim_keypad_t *keypad, uint32_t timeout_us) {
+    keypad->waiting = false;
+    keypad->last_activity_us = 0;
+    keypad->timeout_us = timeout_us;
+}
+
+// The keypad stays lit after a C4 until the deadbolt turns the lights off
+void powerbolt_sim_keypad_frame(powerbolt_sim_keypad_t *keypad, uint8_t port, uint8_t data, uint64_t time_us) {
+    keypad->last_activity_us = time_us;
+    if (port == 0 && data == 0xC4)
+        keypad->waiting = true;
+    else if (port == 0 && data == 0xC7)
+        keypad->waiting = false;
+}
+
+bool powerbolt_sim_keypad_poll(powerbolt_sim_keypad_t *keypad, uint64_t time_us, powerbolt_sim_schedule_t *schedule) {
+    if (!keypad->waiting || time_us - keypad->last_activity_us < keypad->timeout_us)
+        return false;
+
+    keypad->waiting = false;
+    return powerbolt_sim_schedule_add(schedule, time_us, 1, 0xD4);
+}
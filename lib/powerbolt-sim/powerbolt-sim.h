@@ -0,0 +1,101 @@
+#ifndef POWERBOLT_SIM_H
+#define POWERBOLT_SIM_H
+
+#include "powerbolt-protocol.h"
+
+// Virtual deadbolt, keypad and wire for running the protocol code off-target
+// Time is simulated in us, symbol streams use the same tick rates as the device
+// (writer 0.1ms, reader 0.01ms)
+
+#define POWERBOLT_SIM_WRITE_TICK_US     100
+#define POWERBOLT_SIM_READ_TICK_US      10
+#define POWERBOLT_SIM_MAX_SYMBOLS       (20 * POWERBOLT_KEY_SYMBOLS)
+#define POWERBOLT_SIM_MAX_RUN           64
+#define POWERBOLT_SIM_MAX_RUNS          64
+#define POWERBOLT_SIM_MAX_FRAMES        32
+
+// Wire between a sender and an RMT reader
+// drift scales every duration (the sender's clock), jitter moves every edge by up to +/- jitter_us,
+// glitch_rate is the chance of a short noise pulse in front of a frame
+// The reader ends a run when a level lasts longer than idle_threshold_us, like the RMT receiver
+typedef struct {
+    double drift;
+    uint32_t jitter_us;
+    uint32_t idle_threshold_us;
+    double glitch_rate;
+    uint32_t seed;
+} powerbolt_sim_wire_t;
+
+typedef struct {
+    uint32_t symbols[POWERBOLT_SIM_MAX_RUN];
+    size_t len;
+    uint64_t end_us;    // When the reader delivers the run, relative to the start of the transmission
+} powerbolt_sim_run_t;
+
+// A frame waiting to be put on a wire
+// Port 0 is the deadbolt talking to the keypad, port 1 is the keypad (or this device) talking to the deadbolt
+typedef struct {
+    uint64_t time_us;
+    uint8_t port;
+    uint8_t data;
+} powerbolt_sim_frame_t;
+
+typedef struct {
+    powerbolt_sim_frame_t frames[POWERBOLT_SIM_MAX_FRAMES];
+    size_t count;
+} powerbolt_sim_schedule_t;
+
+// Deadbolt state machine from the readme sequences
+// Keys that arrive sooner than min_key_gap_us after the previous C4 are lost, which is what
+// ack pacing has to learn
+typedef struct {
+    bool locked;
+    uint8_t code[8];
+    uint8_t code_length;
+    uint8_t entered[8];
+    uint8_t entered_length;
+    bool lights_on;
+    uint64_t busy_until_us;
+    uint64_t last_ack_us;
+    uint32_t min_key_gap_us;
+} powerbolt_sim_deadbolt_t;
+
+// Keypad state machine, it decides when a sequence has timed out and sends D4
+typedef struct {
+    bool waiting;
+    uint64_t last_activity_us;
+    uint32_t timeout_us;
+} powerbolt_sim_keypad_t;
+
+extern "C" {
+    void powerbolt_sim_wire_init(powerbolt_sim_wire_t *wire, double drift, uint32_t jitter_us, uint32_t seed);
+
+    // Plays a transmit buffer (at most POWERBOLT_SIM_MAX_SYMBOLS) over the wire, returns the runs the
+    // reader would deliver
+    size_t powerbolt_sim_wire_transmit(powerbolt_sim_wire_t *wire, const rmt_data_t tx[], size_t len, uint32_t tx_tick_us,
+        powerbolt_sim_run_t runs[], size_t max_runs);
+
+    // Samples a transmit buffer every sample_us like the ULP capture loop, returns the edge records it
+    // would store (see powerbolt-capture.h). The line idles low and level_bit is its level bit in a record
+    size_t powerbolt_sim_wire_capture(powerbolt_sim_wire_t *wire, const rmt_data_t tx[], size_t len, uint32_t tx_tick_us,
+        double sample_us, uint32_t level_bit, uint32_t records[], size_t max_records);
+
+    // Total time a transmit buffer occupies the wire
+    uint64_t powerbolt_sim_duration_us(const rmt_data_t tx[], size_t len, uint32_t tx_tick_us);
+
+    void powerbolt_sim_schedule_init(powerbolt_sim_schedule_t *schedule);
+    bool powerbolt_sim_schedule_add(powerbolt_sim_schedule_t *schedule, uint64_t time_us, uint8_t port, uint8_t data);
+    const powerbolt_sim_frame_t *powerbolt_sim_schedule_peek(const powerbolt_sim_schedule_t *schedule);
+    bool powerbolt_sim_schedule_next(powerbolt_sim_schedule_t *schedule, powerbolt_sim_frame_t *frame);
+
+    void powerbolt_sim_deadbolt_init(powerbolt_sim_deadbolt_t *deadbolt, const uint8_t code[], uint8_t code_length, bool locked);
+    // A key byte arrived at the deadbolt, its responses are added to the schedule
+    void powerbolt_sim_deadbolt_key(powerbolt_sim_deadbolt_t *deadbolt, uint8_t key, uint64_t time_us, powerbolt_sim_schedule_t *schedule);
+
+    void powerbolt_sim_keypad_init(powerbolt_sim_keypad_t *keypad, uint32_t timeout_us);
+    // Tracks traffic on both wires, poll adds D4 to the schedule when the keypad times out
+    void powerbolt_sim_keypad_frame(powerbolt_sim_keypad_t *keypad, uint8_t port, uint8_t data, uint64_t time_us);
+    bool powerbolt_sim_keypad_poll(powerbolt_sim_keypad_t *keypad, uint64_t time_us, powerbolt_sim_schedule_t *schedule);
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,118 @@
+#include "powerbolt-trace.h"
+
+static size_t trace_put_varint(uint8_t buffer[], uint64_t value) {
+    size_t length = 0;
+    do {
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        buffer[length++] = byte | (value ? 0x80 : 0);
+    } while (value);
+    return length;
+}
+
+static bool trace_get_varint(powerbolt_trace_reader_t *reader, uint64_t *value) {
+    *value = 0;
+    for (uint8_t shift = 0; shift < 64; shift += 7) {
+        if (reader->pos >= reader->length)
+            return false;
+        uint8_t byte = reader->data[reader->pos++];
+        *value |= (uint64_t) (byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// One half of an RMT symbol (duration:15, level:1) with the level moved to the bottom, so short
+// durations fit in one byte whatever the level
+static uint32_t trace_pack_half(uint32_t half) {
+    return (half & 0x7FFF) << 1 | (half >> 15 & 1);
+}
+
+static uint32_t trace_unpack_half(uint64_t value) {
+    return (uint32_t) (value >> 1 & 0x7FFF) | (uint32_t) (value & 1) << 15;
+}
+
+size_t powerbolt_trace_header(uint8_t buffer[], uint32_t tick_ns) {
+    buffer[0] = 'P';
+    buffer[1] = 'B';
+    buffer[2] = 'T';
+    buffer[3] = POWERBOLT_TRACE_VERSION;
+    for (uint8_t i = 0; i < 4; i++)
+        buffer[4 + i] = tick_ns >> (8 * i);
+    return POWERBOLT_TRACE_HEADER_SIZE;
+}
+
+void powerbolt_trace_writer_init(powerbolt_trace_writer_t *writer) {
+    writer->last_timestamp = 0;
+}
+
+size_t powerbolt_trace_encode(powerbolt_trace_writer_t *writer, uint8_t buffer[], uint8_t port,
+    const uint32_t symbols[], size_t len, int64_t timestamp) {
+    if (len > POWERBOLT_TRACE_MAX_SYMBOLS)
+        len = POWERBOLT_TRACE_MAX_SYMBOLS;
+
+    // Runs from the two readers can be handed over slightly out of order
+    int64_t delta = timestamp - writer->last_timestamp;
+    if (delta < 0)
+        delta = 0;
+    else
+        writer->last_timestamp = timestamp;
+
+    size_t length = 0;
+    buffer[length++] = port;
+    length += trace_put_varint(&buffer[length], delta);
+    length += trace_put_varint(&buffer[length], len);
+    for (size_t i = 0; i < len; i++) {
+        length += trace_put_varint(&buffer[length], trace_pack_half(symbols[i] & 0xFFFF));
+        length += trace_put_varint(&buffer[length], trace_pack_half(symbols[i] >> 16));
+    }
+    return length;
+}
+
+static bool trace_is_header(const uint8_t data[], size_t length) {
+    return length >= POWERBOLT_TRACE_HEADER_SIZE && data[0] == 'P' && data[1] == 'B' && data[2] == 'T'
+        && data[3] == POWERBOLT_TRACE_VERSION;
+}
+
+bool powerbolt_trace_reader_begin(powerbolt_trace_reader_t *reader, const uint8_t data[], size_t length) {
+    if (!trace_is_header(data, length))
+        return false;
+
+    reader->data = data;
+    reader->length = length;
+    reader->pos = POWERBOLT_TRACE_HEADER_SIZE;
+    reader->timestamp = 0;
+    reader->tick_ns = 0;
+    for (uint8_t i = 0; i < 4; i++)
+        reader->tick_ns |= (uint32_t) data[4 + i] << (8 * i);
+    return true;
+}
+
+bool powerbolt_trace_next(powerbolt_trace_reader_t *reader, powerbolt_trace_run_t *run) {
+    // Every wake starts a new segment with its own header and a clock that restarted at boot,
+    // segments are kept apart in time so repeats are never merged across them
+    while (trace_is_header(&reader->data[reader->pos], reader->length - reader->pos)) {
+        reader->pos += POWERBOLT_TRACE_HEADER_SIZE;
+        reader->timestamp += POWERBOLT_TRACE_SEGMENT_GAP_US;
+    }
+    if (reader->pos >= reader->length)
+        return false;
+
+    uint64_t delta, len;
+    run->port = reader->data[reader->pos++];
+    if (!trace_get_varint(reader, &delta) || !trace_get_varint(reader, &len) || len > POWERBOLT_TRACE_MAX_SYMBOLS)
+        return false;
+
+    for (size_t i = 0; i < len; i++) {
+        uint64_t low, high;
+        if (!trace_get_varint(reader, &low) || !trace_get_varint(reader, &high))
+            return false;
+        run->symbols[i] = trace_unpack_half(low) | trace_unpack_half(high) << 16;
+    }
+
+    reader->timestamp += delta;
+    run->timestamp = reader->timestamp;
+    run->len = len;
+    return true;
+}
@@ -0,0 +1,54 @@
+#ifndef POWERBOLT_TRACE_H
+#define POWERBOLT_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Raw RMT runs from both readers, recorded on the device and replayed by src/native/replay.cpp
+// Layout:
+//      header: "PBT", version (1), reader tick in ns (4, little endian)
+//      per run: port (1, lock * 2 + reader), us since the previous run (LEB128 varint), symbol count (LEB128 varint),
+//               then both halves of every symbol as LEB128 varints of duration << 1 | level
+// Most halves are under 64 ticks (0.64ms) and take one byte, a frame is about 20 bytes
+// A header can appear again part way through, each wake starts a new segment with its own header
+// Over serial every chunk is written as a line of "T " and hex so it can share the port with logging
+#define POWERBOLT_TRACE_VERSION         1
+#define POWERBOLT_TRACE_HEADER_SIZE     8
+#define POWERBOLT_TRACE_MAX_SYMBOLS     64
+#define POWERBOLT_TRACE_MAX_RECORD      (1 + 10 + 1 + POWERBOLT_TRACE_MAX_SYMBOLS * 6)
+#define POWERBOLT_TRACE_LINE_PREFIX     "T "
+#define POWERBOLT_TRACE_SEGMENT_GAP_US  1000000
+
+typedef struct {
+    int64_t last_timestamp;
+} powerbolt_trace_writer_t;
+
+typedef struct {
+    const uint8_t *data;
+    size_t length;
+    size_t pos;
+    int64_t timestamp;
+    uint32_t tick_ns;
+} powerbolt_trace_reader_t;
+
+typedef struct {
+    uint8_t port;
+    int64_t timestamp;
+    size_t len;
+    uint32_t symbols[POWERBOLT_TRACE_MAX_SYMBOLS];
+} powerbolt_trace_run_t;
+
+extern "C" {
+    size_t powerbolt_trace_header(uint8_t buffer[], uint32_t tick_ns);
+    void powerbolt_trace_writer_init(powerbolt_trace_writer_t *writer);
+    // Encodes one run into buffer (at least POWERBOLT_TRACE_MAX_RECORD bytes), returns its length
+    size_t powerbolt_trace_encode(powerbolt_trace_writer_t *writer, uint8_t buffer[], uint8_t port,
+        const uint32_t symbols[], size_t len, int64_t timestamp);
+
+    // False when the data does not start with a trace header
+    bool powerbolt_trace_reader_begin(powerbolt_trace_reader_t *reader, const uint8_t data[], size_t length);
+    // False at the end of the trace or at a truncated record
+    bool powerbolt_trace_next(powerbolt_trace_reader_t *reader, powerbolt_trace_run_t *run);
+}
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Lock-free single-producer/single-consumer ring buffer
+// The producer can be an ISR or driver callback and the consumer a task, no locks are taken on either side
+// Indices run freely and are only wrapped when indexing, so SIZE must be a power of two
+// Overflow and high watermark counters are only written by the producer
+template <typename T, size_t SIZE>
+class spsc_ring {
+    static_assert(SIZE > 0 && (SIZE & (SIZE - 1)) == 0, "spsc_ring size must be a power of two");
+
+public:
+    typedef struct {
+        uint32_t timestamp;
+        T value;
+    } entry_t;
+
+    spsc_ring() : head(0), tail(0), overflows(0), watermark(0) {}
+
+    // Producer: returns false and counts an overflow when the ring is full
+    bool push(const T &value, uint32_t timestamp) {
+        uint32_t current_head = head.load(std::memory_order_relaxed);
+        uint32_t used = current_head - tail.load(std::memory_order_acquire);
+        if (used >= SIZE) {
+            overflows.store(overflows.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return false;
+        }
+
+        entry_t &entry = entries[current_head & (SIZE - 1)];
+        entry.timestamp = timestamp;
+        entry.value = value;
+
+        // Publish the entry only after it has been written
+        head.store(current_head + 1, std::memory_order_release);
+
+        if (used + 1 > watermark.load(std::memory_order_relaxed))
+            watermark.store(used + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Consumer: returns false when the ring is empty
+    bool pop(entry_t &entry) {
+        return pop_batch(&entry, 1) == 1;
+    }
+
+    // Consumer: copies up to max entries in order and returns how many were copied
+    size_t pop_batch(entry_t out[], size_t max) {
+        uint32_t current_tail = tail.load(std::memory_order_relaxed);
+        uint32_t available = head.load(std::memory_order_acquire) - current_tail;
+        size_t count = available < max ? available : max;
+
+        for (size_t i = 0; i < count; i++)
+            out[i] = entries[(current_tail + i) & (SIZE - 1)];
+
+        // Hand the slots back to the producer only after they have been copied
+        tail.store(current_tail + count, std::memory_order_release);
+        return count;
+    }
+
+    size_t size() const {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    size_t capacity() const {
+        return SIZE;
+    }
+
+    uint32_t overflow_count() const {
+        return overflows.load(std::memory_order_relaxed);
+    }
+
+    uint32_t high_watermark() const {
+        return watermark.load(std::memory_order_relaxed);
+    }
+
+private:
+    entry_t entries[SIZE];
+    std::atomic<uint32_t> head;
+    std::atomic<uint32_t> tail;
+    std::atomic<uint32_t> overflows;
+    std::atomic<uint32_t> watermark;
+};
+
+#endif
@@ -0,0 +1,254 @@
+#include <Arduino.h>
+#include "event-batch.h"
+#include "powerbolt-command.h"
+#include "powerbolt-decoder.h"
+#include "powerbolt-protocol.h"
+#include "spsc-ring.h"
+
+// Benchmarks for the protocol, queue and command paths, results are printed as one JSON object
+//      Host:   pio run -e native-bench && .pio/build/native-bench/program
+//      ESP32:  pio run -e nodemcu-32s-bench -t upload -t monitor
+// The ESP32 build counts CPU cycles, the host build only has wall clock time
+
+#ifndef FIRMWARE_VERSION
+#define FIRMWARE_VERSION        "unknown"
+#endif
+
+#define BENCH_SAMPLES           5
+#define BENCH_MAX_RESULTS       16
+#define BENCH_MIN_ITERATIONS    64
+
+#ifdef ARDUINO_ARCH_ESP32
+#define BENCH_PLATFORM          "esp32"
+#define BENCH_SAMPLE_NS         50000000ULL
+#else
+#include <chrono>
+#define BENCH_PLATFORM          "native"
+#define BENCH_SAMPLE_NS         100000000ULL
+#endif
+
+// Ratio between the writer (0.1ms) and reader (0.01ms) ticks
+#define BENCH_READ_TICKS_PER_WRITE_TICK 10
+
+typedef struct {
+    const char *name;
+    uint32_t iterations;
+    double ns_min;
+    double ns_median;
+    double cycles_median;
+} bench_result_t;
+
+typedef void (*bench_function_t)(uint32_t iterations);
+
+static bench_result_t bench_results[BENCH_MAX_RESULTS];
+static size_t bench_result_count = 0;
+static volatile uint32_t bench_sink;
+
+#ifdef ARDUINO_ARCH_ESP32
+// The cycle counter wraps every 18s at 240MHz, samples are far shorter
+static inline uint32_t bench_cycles() {
+    return ESP.getCycleCount();
+}
+
+static inline uint64_t bench_ns() {
+    return (uint64_t) esp_timer_get_time() * 1000;
+}
+#else
+static inline uint32_t bench_cycles() {
+    return 0;
+}
+
+static inline uint64_t bench_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+
+static void bench_sort(double values[], size_t count) {
+    for (size_t i = 1; i < count; i++) {
+        double value = values[i];
+        size_t j = i;
+        for (; j > 0 && values[j - 1] > value; j--)
+            values[j] = values[j - 1];
+        values[j] = value;
+    }
+}
+
+// Doubles the iteration count until one sample takes long enough to time, then keeps the best and
+// median of several samples
+static void bench_run(const char *name, bench_function_t function) {
+    if (bench_result_count >= BENCH_MAX_RESULTS)
+        return;
+
+    uint32_t iterations = BENCH_MIN_ITERATIONS;
+    for (;;) {
+        uint64_t start = bench_ns();
+        function(iterations);
+        if (bench_ns() - start >= BENCH_SAMPLE_NS / 10 || iterations >= 0x40000000)
+            break;
+        iterations *= 2;
+    }
+    iterations *= 10;
+
+    double ns[BENCH_SAMPLES];
+    double cycles[BENCH_SAMPLES];
+    for (size_t i = 0; i < BENCH_SAMPLES; i++) {
+        uint64_t start = bench_ns();
+        uint32_t start_cycles = bench_cycles();
+        function(iterations);
+        cycles[i] = (double) (uint32_t) (bench_cycles() - start_cycles) / iterations;
+        ns[i] = (double) (bench_ns() - start) / iterations;
+    }
+    bench_sort(ns, BENCH_SAMPLES);
+    bench_sort(cycles, BENCH_SAMPLES);
+
+    bench_result_t *result = &bench_results[bench_result_count++];
+    result->name = name;
+    result->iterations = iterations;
+    result->ns_min = ns[0];
+    result->ns_median = ns[BENCH_SAMPLES / 2];
+    result->cycles_median = cycles[BENCH_SAMPLES / 2];
+}
+
+// A received frame in reader ticks, as the RMT delivers the first copy (8 data bits then the stop bit)
+static uint32_t bench_frame[9];
+
+static void bench_make_frame(uint8_t command) {
+    rmt_data_t waveform[POWERBOLT_KEY_SYMBOLS];
+    powerbolt_write_buffer_raw(waveform, command);
+    for (uint8_t i = 0; i < 9; i++) {
+        rmt_data_t symbol = waveform[i + 1];
+        symbol.duration0 *= BENCH_READ_TICKS_PER_WRITE_TICK;
+        symbol.duration1 *= BENCH_READ_TICKS_PER_WRITE_TICK;
+        bench_frame[i] = symbol.val;
+    }
+
+    // The stop bit low is too long for the receiver
+    bench_frame[8] &= 0x7FFF | 1 << 15;
+}
+
+static void bench_write_buffer(uint32_t iterations) {
+    rmt_data_t buffer[POWERBOLT_KEY_SYMBOLS];
+    for (uint32_t i = 0; i < iterations; i++) {
+        powerbolt_write_buffer(buffer, (POWERBOLT_KEY_CODES) (i % sizeof(powerbolt_key_codes)));
+        bench_sink ^= buffer[i % POWERBOLT_KEY_SYMBOLS].val;
+    }
+}
+
+static void bench_write_buffer_raw(uint32_t iterations) {
+    rmt_data_t buffer[POWERBOLT_KEY_SYMBOLS];
+    for (uint32_t i = 0; i < iterations; i++) {
+        powerbolt_write_buffer_raw(buffer, (uint8_t) i);
+        bench_sink ^= buffer[i % POWERBOLT_KEY_SYMBOLS].val;
+    }
+}
+
+static void bench_parse_buffer(uint32_t iterations) {
+    for (uint32_t i = 0; i < iterations; i++)
+        bench_sink ^= powerbolt_parse_buffer(bench_frame).data;
+}
+
+static void bench_decoder_feed(uint32_t iterations) {
+    static powerbolt_decoder_t decoder;
+    powerbolt_read_t frames[2];
+    powerbolt_decoder_init(&decoder);
+    for (uint32_t i = 0; i < iterations; i++) {
+        if (powerbolt_decoder_feed(&decoder, bench_frame, 9, frames, 2) > 0)
+            bench_sink ^= frames[0].data;
+    }
+}
+
+// One push and one pop, the same work the RMT callback and loop() do for every frame
+static void bench_queue(uint32_t iterations) {
+    static spsc_ring<uint16_t, 128> queue;
+    spsc_ring<uint16_t, 128>::entry_t entry;
+    for (uint32_t i = 0; i < iterations; i++) {
+        queue.push((uint16_t) i, i);
+        if (queue.pop(entry))
+            bench_sink ^= entry.value;
+    }
+}
+
+static void bench_event_batch(EVENT_BATCH_ENCODING encoding, uint32_t iterations) {
+    static event_batch_t batch;
+    event_batch_begin(&batch, encoding);
+    for (uint32_t i = 0; i < iterations; i++) {
+        if (!event_batch_add(&batch, EVENT_FRAME_DEADBOLT, (uint8_t) i, i * 20)) {
+            bench_sink ^= batch.length;
+            event_batch_begin(&batch, encoding);
+        }
+    }
+}
+
+static void bench_event_batch_text(uint32_t iterations) {
+    bench_event_batch(EVENT_BATCH_TEXT, iterations);
+}
+
+static void bench_event_batch_binary(uint32_t iterations) {
+    bench_event_batch(EVENT_BATCH_BINARY, iterations);
+}
+
+// A mix of MQTT payloads, including ones that are not commands
+static const char *bench_payloads[] = {
+    "DB1234", "DB#D4C3", "DB12L?", "DB?", "> locked", "DB98765432109876543"
+};
+
+static void bench_command_parse(uint32_t iterations) {
+    const size_t payload_count = sizeof(bench_payloads) / sizeof(bench_payloads[0]);
+    size_t lengths[payload_count];
+    for (size_t i = 0; i < payload_count; i++)
+        lengths[i] = strlen(bench_payloads[i]);
+
+    powerbolt_command_t command;
+    for (uint32_t i = 0; i < iterations; i++) {
+        size_t n = i % payload_count;
+        if (powerbolt_command_parse((const uint8_t *) bench_payloads[n], lengths[n], &command))
+            bench_sink ^= command.count;
+    }
+}
+
+static void bench_report() {
+    printf("{\"platform\":\"%s\",\"version\":\"%s\",\"compiler\":\"%s\",\"benchmarks\":[", BENCH_PLATFORM, FIRMWARE_VERSION, __VERSION__);
+    for (size_t i = 0; i < bench_result_count; i++) {
+        const bench_result_t *result = &bench_results[i];
+        printf("%s\n  {\"name\":\"%s\",\"iterations\":%u,\"ns_per_op_min\":%.2f,\"ns_per_op_median\":%.2f",
+            i ? "," : "", result->name, result->iterations, result->ns_min, result->ns_median);
+#ifdef ARDUINO_ARCH_ESP32
+        printf(",\"cycles_per_op_median\":%.1f", result->cycles_median);
+#endif
+        printf("}");
+    }
+    printf("\n]}\n");
+    fflush(stdout);
+}
+
+static void bench_all() {
+    bench_make_frame(0xC4);
+
+    bench_run("powerbolt_write_buffer", bench_write_buffer);
+    bench_run("powerbolt_write_buffer_raw", bench_write_buffer_raw);
+    bench_run("powerbolt_parse_buffer", bench_parse_buffer);
+    bench_run("powerbolt_decoder_feed", bench_decoder_feed);
+    bench_run("spsc_ring_push_pop", bench_queue);
+    bench_run("event_batch_add_text", bench_event_batch_text);
+    bench_run("event_batch_add_binary", bench_event_batch_binary);
+    bench_run("powerbolt_command_parse", bench_command_parse);
+
+    bench_report();
+}
+
+#ifdef ARDUINO_ARCH_ESP32
+void setup() {
+    Serial.begin(115200);
+    delay(1000);
+    bench_all();
+}
+
+void loop() {
+    delay(1000);
+}
+#else
+int main() {
+    bench_all();
+    return 0;
+}
+#endif
@@ -3,9 +3,27 @@
 #include <WiFi.h>
 #include <WiFiClientSecure.h>
 #include <PubSubClient.h>
+#include <Preferences.h>
+#include <SPIFFS.h>
+#include <sys/time.h>
+#include "freertos/semphr.h"
+#if CONFIG_PM_ENABLE
+#include "driver/gpio.h"
+#include "esp_pm.h"
+#endif
 
 // Private libraries
+#include "deferred-log.h"
+#include "event-batch.h"
+#include "event-log.h"
+#include "latency-histogram.h"
+#include "local-endpoint.h"
+#include "powerbolt-command.h"
+#include "powerbolt-pacing.h"
 #include "powerbolt-protocol.h"
+#include "powerbolt-sequence.h"
+#include "powerbolt-trace.h"
+#include "spsc-ring.h"
 
 // Project-specific
 #include "trinket-powerbolt.h"
@@ -14,6 +32,11 @@
 #include "aws-iot-credentials.h"
 #include "wifi-credentials.h"
 
+// Credentials from before the local endpoint leave it disabled
+#ifndef LOCAL_ENDPOINT_PSK
+#define LOCAL_ENDPOINT_PSK      ""
+#endif
+
 // IO Configuration
 #define I_BUTTON                0   // Button labeled "BOOT" on ESP32 dev board
 #define I_BOLT_LOCKED           25  // Microswitch input to detect when deadbolt is fully locked
@@ -23,6 +46,27 @@
 #define O_BLOCK_KEYPAD_RX       33  // Output low to block keypad from receiving lights from deadbolt (otherwise high-Z)
 #define O_BLOCK_BUZZER          27  // Output to block the buzzer
 
+// Locks served by this board, up to TRINKET_POWERBOLT_MAX_LOCKS, the pins above are the first lock
+// Each lock has its own MQTT topic, DEVICE_NAME for an unnamed lock and DEVICE_NAME/<name> otherwise
+// Only the first lock can be watched by the ULP in deep sleep, the keypad lines and bolt switches of
+// the others wake the device directly so they have to be RTC GPIOs
+typedef struct {
+    const char *name;
+    int keypad_read;
+    int deadbolt_rw;
+    int bolt_locked;
+    int bolt_unlocked;
+    int block_keypad_rx;
+    int block_buzzer;
+} lock_config_t;
+
+static const lock_config_t lock_configs[] = {
+    { "", I_KEYPAD_READ, IO_DEADBOLT_RW, I_BOLT_LOCKED, I_BOLT_UNLOCKED, O_BLOCK_KEYPAD_RX, O_BLOCK_BUZZER },
+//  { "back", 34, 4, 13, 14, 16, 17 },
+};
+#define LOCK_COUNT              (sizeof(lock_configs) / sizeof(lock_configs[0]))
+static_assert(LOCK_COUNT <= TRINKET_POWERBOLT_MAX_LOCKS, "More locks than the driver supports");
+
 // IoT Configuration
 #define DEVICE_NAME             "trinket-esp32-1"   // Used for AWS cert and as MQTT topic
 #define MQTT_SERVER             "ahu6v4hx3ap4w-ats.iot.us-east-1.amazonaws.com"
@@ -31,8 +75,43 @@
 // Generic Configuration
 #define EVENT_WAIT_TIME_MS      10000   // Time in ms since the last event before entering sleep
 #define SLEEP_TIME_S            30
-#define POWERBOLT_WRITE_WAIT_MS 750     // Time to wait between writes to the deadbolt
-#define POWERBOLT_QUEUE_SIZE    100
+#define POWERBOLT_WRITE_ON_ACK  true    // Send each key as soon as the deadbolt acks the previous one
+#define POWERBOLT_QUEUE_SIZE    128     // Must be a power of two
+#define KEYPAD_ULP_CAPTURE      true    // Capture keypad frames with the ULP during deep sleep
+#define COMMAND_RESULT_TIMEOUT_MS 10000 // Time after a write for the deadbolt to finish its sequence
+#define COMMAND_TASK_STACK      4096
+#define COMMAND_TASK_PRIORITY   2       // Above loop() so queued commands start straight away
+#define MQTT_BATCH_WINDOW_MS    250     // Time to collect protocol and bolt events into one message
+#define MQTT_BATCH_ENCODING     EVENT_BATCH_TEXT    // EVENT_BATCH_BINARY for compact messages
+#define EVENT_LOG_NAMESPACE     "event-log"
+#define EVENT_LOG_UPLOAD_BATCH  16      // Log entries read per MQTT message, more than fit in one
+#define MQTT_POLL_MS            100     // Incoming messages are buffered by the AP until the next beacon anyway
+#define PM_MAX_FREQ_MHZ         240     // Power management limits, only used when CONFIG_PM_ENABLE is set
+#define PM_MIN_FREQ_MHZ         80
+#define WIFI_FAST_TIMEOUT_MS    2000    // Time allowed to rejoin the last AP with the saved lease
+#define WIFI_FULL_TIMEOUT_MS    10000   // Time allowed for a full scan, association and DHCP
+#define WIFI_RESUME_MAGIC       0x7b1e5a11
+#define LOCAL_ENDPOINT          true    // Commands from the local network as well, needs LOCAL_ENDPOINT_PSK
+#define LOCAL_PORT              7070
+#define LOCAL_AUTH_TIMEOUT_MS   1000    // From connecting to a valid auth line, bytes before it do not extend it
+#define LOCAL_IDLE_TIMEOUT_MS   60000   // A connected client keeps the device awake until it is quiet this long
+#define LOCAL_POLL_MS           10
+#define LOCAL_MESSAGE_SIZE      256
+#define LOG_TASK_STACK          3072
+#define LOG_TASK_PRIORITY       0       // Only formats and prints when nothing else wants the CPU
+#define LOG_DRAIN_MS            50
+#define TRACE_OUTPUT            TRACE_OFF   // TRACE_SERIAL or TRACE_FLASH to record raw RMT runs for src/native/replay.cpp
+#define TRACE_QUEUE_SIZE        32          // Must be a power of two
+#define TRACE_FILE              "/trace.bin"
+#define TRACE_FILE_MAX_BYTES    (512 * 1024)
+#define TELEMETRY_TOPIC         DEVICE_NAME "/telemetry"
+#define TELEMETRY_INTERVAL_S    3600    // Latency histograms and counters are published and cleared this often
+#define TELEMETRY_BOLT_WAIT_MS  2000    // Time after a command result to wait for the bolt switch
+#define TELEMETRY_MAGIC         0x74656c01
+#define LOCK_STATE_NAMESPACE    "lock-state"
+#define LOCK_STATE_MAGIC        0x73746101
+
+enum TRACE_OUTPUTS { TRACE_OFF, TRACE_SERIAL, TRACE_FLASH };
 
 WiFiClientSecure wifi_client;
 PubSubClient mqtt_client(wifi_client);
@@ -42,225 +121,882 @@ typedef struct {
     uint8_t port :1;
 } trinket_powerbolt_queued_msg_t;
 
-static void on_powerbolt_read(uint8_t port, powerbolt_read_t received);
+// Trace points of the command being written to a lock, in ms since boot
+// Received is stamped by the MQTT callback, started by the command task, written by the write done
+// callback, response by the first deadbolt frame after the write started, result when the command's
+// result is published and bolt by the first bolt switch interrupt. Reached has a bit per point.
+enum COMMAND_TRACE_POINTS {
+    TRACE_RECEIVED, TRACE_STARTED, TRACE_WRITTEN, TRACE_RESPONSE, TRACE_RESULT, TRACE_BOLT, TRACE_POINT_COUNT
+};
 
-static volatile union {
-    uint8_t flags;
-    struct {
-        uint8_t mqtt: 1;
-        uint8_t rmt: 1;
-        uint8_t locked: 1;
-        uint8_t unlocked: 1;
-    };
-} triggered_event_flags;
+typedef struct {
+    bool active;
+    uint8_t reached;
+    unsigned long points[TRACE_POINT_COUNT];
+} command_trace_t;
+
+// Everything kept per lock
+// The receive queue and sequence events are written from the powerbolt engine task and read from loop()
+// Commands are shared between loop(), the command task and the write done callback under command_mux
+// Bolt switch events are flagged by their interrupts under bolt_mux
+typedef struct {
+    const lock_config_t *config;
+    uint8_t index;
+    char topic[48];
+    char state_topic[56];
+    char desired_topic[56];
+    trinket_powerbolt_t *powerbolt;
+
+    spsc_ring<trinket_powerbolt_queued_msg_t, POWERBOLT_QUEUE_SIZE> queue;
+    uint32_t queue_reported_overflows;
+    powerbolt_sequence_t sequence;
+    spsc_ring<POWERBOLT_EVENTS, 8> events;
+
+    powerbolt_command_queue_t command_queue;
+    bool command_pending;
+    uint16_t command_pending_id;
+    unsigned long command_written_at;
+
+    unsigned long bolt_lock_debounce;
+    unsigned long bolt_unlock_debounce;
+    bool bolt_locked_pending;
+    bool bolt_unlocked_pending;
+
+    command_trace_t trace;
+} lock_t;
+
+static lock_t locks[LOCK_COUNT];
+static portMUX_TYPE bolt_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Telemetry, kept in RTC memory so one period spans many wakes, published on TELEMETRY_TOPIC once
+// TELEMETRY_INTERVAL_S have passed and then cleared
+// Command latencies run from a trace point to a later one, connect phases are timed once per wake and
+// event latency is from a frame or bolt switch to its upload, including any time spent offline
+// Histograms are recorded from loop() and the command task under telemetry_mux, the counters only from loop()
+enum TELEMETRY_LATENCIES {
+    LATENCY_QUEUED,     // Received to started
+    LATENCY_WRITE,      // Started to written
+    LATENCY_RESPONSE,   // Started to response
+    LATENCY_RESULT,     // Received to result
+    LATENCY_BOLT,       // Received to bolt
+    LATENCY_WIFI,
+    LATENCY_MQTT,
+    LATENCY_SUBSCRIBE,
+    LATENCY_ONLINE,     // Boot to subscribed
+    LATENCY_EVENT,
+    LATENCY_COUNT
+};
+
+static const char *const telemetry_latency_names[LATENCY_COUNT] = {
+    "queued", "write", "response", "result", "bolt", "wifi", "mqtt", "subscribe", "online", "event"
+};
+
+typedef struct {
+    uint32_t magic;
+    uint32_t period_start;
+    latency_histogram_t latencies[LATENCY_COUNT];
+    uint32_t wakes;
+    uint32_t reconnects;
+    uint32_t connect_failures;
+    uint32_t decode_errors;
+    uint32_t repeats_missing;
+    uint32_t ack_timeouts;
+    uint32_t runs_dropped;
+    uint32_t queue_overflows;
+} telemetry_t;
+
+RTC_DATA_ATTR static telemetry_t telemetry;
+static portMUX_TYPE telemetry_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Trace points are stamped from ISRs, the engine, the esp_timer task, the command task and loop()
+static portMUX_TYPE trace_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static void record_latency(TELEMETRY_LATENCIES latency, unsigned long latency_ms) {
+    portENTER_CRITICAL(&telemetry_mux);
+    latency_histogram_record(&telemetry.latencies[latency], latency_ms);
+    portEXIT_CRITICAL(&telemetry_mux);
+}
+
+static void record_trace_latency(const command_trace_t *trace, TELEMETRY_LATENCIES latency, COMMAND_TRACE_POINTS from,
+    COMMAND_TRACE_POINTS to) {
+    if ((trace->reached & 1 << from) && (trace->reached & 1 << to))
+        record_latency(latency, trace->points[to] - trace->points[from]);
+}
+
+static void record_command_trace(const command_trace_t *trace) {
+    record_trace_latency(trace, LATENCY_QUEUED, TRACE_RECEIVED, TRACE_STARTED);
+    record_trace_latency(trace, LATENCY_WRITE, TRACE_STARTED, TRACE_WRITTEN);
+    record_trace_latency(trace, LATENCY_RESPONSE, TRACE_STARTED, TRACE_RESPONSE);
+    record_trace_latency(trace, LATENCY_RESULT, TRACE_RECEIVED, TRACE_RESULT);
+    record_trace_latency(trace, LATENCY_BOLT, TRACE_RECEIVED, TRACE_BOLT);
+}
+
+// Safe from ISRs and from any task, only the first time a point is reached counts
+static void stamp_command_trace(lock_t *lock, COMMAND_TRACE_POINTS point) {
+    unsigned long timestamp = millis();
+    portENTER_CRITICAL_ISR(&trace_mux);
+    if (lock->trace.active && !(lock->trace.reached & 1 << point)) {
+        lock->trace.points[point] = timestamp;
+        lock->trace.reached |= 1 << point;
+    }
+    portEXIT_CRITICAL_ISR(&trace_mux);
+}
+
+// Command task only, called before the write starts so that a quick response is never missed
+// A trace still waiting for its bolt switch is recorded as it is
+static void begin_command_trace(lock_t *lock, uint32_t received) {
+    unsigned long timestamp = millis();
+    portENTER_CRITICAL(&trace_mux);
+    command_trace_t finished = lock->trace;
+    lock->trace.active = true;
+    lock->trace.reached = 1 << TRACE_RECEIVED | 1 << TRACE_STARTED;
+    lock->trace.points[TRACE_RECEIVED] = received;
+    lock->trace.points[TRACE_STARTED] = timestamp;
+    portEXIT_CRITICAL(&trace_mux);
+
+    if (finished.active)
+        record_command_trace(&finished);
+}
+
+// A write that never started has nothing worth recording
+static void abandon_command_trace(lock_t *lock) {
+    portENTER_CRITICAL(&trace_mux);
+    lock->trace.active = false;
+    portEXIT_CRITICAL(&trace_mux);
+}
+
+static void on_powerbolt_read(void *arg, uint8_t port, powerbolt_read_t received);
+static void on_powerbolt_write_done(void *arg);
+static void on_powerbolt_trace(void *arg, uint8_t port, const uint32_t *symbols, size_t len, int64_t timestamp);
+static void command_setup();
+static void event_log_setup();
+static void log_pending_events();
+static void trace_setup();
+static void write_traces();
+static void telemetry_setup();
+static void lock_state_setup();
+static void read_lock_switches(lock_t *lock, bool keep_moving);
+static void publish_lock_states();
+static void finish_command_traces(bool all);
+static void collect_telemetry_counters();
+static void publish_telemetry();
+static void log_setup();
+static void flush_log();
+static void send_local_message(const char *topic, const uint8_t *payload, size_t length);
+
+// Events for loop(), delivered as task notification bits so loop() can block until one arrives
+// Bits that loop() has received but not handled yet are kept in triggered_events
+#define TRIGGER_MQTT            (1 << 0)
+#define TRIGGER_RMT             (1 << 1)
+#define TRIGGER_LOCKED          (1 << 2)
+#define TRIGGER_UNLOCKED        (1 << 3)
+#define TRIGGER_WRITTEN         (1 << 4)
+#define TRIGGER_SEQUENCE        (1 << 5)
+#define TRIGGER_COMMAND         (1 << 6)
+#define TRIGGER_NETWORK         (1 << 7)
+#define TRIGGER_TRACE           (1 << 8)
+
+static TaskHandle_t loop_task_handle = NULL;
+static uint32_t triggered_events = 0;
+
+// Time each task spends running rather than blocked, published once per wake with stack high-water marks
+// loop() is only counted while it waits for events, connecting mostly blocks on the network
+static int64_t loop_events_start_us = 0;
+static int64_t loop_blocked_us = 0;
+static volatile uint32_t command_busy_us = 0;
+
+// Safe from ISRs (bolt switches, RMT receive) and from any task
+static void trigger_event(uint32_t event) {
+    if (loop_task_handle == NULL)
+        return;
+
+    if (xPortInIsrContext()) {
+        BaseType_t higher_priority_woken = pdFALSE;
+        xTaskNotifyFromISR(loop_task_handle, event, eSetBits, &higher_priority_woken);
+        if (higher_priority_woken)
+            portYIELD_FROM_ISR();
+    }
+    else
+        xTaskNotify(loop_task_handle, event, eSetBits);
+}
+
+// Blocks loop() until an event arrives or the timeout passes, returns the new events
+static uint32_t wait_for_events(unsigned long timeout_ms) {
+    uint32_t events = 0;
+    int64_t start = esp_timer_get_time();
+    xTaskNotifyWait(0, UINT32_MAX, &events, pdMS_TO_TICKS(timeout_ms));
+    loop_blocked_us += esp_timer_get_time() - start;
+    return events;
+}
 
 static void on_button_press() {
     // There is no configuration mode so do nothing
-    Serial.println("Button press");
+    LOG_INFO("Button press");
 }
 
-static unsigned long bolt_lock_debounce = 0;
-static void on_bolt_lock() {
+// The trigger bits say some lock changed, the flags on each lock say which
+static void on_bolt_lock(void *arg) {
+    lock_t *lock = (lock_t *) arg;
     unsigned long timestamp = millis();
-    if (bolt_lock_debounce == 0 || timestamp - bolt_lock_debounce > 100) {
-        Serial.println("Bolt locked");
-        bolt_lock_debounce = timestamp;
-        triggered_event_flags.locked = true;
+    if (lock->bolt_lock_debounce == 0 || timestamp - lock->bolt_lock_debounce > 100) {
+        portENTER_CRITICAL_ISR(&bolt_mux);
+        lock->bolt_lock_debounce = timestamp;
+        lock->bolt_locked_pending = true;
+        portEXIT_CRITICAL_ISR(&bolt_mux);
+        stamp_command_trace(lock, TRACE_BOLT);
+        LOG_INFO("Bolt locked %s", lock->topic);
+        trigger_event(TRIGGER_LOCKED);
     }
 }
 
-static unsigned long bolt_unlock_debounce = 0;
-static void on_bolt_unlock() {
+static void on_bolt_unlock(void *arg) {
+    lock_t *lock = (lock_t *) arg;
     unsigned long timestamp = millis();
-    if (bolt_unlock_debounce == 0 || timestamp - bolt_unlock_debounce > 100) {
-        Serial.println("Bolt unlocked");
-        bolt_unlock_debounce = timestamp;
-        triggered_event_flags.unlocked = true;
+    if (lock->bolt_unlock_debounce == 0 || timestamp - lock->bolt_unlock_debounce > 100) {
+        portENTER_CRITICAL_ISR(&bolt_mux);
+        lock->bolt_unlock_debounce = timestamp;
+        lock->bolt_unlocked_pending = true;
+        portEXIT_CRITICAL_ISR(&bolt_mux);
+        stamp_command_trace(lock, TRACE_BOLT);
+        LOG_INFO("Bolt unlocked %s", lock->topic);
+        trigger_event(TRIGGER_UNLOCKED);
     }
 }
 
+// Sets up one lock's pins and its driver instance, setup replays frames the ULP captured while asleep
+// so the callbacks and sequence tracking have to be ready before it
+static bool lock_setup(lock_t *lock, uint8_t index) {
+    const lock_config_t *config = &lock_configs[index];
+    lock->config = config;
+    lock->index = index;
+    if (config->name[0] == '\0')
+        snprintf(lock->topic, sizeof(lock->topic), "%s", DEVICE_NAME);
+    else
+        snprintf(lock->topic, sizeof(lock->topic), "%s/%s", DEVICE_NAME, config->name);
+    snprintf(lock->state_topic, sizeof(lock->state_topic), "%s/state", lock->topic);
+    snprintf(lock->desired_topic, sizeof(lock->desired_topic), "%s/desired", lock->topic);
+
+    pinMode(config->block_keypad_rx, INPUT);
+    pinMode(config->block_buzzer, INPUT);
+    powerbolt_sequence_init(&lock->sequence);
+    powerbolt_command_queue_init(&lock->command_queue);
+
+    trinket_powerbolt_config_t powerbolt_config = {
+        .keypad_read_pin = config->keypad_read,
+        .powerbolt_read_write_pin = config->deadbolt_rw,
+        .arg = lock,
+        .on_read = on_powerbolt_read,
+        .on_write_done = on_powerbolt_write_done,
+        .on_trace = TRACE_OUTPUT != TRACE_OFF ? on_powerbolt_trace : NULL
+    };
+    lock->powerbolt = trinket_powerbolt_setup(&powerbolt_config);
+    if (lock->powerbolt == NULL)
+        return false;
+
+    pinMode(config->bolt_locked, INPUT_PULLDOWN);
+    pinMode(config->bolt_unlocked, INPUT_PULLDOWN);
+    attachInterruptArg(config->bolt_locked, on_bolt_lock, lock, RISING);
+    attachInterruptArg(config->bolt_unlocked, on_bolt_unlock, lock, RISING);
+    return true;
+}
+
 void setup()
 {
-    // Hardware init (RMT reader first)
-    pinMode(O_BLOCK_KEYPAD_RX, INPUT);
-    trinket_powerbolt_setup(I_KEYPAD_READ, IO_DEADBOLT_RW);
-    trinket_powerbolt_on_read(on_powerbolt_read);
+    // Anything triggered before loop() starts waits in the notification value
+    loop_task_handle = xTaskGetCurrentTaskHandle();
 
-    pinMode(I_BUTTON, INPUT_PULLUP);
-    pinMode(I_BOLT_LOCKED, INPUT_PULLDOWN);
-    pinMode(I_BOLT_UNLOCKED, INPUT_PULLDOWN);
-    pinMode(O_BLOCK_BUZZER, INPUT);
+    // Lock setup replays the frames the ULP captured while asleep through the read callbacks, so the
+    // event log, telemetry, traces and the command task they feed have to be ready before it
+    event_log_setup();
+    telemetry_setup();
+    trace_setup();
+    command_setup();
+    bool locks_ready = true;
+    for (uint8_t i = 0; i < LOCK_COUNT; i++)
+        locks_ready &= lock_setup(&locks[i], i);
+    lock_state_setup();
 
+    pinMode(I_BUTTON, INPUT_PULLUP);
     attachInterrupt(I_BUTTON, on_button_press, FALLING);
-    attachInterrupt(I_BOLT_LOCKED, on_bolt_lock, RISING);
-    attachInterrupt(I_BOLT_UNLOCKED, on_bolt_unlock, RISING);
 
     Serial.begin(115200);
+    log_setup();
+    if (!locks_ready)
+        LOG_ERROR("Out of RMT channels for the locks");
 
     // Get wakeup reason (timer, pin)
     esp_sleep_wakeup_cause_t wakeup_reason = esp_sleep_get_wakeup_cause();
 
     if (wakeup_reason == ESP_SLEEP_WAKEUP_EXT0)
-        Serial.println("Wakeup from button");
+        LOG_INFO("Wakeup from button");
 
-    // If device was woken up from physical interaction with the deadbolt
+    // If device was woken up from physical interaction with a deadbolt
     else if (wakeup_reason == ESP_SLEEP_WAKEUP_EXT1) {
         uint64_t wakeup_interrupt = esp_sleep_get_ext1_wakeup_status();
+        for (uint8_t i = 0; i < LOCK_COUNT; i++) {
+            lock_t *lock = &locks[i];
+
+            // Only without ULP capture, the frame that caused the wakeup is lost
+            if (wakeup_interrupt & (1ULL << lock->config->keypad_read | 1ULL << lock->config->deadbolt_rw))
+                LOG_INFO("Wakeup from keypad %s", lock->topic);
 
-        // No action for keypad since the RMT read is not done
-        if (wakeup_interrupt & (1ULL << I_KEYPAD_READ | 1ULL << IO_DEADBOLT_RW))
-            Serial.println("Wakeup from keypad");
+            // If the device was woken up from a lock/unlock
+            else if (wakeup_interrupt == 1ULL << lock->config->bolt_locked)
+                on_bolt_lock(lock);
 
-        // If the device was woken up from a lock/unlock
-        else if (wakeup_interrupt == 1ULL << I_BOLT_LOCKED)
-            on_bolt_lock();
+            else if (wakeup_interrupt == 1ULL << lock->config->bolt_unlocked)
+                on_bolt_unlock(lock);
+        }
+    }
 
-        else if (wakeup_interrupt == 1ULL << I_BOLT_UNLOCKED)
-            on_bolt_unlock();
+    // The frames that woke the device have already been replayed through the read callback
+    else if (wakeup_reason == ESP_SLEEP_WAKEUP_ULP && locks[0].powerbolt != NULL) {
+        trinket_powerbolt_stats_t stats;
+        trinket_powerbolt_get_stats(locks[0].powerbolt, &stats);
+        LOG_INFO("Wakeup from keypad, %u edges captured", stats.ulp_edges);
     }
 
     // No action for timer, main loop will check for messages from MQTT server
     if (wakeup_reason == ESP_SLEEP_WAKEUP_TIMER)
-        Serial.println("Wakeup from timer");
+        LOG_INFO("Wakeup from timer");
     
-   Serial.println("Ready");
+    LOG_INFO("Ready");
 }
 
-static void allow_keypad_lights() {
-    pinMode(O_BLOCK_KEYPAD_RX, INPUT);
+static void allow_keypad_lights(const lock_t *lock) {
+    pinMode(lock->config->block_keypad_rx, INPUT);
 }
 
-static void block_keypad_lights() {
-    pinMode(O_BLOCK_KEYPAD_RX, OUTPUT);
-    digitalWrite(O_BLOCK_KEYPAD_RX, LOW);
+static void block_keypad_lights(const lock_t *lock) {
+    pinMode(lock->config->block_keypad_rx, OUTPUT);
+    digitalWrite(lock->config->block_keypad_rx, LOW);
 }
 
-static void allow_powerbolt_buzzer() {
-    pinMode(O_BLOCK_BUZZER, INPUT);
+static void allow_powerbolt_buzzer(const lock_t *lock) {
+    pinMode(lock->config->block_buzzer, INPUT);
 }
 
-static void block_powerbolt_buzzer() {
-    pinMode(O_BLOCK_BUZZER, OUTPUT);
-    digitalWrite(O_BLOCK_BUZZER, LOW);
+static void block_powerbolt_buzzer(const lock_t *lock) {
+    pinMode(lock->config->block_buzzer, OUTPUT);
+    digitalWrite(lock->config->block_buzzer, LOW);
 }
 
-// Ring buffer for storing powerbolt messages
-static uint8_t powerbolt_queue_read_ptr = 0;
-static uint8_t powerbolt_queue_write_ptr = 0;
-trinket_powerbolt_queued_msg_t powerbolt_queue[POWERBOLT_QUEUE_SIZE];
+// Commands are parsed in the MQTT callback, queued per lock and run one at a time per lock by command_task
+// The first event after a command is written is that command's result
+static portMUX_TYPE command_mux = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t command_task_handle = NULL;
+static uint16_t command_next_id = 0;
 
-static void on_powerbolt_read(uint8_t port, powerbolt_read_t received) {
-    Serial.print(port == 0 ? "Powerbolt" : "Keypad");
-    Serial.print(": ");
-    if (!received.valid) {
-        Serial.println("invalid");
-        return;
-    }
+// Results from the command task, published from loop() since the MQTT client is not thread safe
+typedef struct {
+    lock_t *lock;
+    uint16_t id;
+    const char *text;
+    bool result;
+} command_result_t;
+static spsc_ring<command_result_t, 8> command_results;
 
-    Serial.printf("%02x", received.data);
+// Runs on the powerbolt engine task on the other core, frames are printed when loop() drains them
+static void on_powerbolt_read(void *arg, uint8_t port, powerbolt_read_t received) {
+    lock_t *lock = (lock_t *) arg;
+    if (!received.valid)
+        return;
+    if (port == 0)
+        stamp_command_trace(lock, TRACE_RESPONSE);
 
-    // write to write ptr then increment, logic for read is read != write then read[]
     // If the queue is not full, insert received messages
-    uint8_t next_write_ptr = (powerbolt_queue_write_ptr + 1) % POWERBOLT_QUEUE_SIZE;
-    if (next_write_ptr != powerbolt_queue_read_ptr) {
-        Serial.println(" Q");
-        powerbolt_queue[powerbolt_queue_write_ptr] = {
-            .data = received.data,
-            .port = port
-        };
-        powerbolt_queue_write_ptr = next_write_ptr;
-        triggered_event_flags.rmt = true;
-    } else {
-        Serial.println(" XXX");
-    }
+    trinket_powerbolt_queued_msg_t msg;
+    msg.data = received.data;
+    msg.port = port;
+    if (lock->queue.push(msg, millis()))
+        trigger_event(TRIGGER_RMT);
+
+    // Keys written by this device are seen on the keypad port too, so they count as key presses
+    POWERBOLT_EVENTS event = powerbolt_sequence_feed(&lock->sequence, port, received.data);
+    if (event != POWERBOLT_EVENT_NONE && lock->events.push(event, millis()))
+        trigger_event(TRIGGER_SEQUENCE);
 
     // Stop blocking the lights and buzzer when the deadbolt sends C7
     if (port == 0 && received.valid && received.data == 0xC7) {
-        allow_powerbolt_buzzer();
-        allow_keypad_lights();
+        allow_powerbolt_buzzer(lock);
+        allow_keypad_lights(lock);
     }
 }
 
-static unsigned long last_powerbolt_write = 0;
-static void powerbolt_write(POWERBOLT_KEY_CODES key_code) {
-    unsigned long timestamp = millis();
-    unsigned long elapsed_since_last_write = timestamp - last_powerbolt_write;
-    if (last_powerbolt_write > 0 && elapsed_since_last_write < POWERBOLT_WRITE_WAIT_MS)
-        delay(POWERBOLT_WRITE_WAIT_MS - elapsed_since_last_write);
+static void wake_command_task() {
+    if (command_task_handle != NULL)
+        xTaskNotifyGive(command_task_handle);
+}
+
+// Runs on the esp_timer task, the result timeout starts once the last key is out
+static void on_powerbolt_write_done(void *arg) {
+    lock_t *lock = (lock_t *) arg;
+    portENTER_CRITICAL(&command_mux);
+    if (lock->command_pending)
+        lock->command_written_at = millis();
+    portEXIT_CRITICAL(&command_mux);
+    stamp_command_trace(lock, TRACE_WRITTEN);
+
+    trigger_event(TRIGGER_WRITTEN);
+    wake_command_task();
+}
+
+static void set_command_pending(lock_t *lock, bool pending, uint16_t id) {
+    portENTER_CRITICAL(&command_mux);
+    lock->command_pending = pending;
+    lock->command_pending_id = id;
+    lock->command_written_at = 0;
+    portEXIT_CRITICAL(&command_mux);
+}
+
+// The command is pending before the write starts so that a quick response is never missed
+static bool powerbolt_write(lock_t *lock, const POWERBOLT_KEY_CODES key_codes[], size_t count, uint16_t id) {
+    if (trinket_powerbolt_write_busy(lock->powerbolt))
+        return false;
+
+    block_keypad_lights(lock);
+    block_powerbolt_buzzer(lock);
+    set_command_pending(lock, true, id);
+    bool started = POWERBOLT_WRITE_ON_ACK ?
+        trinket_powerbolt_write_paced_async(lock->powerbolt, key_codes, count) :
+        trinket_powerbolt_write_async(lock->powerbolt, key_codes, count, POWERBOLT_WRITE_WAIT_MS);
+
+    if (!started)
+        set_command_pending(lock, false, id);
+    return started;
+}
+
+static bool powerbolt_write_raw(lock_t *lock, const uint8_t commands[], size_t count, uint16_t id) {
+    if (trinket_powerbolt_write_busy(lock->powerbolt))
+        return false;
+
+    block_keypad_lights(lock);
+    block_powerbolt_buzzer(lock);
+    set_command_pending(lock, true, id);
+    bool started = trinket_powerbolt_write_raw_async(lock->powerbolt, commands, count, POWERBOLT_WRITE_WAIT_MS);
+    if (!started)
+        set_command_pending(lock, false, id);
+    return started;
+}
+
+static const char *bolt_status(const lock_t *lock) {
+    bool locked = digitalRead(lock->config->bolt_locked);
+    bool unlocked = digitalRead(lock->config->bolt_unlocked);
+    return locked ? "locked" : unlocked ? "unlocked" : "unknown";
+}
 
-    block_keypad_lights();
-    block_powerbolt_buzzer();
-    trinket_powerbolt_write(key_code);
-    last_powerbolt_write = millis();
+// Command task only
+static void push_command_result(lock_t *lock, uint16_t id, const char *text, bool result) {
+    command_result_t command_result = { lock, id, text, result };
+    if (command_results.push(command_result, millis()))
+        trigger_event(TRIGGER_COMMAND);
+}
+
+static void execute_command(lock_t *lock, const powerbolt_command_t *command) {
+    if (powerbolt_command_is_write(command)) {
+        begin_command_trace(lock, command->received);
+        bool started = command->type == COMMAND_RAW ?
+            powerbolt_write_raw(lock, command->raw, command->count, command->id) :
+            powerbolt_write(lock, command->keys, command->count, command->id);
+        if (!started) {
+            abandon_command_trace(lock);
+            push_command_result(lock, command->id, "busy", true);
+        }
+    }
+
+    if (command->status)
+        push_command_result(lock, command->id, bolt_status(lock), false);
+}
+
+// Times out the pending result and runs what is queued for one lock, returns how long until the
+// pending result times out
+static TickType_t run_lock_commands(lock_t *lock) {
+    // The deadbolt never finished a sequence for the last command
+    portENTER_CRITICAL(&command_mux);
+    bool timed_out = lock->command_pending && lock->command_written_at != 0
+        && millis() - lock->command_written_at > COMMAND_RESULT_TIMEOUT_MS;
+    uint16_t timed_out_id = lock->command_pending_id;
+    if (timed_out)
+        lock->command_pending = false;
+    portEXIT_CRITICAL(&command_mux);
+    if (timed_out) {
+        stamp_command_trace(lock, TRACE_RESULT);
+        push_command_result(lock, timed_out_id, "none", true);
+    }
+
+    for (;;) {
+        powerbolt_command_t command;
+        portENTER_CRITICAL(&command_mux);
+        bool allow_writes = !lock->command_pending && !trinket_powerbolt_write_busy(lock->powerbolt);
+        bool popped = powerbolt_command_queue_pop(&lock->command_queue, allow_writes, &command);
+        portEXIT_CRITICAL(&command_mux);
+        if (!popped)
+            break;
+        execute_command(lock, &command);
+    }
+
+    TickType_t wait = portMAX_DELAY;
+    portENTER_CRITICAL(&command_mux);
+    if (lock->command_pending && lock->command_written_at != 0) {
+        unsigned long elapsed = millis() - lock->command_written_at;
+        wait = elapsed >= COMMAND_RESULT_TIMEOUT_MS ? 0 : pdMS_TO_TICKS(COMMAND_RESULT_TIMEOUT_MS - elapsed) + 1;
+    }
+    portEXIT_CRITICAL(&command_mux);
+    return wait;
 }
 
-static const POWERBOLT_KEY_CODES mqtt_key_map[] = {
-    KEY_90, KEY_12, KEY_12, KEY_34, KEY_34, KEY_56, KEY_56, KEY_78, KEY_78, KEY_90
+// Runs queued commands, a write waits until the previous write on the same lock has its result or has
+// timed out. Status queries never wait behind writes, and locks never wait for each other
+static void command_task(void *arg) {
+    TickType_t wait = portMAX_DELAY;
+    for (;;) {
+        // Woken for new commands, finished writes and results, or when a pending result times out
+        ulTaskNotifyTake(pdTRUE, wait);
+        int64_t start = esp_timer_get_time();
+
+        wait = portMAX_DELAY;
+        for (uint8_t i = 0; i < LOCK_COUNT; i++) {
+            if (locks[i].powerbolt == NULL)
+                continue;
+            TickType_t lock_wait = run_lock_commands(&locks[i]);
+            if (lock_wait < wait)
+                wait = lock_wait;
+        }
+
+        command_busy_us += esp_timer_get_time() - start;
+    }
+}
+
+static void command_setup() {
+    xTaskCreatePinnedToCore(command_task, "command", COMMAND_TASK_STACK, NULL, COMMAND_TASK_PRIORITY, &command_task_handle, 1);
+}
+
+static bool command_busy() {
+    bool busy = false;
+    portENTER_CRITICAL(&command_mux);
+    for (uint8_t i = 0; i < LOCK_COUNT; i++)
+        busy |= locks[i].command_pending || locks[i].command_queue.count > 0;
+    portEXIT_CRITICAL(&command_mux);
+    return busy;
+}
+
+static bool write_busy() {
+    for (uint8_t i = 0; i < LOCK_COUNT; i++) {
+        if (locks[i].powerbolt != NULL && trinket_powerbolt_write_busy(locks[i].powerbolt))
+            return true;
+    }
+    return false;
+}
+
+// Everything published for a lock also goes to the local client
+static bool publish_for_lock(const char *topic, const uint8_t *payload, size_t length, bool retained) {
+    send_local_message(topic, payload, length);
+    return mqtt_client.publish(topic, payload, length, retained);
+}
+
+static void publish_command_result(const lock_t *lock, uint16_t id, const char *text, bool result) {
+    char result_string[40];
+    sprintf(result_string, "> %s%s @%u", result ? "result " : "", text, id);
+    publish_for_lock(lock->topic, (const uint8_t *) result_string, strlen(result_string), false);
+}
+
+static void publish_command_results() {
+    triggered_events &= ~TRIGGER_COMMAND;
+    spsc_ring<command_result_t, 8>::entry_t entry;
+    while (command_results.pop(entry))
+        publish_command_result(entry.value.lock, entry.value.id, entry.value.text, entry.value.result);
+}
+
+// Drops everything queued for the lock and whatever is left of its write in progress
+static void cancel_commands(lock_t *lock, uint16_t id) {
+    uint16_t cancelled[POWERBOLT_COMMAND_QUEUE_SIZE];
+    portENTER_CRITICAL(&command_mux);
+    size_t cancelled_count = powerbolt_command_queue_clear(&lock->command_queue, cancelled);
+    bool pending = lock->command_pending;
+    uint16_t pending_id = lock->command_pending_id;
+    lock->command_pending = false;
+    portEXIT_CRITICAL(&command_mux);
+
+    trinket_powerbolt_write_cancel(lock->powerbolt);
+    if (pending) {
+        stamp_command_trace(lock, TRACE_RESULT);
+        publish_command_result(lock, pending_id, "cancelled", true);
+    }
+    for (size_t i = 0; i < cancelled_count; i++)
+        publish_command_result(lock, cancelled[i], "cancelled", true);
+    publish_command_result(lock, id, "ok", true);
+    wake_command_task();
+}
+
+// Authoritative state of each lock, from the bolt switches and the decoded protocol, kept in RTC memory
+// Every transition gets a new version and is published retained on the lock's state topic, so a client
+// gets the last state from the broker straight away instead of waiting for the device to wake
+// Versions only ever go up, the top byte is a boot epoch from NVS that moves on whenever RTC memory is lost
+enum LOCK_STATES {
+    LOCK_STATE_UNKNOWN, LOCK_STATE_LOCKED, LOCK_STATE_UNLOCKED, LOCK_STATE_LOCKING, LOCK_STATE_UNLOCKING
 };
-static void mqtt_received(char *topic, byte *payload, unsigned int length)
-{
-    triggered_event_flags.mqtt = true;
 
-    Serial.print("MQTT (");
-    Serial.print(length, DEC);
-    Serial.print("): ");
-    for (int i = 0; i < length; i++)
-        Serial.print((char)payload[i]);
-    Serial.println();
+enum LOCK_STATE_SOURCES {
+    LOCK_STATE_SWITCH, LOCK_STATE_DEADBOLT
+};
+
+static const char *const lock_state_names[] = { "unknown", "locked", "unlocked", "locking", "unlocking" };
+static const char *const lock_state_source_names[] = { "switch", "deadbolt" };
+
+typedef struct {
+    uint32_t version;
+    uint8_t bolt;
+    uint8_t source;
+    bool published;
+} lock_state_t;
+
+RTC_DATA_ATTR static uint32_t lock_state_magic;
+RTC_DATA_ATTR static lock_state_t lock_states[LOCK_COUNT];
 
-    if (length > 20) {
-        Serial.println("MQTT message too long to process");
+// loop() only, like everything else that publishes
+static void set_lock_state(const lock_t *lock, LOCK_STATES bolt, LOCK_STATE_SOURCES source) {
+    lock_state_t *state = &lock_states[lock->index];
+    if (state->bolt == bolt)
         return;
+    state->bolt = bolt;
+    state->source = source;
+    state->version++;
+    state->published = false;
+}
+
+// The switches are read rather than taken from their interrupts, which fire before the bolt settles
+// Neither switch closed means the bolt is between the two, a movement the deadbolt announced is kept
+static void read_lock_switches(lock_t *lock, bool keep_moving) {
+    uint8_t bolt = lock_states[lock->index].bolt;
+    if (digitalRead(lock->config->bolt_locked))
+        set_lock_state(lock, LOCK_STATE_LOCKED, LOCK_STATE_SWITCH);
+    else if (digitalRead(lock->config->bolt_unlocked))
+        set_lock_state(lock, LOCK_STATE_UNLOCKED, LOCK_STATE_SWITCH);
+    else if (!keep_moving || (bolt != LOCK_STATE_LOCKING && bolt != LOCK_STATE_UNLOCKING))
+        set_lock_state(lock, LOCK_STATE_UNKNOWN, LOCK_STATE_SWITCH);
+}
+
+// The deadbolt says the bolt is about to move well before the switch at the other end closes
+static void update_lock_state(lock_t *lock, POWERBOLT_EVENTS event) {
+    if (event == POWERBOLT_EVENT_LOCKING)
+        set_lock_state(lock, LOCK_STATE_LOCKING, LOCK_STATE_DEADBOLT);
+    else if (event == POWERBOLT_EVENT_CODE_ACCEPTED && lock_states[lock->index].bolt == LOCK_STATE_LOCKED)
+        set_lock_state(lock, LOCK_STATE_UNLOCKING, LOCK_STATE_DEADBOLT);
+}
+
+static void lock_state_setup() {
+    if (lock_state_magic != LOCK_STATE_MAGIC) {
+        uint32_t epoch = 0;
+        Preferences preferences;
+        if (preferences.begin(LOCK_STATE_NAMESPACE, false)) {
+            epoch = preferences.getUInt("epoch", 0) + 1;
+            preferences.putUInt("epoch", epoch);
+            preferences.end();
+        }
+        for (uint8_t i = 0; i < LOCK_COUNT; i++)
+            lock_states[i] = { epoch << 24, LOCK_STATE_UNKNOWN, LOCK_STATE_SWITCH, false };
+        lock_state_magic = LOCK_STATE_MAGIC;
     }
 
-    // MQTT send from this handler will ruin the payload buffer, so copy it locally
-    byte mqtt_payload_buffer[20];
-    memcpy(mqtt_payload_buffer, payload, length);
+    // The bolt may have been turned by hand while asleep, a movement from the last wake is long over
+    for (uint8_t i = 0; i < LOCK_COUNT; i++) {
+        if (locks[i].powerbolt != NULL)
+            read_lock_switches(&locks[i], false);
+    }
+}
 
-    // Expect all messages to start with DB for deadbolt (could be extended later)
-    // Helps ensure that responses in the MQTT channel aren't treated as commands
-    if (mqtt_payload_buffer[0] != 'D' || mqtt_payload_buffer[1] != 'B')
+// State that did not get out stays unpublished for the next wake with a connection, it is not sent to
+// the local client without one either, it would go again on every call
+//      {"version":16777221,"bolt":"locked","source":"switch"}
+static void publish_lock_states() {
+    if (mqtt_client.state() != MQTT_CONNECTED)
         return;
+    char message[EVENT_BATCH_MAX_SIZE];
+    for (uint8_t i = 0; i < LOCK_COUNT; i++) {
+        lock_state_t *state = &lock_states[i];
+        if (locks[i].powerbolt == NULL || state->published)
+            continue;
+        snprintf(message, sizeof(message), "{\"version\":%u,\"bolt\":\"%s\",\"source\":\"%s\"}",
+            state->version, lock_state_names[state->bolt], lock_state_source_names[state->source]);
+        if (publish_for_lock(locks[i].state_topic, (const uint8_t *) message, strlen(message), true))
+            state->published = true;
+    }
+}
 
-    // Handle actual payload, each character separately
-    // Protocol:
-    //      Deadbolt: 0 - 9, L = lock button, X = unpressable button
-    //      General: ? = locked status
-    for (int i = 2; i < length; i++) {
-        const byte payload_byte = mqtt_payload_buffer[i];
-        // 0 - 9, S, L (Deadbolt)
-        if (payload_byte >= '0' && payload_byte <= '9') {
-            uint8_t key_map_idx = payload_byte - '0';
-            powerbolt_write(mqtt_key_map[key_map_idx]);
-        }
-        else if (payload_byte == 'L')
-            powerbolt_write(KEY_LOCK);
-        else if (payload_byte == 'X')
-            powerbolt_write(KEY_HIDDEN);
-
-        // Get status, don't continue processing
-        else if (payload_byte == '?') {
-            bool locked = digitalRead(I_BOLT_LOCKED);
-            bool unlocked = digitalRead(I_BOLT_UNLOCKED);
-            const char * mqtt_response = locked ? "> locked" : unlocked ? "> unlocked" : "> unknown";
-            mqtt_client.publish(DEVICE_NAME, mqtt_response);
-            return;
-        }
+static lock_t *lock_for_topic(const char *topic) {
+    for (uint8_t i = 0; i < LOCK_COUNT; i++) {
+        if (locks[i].powerbolt != NULL && strcmp(topic, locks[i].topic) == 0)
+            return &locks[i];
+    }
+    return NULL;
+}
 
-        // If a character can not be processed, do not continue processing
-        else
-            return;
+static lock_t *lock_for_desired_topic(const char *topic) {
+    for (uint8_t i = 0; i < LOCK_COUNT; i++) {
+        if (locks[i].powerbolt != NULL && strcmp(topic, locks[i].desired_topic) == 0)
+            return &locks[i];
+    }
+    return NULL;
+}
+
+static lock_t *lock_for_name(const char *name, size_t length) {
+    for (uint8_t i = 0; i < LOCK_COUNT; i++) {
+        const char *lock_name = lock_configs[i].name;
+        if (locks[i].powerbolt != NULL && strlen(lock_name) == length && strncmp(name, lock_name, length) == 0)
+            return &locks[i];
+    }
+    return NULL;
+}
+
+// Nothing runs here, the command task picks the command up
+static void submit_command(lock_t *lock, const powerbolt_command_t *command) {
+    uint16_t superseded[POWERBOLT_COMMAND_QUEUE_SIZE];
+    size_t superseded_count;
+    portENTER_CRITICAL(&command_mux);
+    bool queued = powerbolt_command_queue_push(&lock->command_queue, command, superseded, &superseded_count);
+    portEXIT_CRITICAL(&command_mux);
+
+    for (size_t i = 0; i < superseded_count; i++)
+        publish_command_result(lock, superseded[i], "superseded", true);
+    if (queued)
+        wake_command_task();
+    else
+        publish_command_result(lock, command->id, "full", true);
+}
+
+// Desired state, retained by the client on the lock's desired topic so it is delivered on the next wake
+// Only locking works without a code, so "locked" is the one state that is reconciled. It is taken once:
+// the retained message is cleared and a lock command is queued unless the bolt is already locked, its
+// result goes to the lock's topic like any other
+static void desired_state_received(lock_t *lock, const byte *payload, unsigned int length, uint32_t received) {
+    // Cleared, most likely by this device
+    if (length == 0)
+        return;
+
+    // The payload is not needed past this point, publishing reuses its buffer
+    bool lock_wanted = length == 6 && memcmp(payload, "locked", 6) == 0;
+    mqtt_client.publish(lock->desired_topic, (const uint8_t *) "", 0, true);
+    if (!lock_wanted) {
+        LOG_WARN("Only a desired state of locked is supported");
+        return;
+    }
+    if (lock_states[lock->index].bolt == LOCK_STATE_LOCKED)
+        return;
+
+    powerbolt_command_t command;
+    powerbolt_command_parse((const uint8_t *) "DBL", 3, &command);
+    command.id = command_next_id++;
+    command.received = received;
+    submit_command(lock, &command);
+}
+
+// Commands from MQTT and from the local endpoint
+// Commands are parsed before anything is published, an MQTT send from the MQTT callback would
+// ruin the payload buffer
+static void receive_command(lock_t *lock, const uint8_t *payload, size_t length, uint32_t received) {
+    powerbolt_command_t command;
+    if (!powerbolt_command_parse(payload, length, &command)) {
+        if (length > POWERBOLT_COMMAND_MAX_LENGTH)
+            LOG_WARN("Command too long to process");
+        return;
     }
+    if (!command.has_id)
+        command.id = command_next_id++;
+    command.received = received;
+
+    if (command.type == COMMAND_CANCEL)
+        return cancel_commands(lock, command.id);
+    if (!powerbolt_command_is_write(&command) && command.type != COMMAND_STATUS)
+        return;
+    submit_command(lock, &command);
+}
+
+static void mqtt_received(char *topic, byte *payload, unsigned int length)
+{
+    uint32_t received = millis();
+    trigger_event(TRIGGER_MQTT);
+
+    LOG_INFO("MQTT %s (%u): %s", log_text(topic), length, log_text((const char *) payload, length));
+
+    lock_t *lock = lock_for_desired_topic(topic);
+    if (lock != NULL)
+        return desired_state_received(lock, payload, length, received);
+
+    lock = lock_for_topic(topic);
+    if (lock != NULL)
+        receive_command(lock, payload, length, received);
+}
+
+// AP and DHCP lease from the last successful connect, kept in RTC memory across deep sleep
+// so a timer wake can skip the scan and DHCP
+typedef struct {
+    uint32_t magic;
+    int32_t channel;
+    uint8_t bssid[6];
+    uint32_t ip;
+    uint32_t gateway;
+    uint32_t subnet;
+    uint32_t dns;
+} wifi_resume_t;
+RTC_DATA_ATTR static wifi_resume_t wifi_resume;
+
+// Time spent in each connection phase during this wake, in ms
+static struct {
+    unsigned long wifi;
+    unsigned long mqtt;
+    unsigned long subscribe;
+    bool fast;
+    bool reported;
+} connect_timing;
+
+// The broker could not be reached this wake, only the local endpoint is up
+static bool mqtt_offline = false;
+
+static bool wait_for_wifi(unsigned long timeout_ms) {
+    unsigned long start = millis();
+    while (WiFi.status() != WL_CONNECTED) {
+        if (millis() - start > timeout_ms)
+            return false;
+        delay(10);
+    }
+    return true;
 }
 
 static bool connect_to_wifi() {
+    // Nothing needs to be written to flash on every wake
+    WiFi.persistent(false);
     WiFi.setHostname(DEVICE_NAME);
-    WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
-    uint8_t wifi_timeout_count = 100;
-    while (WiFi.status() != WL_CONNECTED && wifi_timeout_count--) {
-        delay(100);
+
+    // Fast path: join the same AP on the same channel with the previous lease
+    if (wifi_resume.magic == WIFI_RESUME_MAGIC) {
+        WiFi.config(IPAddress(wifi_resume.ip), IPAddress(wifi_resume.gateway), IPAddress(wifi_resume.subnet), IPAddress(wifi_resume.dns));
+        WiFi.begin(WIFI_SSID, WIFI_PASSWORD, wifi_resume.channel, wifi_resume.bssid);
+        if (wait_for_wifi(WIFI_FAST_TIMEOUT_MS)) {
+            connect_timing.fast = true;
+            return true;
+        }
+
+        // The AP or network changed, forget it and go through the full path
+        LOG_WARN("Fast wifi resume failed");
+        wifi_resume.magic = 0;
+        WiFi.disconnect();
+        WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
     }
-    return wifi_timeout_count;
+
+    connect_timing.fast = false;
+    WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
+    if (!wait_for_wifi(WIFI_FULL_TIMEOUT_MS))
+        return false;
+
+    // Save the AP and lease for the next wake
+    wifi_resume.channel = WiFi.channel();
+    memcpy(wifi_resume.bssid, WiFi.BSSID(), sizeof(wifi_resume.bssid));
+    wifi_resume.ip = WiFi.localIP();
+    wifi_resume.gateway = WiFi.gatewayIP();
+    wifi_resume.subnet = WiFi.subnetMask();
+    wifi_resume.dns = WiFi.dnsIP();
+    wifi_resume.magic = WIFI_RESUME_MAGIC;
+    return true;
 }
 
 static bool connect_to_mqtt() {
@@ -274,95 +1010,860 @@ static bool connect_to_mqtt() {
     return mqtt_client.connect(DEVICE_NAME, NULL, NULL, NULL, false, false, NULL, false);
 }
 
+// CPU share of each task over the wake and the least stack it had left, in bytes. Only logged, a message
+// on the lock topic every wake would come back from the broker and keep the device awake
+// The engine runs the protocol on core 0, loop() and the command task share core 1 with nothing time critical
+static void log_task_stats() {
+    trinket_powerbolt_stats_t stats = {};
+    uint32_t runs_dropped = 0;
+    uint32_t runs_spurious = 0;
+    for (uint8_t i = 0; i < LOCK_COUNT; i++) {
+        if (locks[i].powerbolt == NULL)
+            continue;
+        trinket_powerbolt_get_stats(locks[i].powerbolt, &stats);
+        runs_dropped += stats.runs_dropped;
+        runs_spurious += stats.runs_spurious[0] + stats.runs_spurious[1];
+    }
+    int64_t awake_us = esp_timer_get_time();
+    int64_t loop_busy_us = awake_us - loop_events_start_us - loop_blocked_us;
+
+    char stats_string[96];
+    snprintf(stats_string, sizeof(stats_string), "> tasks engine=%.1f%%/%u command=%.1f%%/%u loop=%.1f%%/%u dropped=%u noise=%u",
+        100.0 * stats.engine_busy_us / awake_us, stats.engine_stack_free,
+        100.0 * command_busy_us / awake_us, (unsigned) uxTaskGetStackHighWaterMark(command_task_handle),
+        100.0 * loop_busy_us / awake_us, (unsigned) uxTaskGetStackHighWaterMark(NULL),
+        runs_dropped, runs_spurious);
+    LOG_INFO("%s", log_text(stats_string));
+}
+
 static void enter_deep_sleep() {
+    // Whatever was not published stays in the log for the next wake with a connection
+    log_pending_events();
+    write_traces();
+    finish_command_traces(true);
+    collect_telemetry_counters();
+
     // Interrupts are on high, so make sure an input isn't already high
-    uint64_t bitmask = 1ULL << I_KEYPAD_READ | 1ULL << IO_DEADBOLT_RW;
-    if (!digitalRead(I_BOLT_LOCKED))
-        bitmask |= 1 << I_BOLT_LOCKED;
-    if (!digitalRead(I_BOLT_UNLOCKED))
-        bitmask |= 1 << I_BOLT_UNLOCKED;
+    // The ULP watches the first lock's keypad lines when it can, so noise on them does not wake the main cores
+    uint64_t bitmask = 0;
+    for (uint8_t i = 0; i < LOCK_COUNT; i++) {
+        const lock_t *lock = &locks[i];
+        if (lock->powerbolt == NULL)
+            continue;
+        if (i > 0 || !KEYPAD_ULP_CAPTURE || !trinket_powerbolt_ulp_arm(lock->powerbolt))
+            bitmask |= 1ULL << lock->config->keypad_read | 1ULL << lock->config->deadbolt_rw;
+        if (!digitalRead(lock->config->bolt_locked))
+            bitmask |= 1ULL << lock->config->bolt_locked;
+        if (!digitalRead(lock->config->bolt_unlocked))
+            bitmask |= 1ULL << lock->config->bolt_unlocked;
+    }
 
     esp_sleep_enable_ext1_wakeup(bitmask, ESP_EXT1_WAKEUP_ANY_HIGH);
     esp_sleep_enable_ext0_wakeup(GPIO_NUM_0, LOW);
     esp_sleep_enable_timer_wakeup(SLEEP_TIME_S * 1000 * 1000);
 
-    Serial.println("Sleepy time");
+    LOG_INFO("Sleepy time");
+    flush_log();
     esp_deep_sleep_start();
 }
 
+// Light sleep only wakes on levels, so each bolt switch wakes the CPU when it goes high and is
+// disarmed while it stays high
+static void arm_bolt_wakeup() {
+#if CONFIG_PM_ENABLE
+    for (uint8_t i = 0; i < LOCK_COUNT; i++) {
+        gpio_num_t locked_pin = (gpio_num_t) lock_configs[i].bolt_locked;
+        gpio_num_t unlocked_pin = (gpio_num_t) lock_configs[i].bolt_unlocked;
+        gpio_wakeup_disable(locked_pin);
+        gpio_wakeup_disable(unlocked_pin);
+        if (!digitalRead(locked_pin))
+            gpio_wakeup_enable(locked_pin, GPIO_INTR_HIGH_LEVEL);
+        if (!digitalRead(unlocked_pin))
+            gpio_wakeup_enable(unlocked_pin, GPIO_INTR_HIGH_LEVEL);
+    }
+#endif
+}
+
+static void on_wifi_disconnected(WiFiEvent_t event, WiFiEventInfo_t info) {
+    trigger_event(TRIGGER_NETWORK);
+}
+
+// WiFi modem sleep keeps the broker connection while the radio sleeps between beacons
+// With power management in the SDK config the CPU also light sleeps whenever every task is blocked,
+// the start bit of any frame wakes it long before the data bits arrive
+static void configure_power_saving() {
+    static bool configured = false;
+    if (configured)
+        return;
+    configured = true;
+
+    WiFi.setSleep(true);
+    WiFi.onEvent(on_wifi_disconnected, SYSTEM_EVENT_STA_DISCONNECTED);
+
+#if CONFIG_PM_ENABLE
+    esp_pm_config_esp32_t pm_config = {
+        .max_freq_mhz = PM_MAX_FREQ_MHZ,
+        .min_freq_mhz = PM_MIN_FREQ_MHZ,
+        .light_sleep_enable = true
+    };
+    esp_pm_configure(&pm_config);
+
+    for (uint8_t i = 0; i < LOCK_COUNT; i++) {
+        gpio_wakeup_enable((gpio_num_t) lock_configs[i].keypad_read, GPIO_INTR_HIGH_LEVEL);
+        gpio_wakeup_enable((gpio_num_t) lock_configs[i].deadbolt_rw, GPIO_INTR_HIGH_LEVEL);
+    }
+    arm_bolt_wakeup();
+    esp_sleep_enable_gpio_wakeup();
+#endif
+}
+
+// Local endpoint, commands from the local network without the round trip through the broker, and it
+// keeps working when the broker can not be reached
+// One client at a time on LOCAL_PORT, it answers a challenge with the pre-shared key, then sends commands
+// as tagged lines and gets everything published on the lock topics back (see local-endpoint.h)
+// While an authenticated client is connected the device stays awake and modem sleep is off, so its
+// commands are not held by the AP until the next beacon. A client that has not authenticated does
+// neither and is dropped after LOCAL_AUTH_TIMEOUT_MS. Runs on loop() like the MQTT client, commands
+// share the same queue.
+static WiFiServer local_server(LOCAL_PORT);
+static WiFiClient local_client;
+static local_session_t local_session;
+static bool local_started = false;
+static bool local_connected = false;
+static unsigned long local_activity = 0;
+static unsigned long local_connected_at = 0;
+
+static bool local_endpoint_enabled() {
+    return LOCAL_ENDPOINT && LOCAL_ENDPOINT_PSK[0] != '\0';
+}
+
+static void local_endpoint_setup() {
+    if (!local_endpoint_enabled() || local_started)
+        return;
+    local_server.begin();
+    local_server.setNoDelay(true);
+    local_started = true;
+}
+
+// Only the handshake goes out without a tag
+static void send_local(const char *text) {
+    local_client.write((const uint8_t *) text, strlen(text));
+}
+
+static void send_local_line(const char *line, size_t length) {
+    char tagged[LOCAL_MESSAGE_SIZE + LOCAL_TAG_SIZE * 2 + 2];
+    size_t tagged_length = local_session_seal(&local_session, LOCAL_ENDPOINT_PSK, line, length, tagged);
+    local_client.write((const uint8_t *) tagged, tagged_length);
+}
+
+static void close_local_client() {
+    local_client.stop();
+    local_connected = false;
+    if (local_session.state == LOCAL_SESSION_AUTHENTICATED)
+        WiFi.setSleep(true);
+}
+
+static void send_local_message(const char *topic, const uint8_t *payload, size_t length) {
+    if (!local_connected || local_session.state != LOCAL_SESSION_AUTHENTICATED)
+        return;
+    char line[LOCAL_MESSAGE_SIZE];
+    size_t line_length = local_format_message(topic, payload, length, line, sizeof(line));
+    send_local_line(line, line_length - 1);
+}
+
+static void accept_local_client() {
+    WiFiClient client = local_server.available();
+    if (!client)
+        return;
+
+    local_client = client;
+    local_client.setNoDelay(true);
+    local_connected = true;
+    local_connected_at = millis();
+
+    uint8_t nonce[LOCAL_NONCE_SIZE];
+    for (size_t i = 0; i < LOCAL_NONCE_SIZE; i += 4) {
+        uint32_t random = esp_random();
+        memcpy(&nonce[i], &random, 4);
+    }
+    char challenge[LOCAL_CHALLENGE_SIZE];
+    size_t length = local_session_begin(&local_session, nonce, challenge);
+    local_client.write((const uint8_t *) challenge, length);
+    LOG_INFO("Local client connected");
+}
+
+// The first lock takes bare commands, the others need their name in front
+static void local_line_received(uint32_t received) {
+    if (local_session.state != LOCAL_SESSION_AUTHENTICATED) {
+        if (!local_session_authenticate(&local_session, LOCAL_ENDPOINT_PSK)) {
+            LOG_WARN("Local client denied");
+            send_local("> denied\n");
+            return close_local_client();
+        }
+        LOG_INFO("Local client authenticated");
+        send_local("> ok\n");
+        local_activity = received;
+        WiFi.setSleep(false);
+        return;
+    }
+
+    const char *command = local_session_verify(&local_session, LOCAL_ENDPOINT_PSK);
+    if (command == NULL) {
+        LOG_WARN("Local line with a bad tag");
+        send_local("> denied\n");
+        return close_local_client();
+    }
+    local_activity = received;
+
+    lock_t *lock = &locks[0];
+    const char *space = strchr(command, ' ');
+    if (space != NULL) {
+        lock = lock_for_name(command, space - command);
+        command = space + 1;
+    }
+    if (lock == NULL || lock->powerbolt == NULL) {
+        static const char unknown[] = "> unknown lock";
+        send_local_line(unknown, sizeof(unknown) - 1);
+        return;
+    }
+
+    LOG_INFO("Local %s: %s", lock->topic, log_text(command));
+    receive_command(lock, (const uint8_t *) command, strlen(command), received);
+}
+
+// Returns true while an authenticated client is connected
+static bool poll_local_endpoint() {
+    if (!local_started)
+        return false;
+    if (local_connected && !local_client.connected()) {
+        LOG_INFO("Local client disconnected");
+        close_local_client();
+    }
+    if (!local_connected)
+        accept_local_client();
+    if (!local_connected)
+        return false;
+
+    uint32_t received = millis();
+    while (local_connected && local_client.available() > 0) {
+        if (local_session_feed(&local_session, local_client.read()))
+            local_line_received(received);
+    }
+
+    bool authenticated = local_connected && local_session.state == LOCAL_SESSION_AUTHENTICATED;
+    if (local_connected && (authenticated ? millis() - local_activity > LOCAL_IDLE_TIMEOUT_MS
+        : millis() - local_connected_at > LOCAL_AUTH_TIMEOUT_MS)) {
+        LOG_INFO("Local client timed out");
+        close_local_client();
+        authenticated = false;
+    }
+    return authenticated;
+}
+
+// Event log, kept in RTC memory across deep sleep and spilled to NVS when it fills
+// Everything from the receive queue and the bolt switches goes through the log, so events from a
+// wake without a connection are uploaded in order on the next one that has one
+RTC_DATA_ATTR static event_log_t event_log;
+
+static void event_log_key(uint32_t slot, char key[]) {
+    sprintf(key, "chunk%u", slot);
+}
+
+static bool event_log_write(uint32_t slot, const event_log_entry_t entries[], size_t count) {
+    char key[12];
+    event_log_key(slot, key);
+    Preferences preferences;
+    if (!preferences.begin(EVENT_LOG_NAMESPACE, false))
+        return false;
+    size_t length = count * sizeof(event_log_entry_t);
+    bool written = preferences.putBytes(key, entries, length) == length;
+    preferences.end();
+    return written;
+}
+
+static size_t event_log_read(uint32_t slot, event_log_entry_t entries[], size_t max_count) {
+    char key[12];
+    event_log_key(slot, key);
+    Preferences preferences;
+    if (!preferences.begin(EVENT_LOG_NAMESPACE, true))
+        return 0;
+    size_t length = preferences.getBytes(key, entries, max_count * sizeof(event_log_entry_t));
+    preferences.end();
+    return length / sizeof(event_log_entry_t);
+}
+
+static const event_log_storage_t event_log_storage = { event_log_write, event_log_read };
+
+static void event_log_setup() {
+    event_log_init(&event_log);
+}
+
+// Log timestamps are ms from the RTC clock, which keeps counting through deep sleep, millis() restarts
+// on every wake
+static uint32_t log_time(unsigned long timestamp) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    uint64_t now_ms = (uint64_t) now.tv_sec * 1000 + now.tv_usec / 1000;
+    return (uint32_t) now_ms - (uint32_t) (millis() - timestamp);
+}
+
+// Moves everything pending in one lock's queue and its lock/unlock flags into the log
+static void log_lock_events(lock_t *lock) {
+    portENTER_CRITICAL(&bolt_mux);
+    bool locked = lock->bolt_locked_pending;
+    bool unlocked = lock->bolt_unlocked_pending;
+    unsigned long lock_timestamp = lock->bolt_lock_debounce;
+    unsigned long unlock_timestamp = lock->bolt_unlock_debounce;
+    lock->bolt_locked_pending = false;
+    lock->bolt_unlocked_pending = false;
+    portEXIT_CRITICAL(&bolt_mux);
+    if (locked || unlocked)
+        read_lock_switches(lock, true);
+
+    // Bolt events are merged with the frames in timestamp order
+    typedef struct {
+        EVENT_BATCH_TYPES type;
+        uint32_t timestamp;
+    } bolt_event_t;
+    bolt_event_t bolt_events[2];
+    size_t bolt_count = 0;
+    size_t bolt_pos = 0;
+    if (locked)
+        bolt_events[bolt_count++] = { EVENT_BOLT_LOCKED, (uint32_t) lock_timestamp };
+    if (unlocked)
+        bolt_events[bolt_count++] = { EVENT_BOLT_UNLOCKED, (uint32_t) unlock_timestamp };
+    if (bolt_count == 2 && (int32_t) (bolt_events[1].timestamp - bolt_events[0].timestamp) < 0) {
+        bolt_event_t first = bolt_events[1];
+        bolt_events[1] = bolt_events[0];
+        bolt_events[0] = first;
+    }
+
+    spsc_ring<trinket_powerbolt_queued_msg_t, POWERBOLT_QUEUE_SIZE>::entry_t entries[16];
+    size_t count;
+    while ((count = lock->queue.pop_batch(entries, 16)) > 0) {
+        for (size_t i = 0; i < count; i++) {
+            while (bolt_pos < bolt_count && (int32_t) (bolt_events[bolt_pos].timestamp - entries[i].timestamp) <= 0) {
+                event_log_append(&event_log, &event_log_storage, lock->index, bolt_events[bolt_pos].type, 0,
+                    log_time(bolt_events[bolt_pos].timestamp));
+                bolt_pos++;
+            }
+
+            LOG_INFO("%s: %02x", entries[i].value.port == 0 ? "Powerbolt" : "Keypad", entries[i].value.data);
+            EVENT_BATCH_TYPES type = entries[i].value.port == 0 ? EVENT_FRAME_DEADBOLT : EVENT_FRAME_KEYPAD;
+            event_log_append(&event_log, &event_log_storage, lock->index, type, entries[i].value.data, log_time(entries[i].timestamp));
+        }
+    }
+
+    for (; bolt_pos < bolt_count; bolt_pos++)
+        event_log_append(&event_log, &event_log_storage, lock->index, bolt_events[bolt_pos].type, 0,
+            log_time(bolt_events[bolt_pos].timestamp));
+
+    // Report messages that were dropped because the queue was full
+    uint32_t overflows = lock->queue.overflow_count();
+    uint32_t dropped = overflows - lock->queue_reported_overflows;
+    if (dropped > 0) {
+        event_log_append(&event_log, &event_log_storage, lock->index, EVENT_OVERFLOW, dropped > 255 ? 255 : dropped, log_time(millis()));
+        lock->queue_reported_overflows = overflows;
+    }
+}
+
+// Moves everything pending for every lock into the log
+static void log_pending_events() {
+    // Clear the flags first so anything that arrives while draining opens a new window
+    triggered_events &= ~(TRIGGER_RMT | TRIGGER_LOCKED | TRIGGER_UNLOCKED);
+    for (uint8_t i = 0; i < LOCK_COUNT; i++)
+        log_lock_events(&locks[i]);
+
+    // Entries the log itself lost are reported on the first lock's topic
+    if (event_log.dropped > 0) {
+        uint32_t dropped = event_log.dropped;
+        event_log.dropped = 0;
+        event_log_append(&event_log, &event_log_storage, 0, EVENT_OVERFLOW, dropped > 255 ? 255 : dropped, log_time(millis()));
+    }
+}
+
+// Publishes the log oldest first, in as few messages as possible, each batch holds one lock's events
+// and goes to that lock's topic. Entries are only removed once their batch has been published, a
+// dropped connection leaves the rest. Without the broker nothing goes to the local client either.
+static void upload_event_log() {
+    if (mqtt_client.state() != MQTT_CONNECTED)
+        return;
+    event_log_entry_t entries[EVENT_LOG_UPLOAD_BATCH];
+    size_t count;
+    while ((count = event_log_peek(&event_log, &event_log_storage, entries, EVENT_LOG_UPLOAD_BATCH)) > 0) {
+        event_batch_t batch;
+        event_batch_begin(&batch, MQTT_BATCH_ENCODING);
+        uint8_t source = entries[0].source;
+        size_t added = 0;
+        while (added < count && entries[added].source == source
+            && event_batch_add(&batch, (EVENT_BATCH_TYPES) entries[added].type, entries[added].data, entries[added].timestamp))
+            added++;
+
+        // Entries from a lock that has since been removed from the configuration go to the first lock
+        const lock_t *lock = &locks[source < LOCK_COUNT ? source : 0];
+        if (!publish_for_lock(lock->topic, batch.buffer, batch.length, false))
+            return;
+        event_log_consume(&event_log, added);
+
+        // Entries from before the RTC clock was last reset come out negative and are left out
+        uint32_t now = log_time(millis());
+        for (size_t i = 0; i < added; i++) {
+            int32_t latency = now - entries[i].timestamp;
+            if (latency >= 0)
+                record_latency(LATENCY_EVENT, latency);
+        }
+    }
+}
+
+static void publish_event_batches() {
+    log_pending_events();
+    upload_event_log();
+    publish_lock_states();
+}
+
+// Log records are formatted and printed by a task of their own below everything else, so a log call from
+// an ISR, the engine or the MQTT callback only costs a copy. The task polls rather than being woken so
+// that logging never has to go through the scheduler. Records print in the order they were logged, the
+// timestamp says when that was. Without logging (LOG_LEVEL_NONE) neither the task nor the buffer exist.
+#if LOG_LEVEL > LOG_LEVEL_NONE
+static SemaphoreHandle_t log_drain_mutex = NULL;
+static uint32_t log_reported_drops = 0;
+
+static void drain_log() {
+    char line[DEFERRED_LOG_LINE_SIZE + 2];
+    deferred_log_record_t record;
+    xSemaphoreTake(log_drain_mutex, portMAX_DELAY);
+    while (deferred_log_pop(&record)) {
+        size_t length = deferred_log_format(&record, line, DEFERRED_LOG_LINE_SIZE);
+        line[length++] = '\r';
+        line[length++] = '\n';
+        Serial.write((const uint8_t *) line, length);
+    }
+
+    uint32_t drops = deferred_log_dropped();
+    if (drops != log_reported_drops) {
+        Serial.printf("Log dropped %u records\r\n", drops - log_reported_drops);
+        log_reported_drops = drops;
+    }
+    xSemaphoreGive(log_drain_mutex);
+}
+
+static void log_task(void *arg) {
+    for (;;) {
+        drain_log();
+        vTaskDelay(pdMS_TO_TICKS(LOG_DRAIN_MS));
+    }
+}
+
+static void log_setup() {
+    log_drain_mutex = xSemaphoreCreateMutex();
+    xTaskCreatePinnedToCore(log_task, "log", LOG_TASK_STACK, NULL, LOG_TASK_PRIORITY, NULL, 1);
+}
+
+// Everything logged so far is out before deep sleep
+static void flush_log() {
+    if (log_drain_mutex == NULL)
+        return;
+    drain_log();
+    Serial.flush();
+}
+#else
+static void log_setup() {
+}
+
+static void flush_log() {
+}
+#endif
+
+// Trace recorder, every raw run from both readers is copied off the engine task and written out by loop()
+// Each wake writes its own trace header, the replay tool treats the runs after it as a new segment
+// Flash traces are appended to one file until it reaches TRACE_FILE_MAX_BYTES, delete it to start over
+typedef struct {
+    uint8_t port;
+    uint8_t len;
+    int64_t timestamp;
+    uint32_t symbols[TRINKET_POWERBOLT_MAX_RUN];
+} trace_run_t;
+
+static spsc_ring<trace_run_t, TRACE_QUEUE_SIZE> trace_runs;
+static uint32_t trace_reported_overflows = 0;
+static powerbolt_trace_writer_t trace_writer;
+static bool trace_header_pending = false;
+
+// Runs on the powerbolt engine task, including the runs replayed from the ULP capture during setup
+// The engine serves every lock so there is still one producer, the trace port is lock * 2 + reader
+static void on_powerbolt_trace(void *arg, uint8_t port, const uint32_t *symbols, size_t len, int64_t timestamp) {
+    const lock_t *lock = (const lock_t *) arg;
+    trace_run_t run;
+    run.port = lock->index * 2 + port;
+    run.len = len > TRINKET_POWERBOLT_MAX_RUN ? TRINKET_POWERBOLT_MAX_RUN : len;
+    run.timestamp = timestamp;
+    memcpy(run.symbols, symbols, run.len * sizeof(uint32_t));
+    if (trace_runs.push(run, millis()))
+        trigger_event(TRIGGER_TRACE);
+}
+
+static void trace_setup() {
+    if (TRACE_OUTPUT == TRACE_OFF)
+        return;
+    if (TRACE_OUTPUT == TRACE_FLASH && !SPIFFS.begin(true)) {
+        LOG_ERROR("Failed to mount SPIFFS for traces");
+        return;
+    }
+
+    powerbolt_trace_writer_init(&trace_writer);
+    trace_header_pending = true;
+}
+
+static void write_trace_serial(const uint8_t data[], size_t length) {
+    static const char hex[] = "0123456789abcdef";
+    char line[2 + POWERBOLT_TRACE_MAX_RECORD * 2 + 1];
+    size_t pos = sprintf(line, POWERBOLT_TRACE_LINE_PREFIX);
+    for (size_t i = 0; i < length; i++) {
+        line[pos++] = hex[data[i] >> 4];
+        line[pos++] = hex[data[i] & 0xF];
+    }
+    line[pos] = '\0';
+    Serial.println(line);
+}
+
+static void write_traces() {
+    triggered_events &= ~TRIGGER_TRACE;
+    if (TRACE_OUTPUT == TRACE_OFF || trace_runs.empty())
+        return;
+
+    File file;
+    if (TRACE_OUTPUT == TRACE_FLASH) {
+        file = SPIFFS.open(TRACE_FILE, FILE_APPEND);
+        if (!file)
+            return;
+    }
+
+    uint8_t record[POWERBOLT_TRACE_MAX_RECORD];
+    if (trace_header_pending) {
+        size_t length = powerbolt_trace_header(record, TRINKET_POWERBOLT_READ_TICK_NS);
+        if (TRACE_OUTPUT == TRACE_SERIAL)
+            write_trace_serial(record, length);
+        else
+            file.write(record, length);
+        trace_header_pending = false;
+    }
+
+    spsc_ring<trace_run_t, TRACE_QUEUE_SIZE>::entry_t entry;
+    while (trace_runs.pop(entry)) {
+        size_t length = powerbolt_trace_encode(&trace_writer, record, entry.value.port, entry.value.symbols,
+            entry.value.len, entry.value.timestamp);
+        if (TRACE_OUTPUT == TRACE_SERIAL)
+            write_trace_serial(record, length);
+        else if (file.size() + length <= TRACE_FILE_MAX_BYTES)
+            file.write(record, length);
+    }
+
+    if (TRACE_OUTPUT == TRACE_FLASH)
+        file.close();
+
+    // A gap in the trace shows up as a missing repeat or a broken frame in the replay, so say so here
+    uint32_t overflows = trace_runs.overflow_count();
+    if (overflows != trace_reported_overflows) {
+        LOG_WARN("Trace dropped %u runs", overflows - trace_reported_overflows);
+        trace_reported_overflows = overflows;
+    }
+}
+
+static void telemetry_setup() {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    if (telemetry.magic != TELEMETRY_MAGIC) {
+        memset(&telemetry, 0, sizeof(telemetry));
+        telemetry.magic = TELEMETRY_MAGIC;
+        telemetry.period_start = now.tv_sec;
+    }
+    telemetry.wakes++;
+}
+
+// Records command traces that have their result, once the bolt switch has moved or stopped being
+// expected. All records every trace that is left, before deep sleep.
+static void finish_command_traces(bool all) {
+    for (uint8_t i = 0; i < LOCK_COUNT; i++) {
+        lock_t *lock = &locks[i];
+        portENTER_CRITICAL(&trace_mux);
+        command_trace_t trace = lock->trace;
+        bool finished = trace.active && (all || ((trace.reached & 1 << TRACE_RESULT)
+            && ((trace.reached & 1 << TRACE_BOLT) || millis() - trace.points[TRACE_RESULT] > TELEMETRY_BOLT_WAIT_MS)));
+        if (finished)
+            lock->trace.active = false;
+        portEXIT_CRITICAL(&trace_mux);
+
+        if (finished)
+            record_command_trace(&trace);
+    }
+}
+
+// Driver and queue counters restart on every wake, only what they gained since the last call is added
+static void count_telemetry(uint32_t *total, uint32_t *counted, uint32_t value) {
+    if (value > *counted) {
+        *total += value - *counted;
+        *counted = value;
+    }
+}
+
+static void collect_telemetry_counters() {
+    static uint32_t counted_decode_errors = 0;
+    static uint32_t counted_repeats_missing = 0;
+    static uint32_t counted_ack_timeouts = 0;
+    static uint32_t counted_runs_dropped = 0;
+    static uint32_t counted_queue_overflows = 0;
+
+    uint32_t decode_errors = 0;
+    uint32_t repeats_missing = 0;
+    uint32_t ack_timeouts = 0;
+    uint32_t runs_dropped = 0;
+    uint32_t queue_overflows = command_results.overflow_count() + trace_runs.overflow_count();
+    for (uint8_t i = 0; i < LOCK_COUNT; i++) {
+        const lock_t *lock = &locks[i];
+        if (lock->powerbolt == NULL)
+            continue;
+        trinket_powerbolt_stats_t stats;
+        trinket_powerbolt_get_stats(lock->powerbolt, &stats);
+        decode_errors += stats.decode_errors;
+        repeats_missing += stats.repeats_missing;
+        ack_timeouts += stats.ack_timeouts;
+        runs_dropped += stats.runs_dropped;
+        queue_overflows += lock->queue.overflow_count() + lock->events.overflow_count();
+    }
+
+    count_telemetry(&telemetry.decode_errors, &counted_decode_errors, decode_errors);
+    count_telemetry(&telemetry.repeats_missing, &counted_repeats_missing, repeats_missing);
+    count_telemetry(&telemetry.ack_timeouts, &counted_ack_timeouts, ack_timeouts);
+    count_telemetry(&telemetry.runs_dropped, &counted_runs_dropped, runs_dropped);
+    count_telemetry(&telemetry.queue_overflows, &counted_queue_overflows, queue_overflows);
+}
+
+// Counters first, then one message per histogram that has anything in it, sized like the event batches
+// to fit PubSubClient's default packet with the telemetry topic
+// A period that did not get out completely is sent again on the next wake, with whatever was added since
+static void publish_telemetry() {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    uint32_t period = now.tv_sec - telemetry.period_start;
+    if (period < TELEMETRY_INTERVAL_S)
+        return;
+
+    collect_telemetry_counters();
+    char message[EVENT_BATCH_MAX_SIZE];
+    snprintf(message, sizeof(message), "> counters %us wake=%u reconn=%u fail=%u decode=%u missing=%u ack=%u drop=%u overflow=%u",
+        period, telemetry.wakes, telemetry.reconnects, telemetry.connect_failures, telemetry.decode_errors,
+        telemetry.repeats_missing, telemetry.ack_timeouts, telemetry.runs_dropped, telemetry.queue_overflows);
+    LOG_INFO("%s", log_text(message));
+    if (!mqtt_client.publish(TELEMETRY_TOPIC, message))
+        return;
+
+    for (uint8_t i = 0; i < LATENCY_COUNT; i++) {
+        portENTER_CRITICAL(&telemetry_mux);
+        latency_histogram_t histogram = telemetry.latencies[i];
+        portEXIT_CRITICAL(&telemetry_mux);
+
+        uint8_t next_bucket = 0;
+        while (histogram.count > 0 && next_bucket < LATENCY_HISTOGRAM_BUCKETS) {
+            latency_histogram_format(&histogram, telemetry_latency_names[i], message, sizeof(message), &next_bucket);
+            if (!mqtt_client.publish(TELEMETRY_TOPIC, message))
+                return;
+        }
+    }
+
+    portENTER_CRITICAL(&telemetry_mux);
+    for (uint8_t i = 0; i < LATENCY_COUNT; i++)
+        latency_histogram_clear(&telemetry.latencies[i]);
+    portEXIT_CRITICAL(&telemetry_mux);
+    telemetry.period_start = now.tv_sec;
+    telemetry.wakes = 0;
+    telemetry.reconnects = 0;
+    telemetry.connect_failures = 0;
+    telemetry.decode_errors = 0;
+    telemetry.repeats_missing = 0;
+    telemetry.ack_timeouts = 0;
+    telemetry.runs_dropped = 0;
+    telemetry.queue_overflows = 0;
+}
+
+// Publishes recognised sequences on each lock's topic, the first one after a command is published as
+// its result
+static void publish_powerbolt_events() {
+    char event_string[40];
+    spsc_ring<POWERBOLT_EVENTS, 8>::entry_t entry;
+    for (uint8_t i = 0; i < LOCK_COUNT; i++) {
+        lock_t *lock = &locks[i];
+        while (lock->events.pop(entry)) {
+            update_lock_state(lock, entry.value);
+            portENTER_CRITICAL(&command_mux);
+            bool result = lock->command_pending;
+            uint16_t id = lock->command_pending_id;
+            lock->command_pending = false;
+            portEXIT_CRITICAL(&command_mux);
+
+            if (result) {
+                stamp_command_trace(lock, TRACE_RESULT);
+                publish_command_result(lock, id, powerbolt_event_name(entry.value), true);
+                wake_command_task();
+                continue;
+            }
+            sprintf(event_string, "> event %s", powerbolt_event_name(entry.value));
+            publish_for_lock(lock->topic, (const uint8_t *) event_string, strlen(event_string), false);
+        }
+    }
+    publish_lock_states();
+}
+
 void loop()
 {
+    // Back here after being online means wifi or MQTT dropped out
+    if (connect_timing.reported)
+        telemetry.reconnects++;
+
+    unsigned long phase_start = millis();
     if (WiFi.status() != WL_CONNECTED) {
-        Serial.println("Connecting to wifi");
+        LOG_INFO("Connecting to wifi");
         if (!connect_to_wifi()) {
-            Serial.println("Failed to connect to wifi");
+            LOG_ERROR("Failed to connect to wifi");
+            telemetry.connect_failures++;
             return enter_deep_sleep();
         }
+        connect_timing.wifi = millis() - phase_start;
     }
 
-    if (mqtt_client.state() != MQTT_CONNECTED) {
-        Serial.println("Connecting to MQTT");
+    // Without the broker the local endpoint still takes commands, MQTT is tried again on the next wake
+    phase_start = millis();
+    if (mqtt_client.state() != MQTT_CONNECTED && !mqtt_offline) {
+        LOG_INFO("Connecting to MQTT");
         if (!connect_to_mqtt()) {
-            Serial.print("Failed to connect to MQTT - ");
-            Serial.println(mqtt_client.state());
-            return enter_deep_sleep();
+            LOG_ERROR("Failed to connect to MQTT - %d", mqtt_client.state());
+
+            // A bad saved lease can get through association but not reach the broker
+            if (connect_timing.fast)
+                wifi_resume.magic = 0;
+            telemetry.connect_failures++;
+            if (!local_endpoint_enabled())
+                return enter_deep_sleep();
+            mqtt_offline = true;
         }
+        else
+            connect_timing.mqtt = millis() - phase_start;
     }
 
-    Serial.println("Subscribing to MQTT topic");
-    if (!mqtt_client.subscribe(DEVICE_NAME)) {
-        Serial.println("Failed to subscribe to topic");
-        return enter_deep_sleep();
+    phase_start = millis();
+    if (!mqtt_offline) {
+        LOG_INFO("Subscribing to MQTT topics");
+        for (uint8_t i = 0; i < LOCK_COUNT; i++) {
+            if (locks[i].powerbolt != NULL
+                && (!mqtt_client.subscribe(locks[i].topic) || !mqtt_client.subscribe(locks[i].desired_topic))) {
+                LOG_ERROR("Failed to subscribe to topic");
+                telemetry.connect_failures++;
+                return enter_deep_sleep();
+            }
+        }
+        connect_timing.subscribe = millis() - phase_start;
+    }
+
+    // Log how long this wake took to get online, once per wake. The phases reach the broker through the
+    // telemetry histograms
+    if (!connect_timing.reported && !mqtt_offline) {
+        char timing_string[64];
+        sprintf(timing_string, "> connect %s wifi=%lu mqtt=%lu sub=%lu",
+            connect_timing.fast ? "fast" : "full", connect_timing.wifi, connect_timing.mqtt, connect_timing.subscribe);
+        LOG_INFO("%s", log_text(timing_string));
+        connect_timing.reported = true;
+
+        record_latency(LATENCY_WIFI, connect_timing.wifi);
+        record_latency(LATENCY_MQTT, connect_timing.mqtt);
+        record_latency(LATENCY_SUBSCRIBE, connect_timing.subscribe);
+        record_latency(LATENCY_ONLINE, millis());
     }
 
     mqtt_client.setCallback(mqtt_received);
+    configure_power_saving();
+    local_endpoint_setup();
+
+    // Events logged while offline go out before anything new
+    upload_event_log();
+    publish_lock_states();
+    publish_telemetry();
 
-    // Wait for events until timeout
-    Serial.println("Waiting for events");
+    // Wait for events until timeout, sleeping in between
+    LOG_INFO("Waiting for events");
+    if (loop_events_start_us == 0)
+        loop_events_start_us = esp_timer_get_time();
     unsigned long last_event = millis();
+    unsigned long batch_window_start = 0;
+    bool batch_window_open = false;
     while (millis() - last_event < EVENT_WAIT_TIME_MS) {
         // Restart the main loop if wifi or MQTT have dropped out 
-        if (mqtt_client.state() != MQTT_CONNECTED || WiFi.status() != WL_CONNECTED)
+        if (WiFi.status() != WL_CONNECTED || (!mqtt_offline && mqtt_client.state() != MQTT_CONNECTED))
             return;
 
         mqtt_client.loop();
+        triggered_events |= wait_for_events(0);
+        triggered_events &= ~TRIGGER_NETWORK;
+        finish_command_traces(false);
+
+        // Traces are written as they arrive but do not count as activity
+        if (triggered_events & TRIGGER_TRACE)
+            write_traces();
 
-        // Nothing happened, keep waiting
-        if (!triggered_event_flags.flags) {
-            delay(50);
+        // Stay awake while a key sequence is still being written, commands are waiting or a local client
+        // is connected
+        bool local_active = poll_local_endpoint();
+        if (write_busy() || command_busy() || local_active)
+            last_event = millis();
+
+        // Protocol frames and bolt events are collected for one window and published together
+        if (triggered_events & (TRIGGER_RMT | TRIGGER_LOCKED | TRIGGER_UNLOCKED)) {
+            last_event = millis();
+            if (!batch_window_open) {
+                batch_window_open = true;
+                batch_window_start = millis();
+            }
+            else if (millis() - batch_window_start >= MQTT_BATCH_WINDOW_MS) {
+                if (triggered_events & (TRIGGER_LOCKED | TRIGGER_UNLOCKED))
+                    arm_bolt_wakeup();
+                publish_event_batches();
+                batch_window_open = false;
+            }
+        }
+
+        // Nothing else happened, sleep until something does, the batch window closes or MQTT is due a poll
+        if (!(triggered_events & (TRIGGER_MQTT | TRIGGER_WRITTEN | TRIGGER_SEQUENCE | TRIGGER_COMMAND))) {
+            unsigned long timeout = local_active ? LOCAL_POLL_MS : MQTT_POLL_MS;
+            if (batch_window_open) {
+                unsigned long batch_elapsed = millis() - batch_window_start;
+                unsigned long batch_remaining = batch_elapsed >= MQTT_BATCH_WINDOW_MS ? 0 : MQTT_BATCH_WINDOW_MS - batch_elapsed;
+                if (batch_remaining < timeout)
+                    timeout = batch_remaining;
+            }
+            triggered_events |= wait_for_events(timeout);
             continue;
         }
 
         // Only process one event per loop
         last_event = millis();
-        if (triggered_event_flags.mqtt) {
+        if (triggered_events & TRIGGER_MQTT) {
             // MQTT events are handled immediately during callback
             // This just makes sure the device gives up and goes to sleep after the delay
-            triggered_event_flags.mqtt = false;
+            triggered_events &= ~TRIGGER_MQTT;
         }
-        else if (triggered_event_flags.rmt) {
-            // Send each RMT character from the queue to the MQTT server
-            char rmt_string[20];
-            while (powerbolt_queue_read_ptr != powerbolt_queue_write_ptr) {
-                trinket_powerbolt_queued_msg_t current = powerbolt_queue[powerbolt_queue_read_ptr];
-                sprintf(rmt_string, ">%c %02x", current.port == 0 ? 'D' : 'K', current.data);
-                mqtt_client.publish(DEVICE_NAME, rmt_string);
-
-                powerbolt_queue_read_ptr = (powerbolt_queue_read_ptr + 1) % POWERBOLT_QUEUE_SIZE;
-            }
-
-            triggered_event_flags.rmt = false;
+        else if (triggered_events & TRIGGER_WRITTEN) {
+            // Responses arrive through RMT, the command task times out the result
+            triggered_events &= ~TRIGGER_WRITTEN;
         }
-        else if (triggered_event_flags.locked) {
-            mqtt_client.publish(DEVICE_NAME, "> Locked");
-            triggered_event_flags.locked = false;
+        else if (triggered_events & TRIGGER_SEQUENCE) {
+            triggered_events &= ~TRIGGER_SEQUENCE;
+            publish_powerbolt_events();
         }
-        else if (triggered_event_flags.unlocked) {
-            mqtt_client.publish(DEVICE_NAME, "> Unlocked");
-            triggered_event_flags.unlocked = false;
+        else if (triggered_events & TRIGGER_COMMAND) {
+            publish_command_results();
         }
     }
 
     // No recent events, ok to turn off
+    log_task_stats();
     enter_deep_sleep();
 }
\ No newline at end of file
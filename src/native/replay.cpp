@@ -0,0 +1,244 @@
+#include <Arduino.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "powerbolt-protocol.h"
+#include "powerbolt-receiver.h"
+#include "powerbolt-sequence.h"
+#include "powerbolt-trace.h"
+
+// Replays recorded RMT traces through the driver's receive path, built by the native-replay environment
+//      pio run -e native-replay && .pio/build/native-replay/program [-v] trace.bin serial.log ...
+// Accepts binary traces from flash and serial monitor logs with "T " lines mixed in with other output
+// Every run goes through powerbolt_receiver_feed (decoder and repeat merging, as on the device) and the
+// frames through sequence tracking. Runs that start with a data bit are also checked with the fixed
+// 9 symbol parser, powerbolt_parse_buffer, to compare how many frames each decoder gets from real captures.
+// -v prints every frame, and the raw symbols of every run that decoded as invalid
+
+#define REPLAY_READ_TICK_NS        10000  // Reader tick the decoder is tuned for
+#define REPLAY_DATA_HIGH_MAX_TICKS 200  // Longer than any data bit high (0.7ms), far shorter than the start bit (30ms)
+#define REPLAY_MAX_LOCKS           8    // Trace ports are lock * 2 + reader
+
+typedef struct {
+    uint32_t runs;
+    uint32_t symbols;
+    uint32_t frames_valid;
+    uint32_t frames_invalid;
+    uint32_t repeats_seen;
+    uint32_t repeats_missing;
+    uint32_t decode_errors;
+    uint32_t symbols_discarded;
+    uint32_t parse_runs;
+    uint32_t parse_valid;
+    uint32_t events;
+    uint32_t truncated;
+    uint32_t bad_ports;
+} replay_totals_t;
+
+static bool verbose = false;
+
+static bool replay_load(const char *path, uint8_t **data, size_t *length) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return false;
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    *data = (uint8_t *) malloc(size > 0 ? size : 1);
+    *length = fread(*data, 1, size > 0 ? size : 0, file);
+    fclose(file);
+    return true;
+}
+
+static int replay_hex_digit(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+// Pulls the trace bytes out of a serial log in place, other lines are skipped
+static size_t replay_extract_serial(uint8_t *data, size_t length) {
+    size_t out = 0;
+    size_t pos = 0;
+    const size_t prefix_length = strlen(POWERBOLT_TRACE_LINE_PREFIX);
+    while (pos < length) {
+        size_t end = pos;
+        while (end < length && data[end] != '\n')
+            end++;
+
+        if (end - pos > prefix_length && memcmp(&data[pos], POWERBOLT_TRACE_LINE_PREFIX, prefix_length) == 0) {
+            for (size_t i = pos + prefix_length; i + 1 < end; i += 2) {
+                int high = replay_hex_digit(data[i]);
+                int low = replay_hex_digit(data[i + 1]);
+                if (high < 0 || low < 0)
+                    break;
+                data[out++] = high << 4 | low;
+            }
+        }
+        pos = end + 1;
+    }
+    return out;
+}
+
+// Deadbolt or keypad reader, with the lock number on a board that drives several
+static void replay_port_name(uint8_t port, char name[]) {
+    sprintf(name, "%u%c", port / 2, port % 2 == 0 ? 'D' : 'K');
+}
+
+static void replay_print_run(const powerbolt_trace_run_t *run) {
+    char name[8];
+    replay_port_name(run->port, name);
+    printf("    raw %s", name);
+    for (size_t i = 0; i < run->len; i++) {
+        uint32_t symbol = run->symbols[i];
+        printf(" %u:%u/%u:%u", (symbol >> 15) & 1, symbol & 0x7FFF, symbol >> 31, (symbol >> 16) & 0x7FFF);
+    }
+    printf("\n");
+}
+
+// Traces recorded at another tick are scaled to the reader tick the decoder expects
+static void replay_scale(powerbolt_trace_run_t *run, uint32_t tick_ns) {
+    if (tick_ns == REPLAY_READ_TICK_NS || tick_ns == 0)
+        return;
+
+    for (size_t i = 0; i < run->len; i++) {
+        uint32_t halves[2] = { run->symbols[i] & 0xFFFF, run->symbols[i] >> 16 };
+        for (uint8_t h = 0; h < 2; h++) {
+            uint64_t duration = (uint64_t) (halves[h] & 0x7FFF) * tick_ns / REPLAY_READ_TICK_NS;
+            halves[h] = (halves[h] & 0x8000) | (duration > POWERBOLT_MAX_DURATION_TICKS ? POWERBOLT_MAX_DURATION_TICKS : duration);
+        }
+        run->symbols[i] = halves[0] | halves[1] << 16;
+    }
+}
+
+static bool replay_trace(const char *path, replay_totals_t *totals) {
+    uint8_t *data;
+    size_t length;
+    if (!replay_load(path, &data, &length)) {
+        fprintf(stderr, "%s: cannot read\n", path);
+        return false;
+    }
+
+    powerbolt_trace_reader_t reader;
+    if (!powerbolt_trace_reader_begin(&reader, data, length)) {
+        length = replay_extract_serial(data, length);
+        if (!powerbolt_trace_reader_begin(&reader, data, length)) {
+            fprintf(stderr, "%s: no trace header\n", path);
+            free(data);
+            return false;
+        }
+    }
+
+    powerbolt_receiver_t receivers[REPLAY_MAX_LOCKS * 2];
+    powerbolt_sequence_t sequences[REPLAY_MAX_LOCKS];
+    for (uint8_t port = 0; port < REPLAY_MAX_LOCKS * 2; port++)
+        powerbolt_receiver_init(&receivers[port]);
+    for (uint8_t lock = 0; lock < REPLAY_MAX_LOCKS; lock++)
+        powerbolt_sequence_init(&sequences[lock]);
+    replay_totals_t file;
+    memset(&file, 0, sizeof(file));
+
+    powerbolt_trace_run_t run;
+    while (powerbolt_trace_next(&reader, &run)) {
+        if (run.port >= REPLAY_MAX_LOCKS * 2) {
+            file.bad_ports++;
+            continue;
+        }
+        replay_scale(&run, reader.tick_ns);
+        char name[8];
+        replay_port_name(run.port, name);
+        file.runs++;
+        file.symbols += run.len;
+
+        // The fixed parser only understands a run that starts with the first data bit, the streaming
+        // decoder also picks up frames split across runs so the counts are compared per file
+        if (run.len >= 9 && (run.symbols[0] & 0x7FFF) < REPLAY_DATA_HIGH_MAX_TICKS) {
+            file.parse_runs++;
+            file.parse_valid += powerbolt_parse_buffer(run.symbols).valid;
+        }
+
+        uint32_t errors_before = receivers[run.port].decoder.errors;
+        powerbolt_read_t frames[4];
+        size_t count = powerbolt_receiver_feed(&receivers[run.port], run.symbols, run.len, run.timestamp, frames, 4);
+
+        for (size_t i = 0; i < count; i++) {
+            if (!frames[i].valid) {
+                file.frames_invalid++;
+                continue;
+            }
+
+            file.frames_valid++;
+            if (verbose)
+                printf("  %10.3f %s %02x confidence %u\n", run.timestamp / 1e6, name, frames[i].data, frames[i].confidence);
+
+            POWERBOLT_EVENTS event = powerbolt_sequence_feed(&sequences[run.port / 2], run.port % 2, frames[i].data);
+            if (event != POWERBOLT_EVENT_NONE) {
+                file.events++;
+                if (verbose)
+                    printf("  %10.3f %u event %s\n", run.timestamp / 1e6, run.port / 2, powerbolt_event_name(event));
+            }
+        }
+
+        if (verbose && receivers[run.port].decoder.errors > errors_before) {
+            printf("  %10.3f %s invalid\n", run.timestamp / 1e6, name);
+            replay_print_run(&run);
+        }
+    }
+    file.truncated = reader.pos < reader.length;
+
+    for (uint8_t port = 0; port < REPLAY_MAX_LOCKS * 2; port++) {
+        file.repeats_seen += receivers[port].repeats_seen;
+        file.repeats_missing += receivers[port].repeats_missing + powerbolt_receiver_repeat_expired(&receivers[port], INT64_MAX);
+        file.decode_errors += receivers[port].decoder.errors;
+        file.symbols_discarded += receivers[port].decoder.discarded;
+    }
+
+    printf("%s: runs %u frames %u valid %u invalid, repeats %u seen %u missing, decode errors %u, discarded %u, "
+        "parse_buffer %u valid of %u runs, events %u%s%s\n",
+        path, file.runs, file.frames_valid, file.frames_invalid, file.repeats_seen, file.repeats_missing,
+        file.decode_errors, file.symbols_discarded, file.parse_valid, file.parse_runs, file.events,
+        file.truncated ? ", truncated" : "", file.bad_ports > 0 ? ", runs on unknown ports" : "");
+
+    uint32_t *sums = (uint32_t *) totals;
+    const uint32_t *values = (const uint32_t *) &file;
+    for (size_t i = 0; i < sizeof(replay_totals_t) / sizeof(uint32_t); i++)
+        sums[i] += values[i];
+    free(data);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    replay_totals_t totals;
+    memset(&totals, 0, sizeof(totals));
+    size_t files = 0;
+    int failed = 0;
+
+    unsigned long start = micros();
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-v") == 0) {
+            verbose = true;
+            continue;
+        }
+        if (replay_trace(argv[i], &totals))
+            files++;
+        else
+            failed = 1;
+    }
+    unsigned long elapsed_us = micros() - start;
+
+    if (files == 0 && !failed) {
+        fprintf(stderr, "usage: %s [-v] trace ...\n", argv[0]);
+        return 2;
+    }
+
+    printf("total: %zu traces, runs %u (%u symbols), frames %u valid %u invalid, repeats %u seen %u missing, "
+        "decode errors %u, parse_buffer %u valid of %u runs, events %u, %.1f ms (%.0f runs/s)\n",
+        files, totals.runs, totals.symbols, totals.frames_valid, totals.frames_invalid, totals.repeats_seen,
+        totals.repeats_missing, totals.decode_errors, totals.parse_valid, totals.parse_runs, totals.events,
+        elapsed_us / 1000.0, elapsed_us > 0 ? totals.runs * 1e6 / elapsed_us : 0);
+    return failed;
+}
@@ -0,0 +1,465 @@
+#include <Arduino.h>
+#include "powerbolt-protocol.h"
+#include "powerbolt-decoder.h"
+#include "powerbolt-receiver.h"
+#include "powerbolt-pacing.h"
+#include "powerbolt-sequence.h"
+#include "powerbolt-capture.h"
+#include "powerbolt-sim.h"
+
+// Host simulator, built by the native environment (pio run -e native && .pio/build/native/program)
+// Measures encoder/decoder throughput, then unlocks a virtual deadbolt over simulated wires with fixed
+// key timing and with ack pacing to compare the end-to-end latency of a code, and decodes frames
+// sampled by the ULP capture loop with its sample period off
+
+#define KEYPAD_TIMEOUT_US           3000000
+#define SIM_TIMEOUT_US              20000000
+#define SIM_UNLOCKS                 8
+#define SIM_MAX_DELIVERIES          128
+#define SIM_NEVER                   UINT64_MAX
+
+#define BENCH_ITERATIONS            1000000
+
+#define CAPTURE_FRAMES              64
+#define CAPTURE_MAX_RECORDS         64
+
+typedef struct {
+    const char *name;
+    double drift;
+    uint32_t jitter_us;
+    double glitch_rate;
+} sim_scenario_t;
+
+// Drift applies to the deadbolt, the ESP32 and keypad clocks are taken as exact
+static const sim_scenario_t scenarios[] = {
+    { "nominal", 1.0, 0, 0 },
+    { "jitter 30us", 1.0, 30, 0 },
+    { "slow 1.2x", 1.2, 20, 0 },
+    { "fast 0.85x", 0.85, 20, 0 },
+    { "glitches", 1.0, 20, 0.3 },
+    { "slow 1.3x noisy", 1.3, 50, 0.3 }
+};
+
+// 1234 on the keypad
+static const POWERBOLT_KEY_CODES unlock_keys[] = { KEY_12, KEY_12, KEY_34, KEY_34 };
+static const uint8_t unlock_code[] = { 0x01, 0x01, 0x02, 0x02 };
+
+typedef struct {
+    uint64_t time_us;
+    uint8_t port;
+    powerbolt_sim_run_t run;
+} sim_delivery_t;
+
+// The driver's write states without the queue for the shared writer, the pacing decisions are the
+// driver's own (powerbolt-pacing), times are simulated
+enum SIM_WRITE_STATES {
+    WRITE_IDLE, WRITE_TRANSMITTING, WRITE_WAITING_ACK, WRITE_GAP
+};
+
+typedef struct {
+    SIM_WRITE_STATES state;
+    bool paced;
+    powerbolt_pacing_t pacing;
+    powerbolt_pacing_gap_t ack_gap;
+    uint64_t timer_us;
+} sim_writer_t;
+
+typedef struct {
+    powerbolt_sim_wire_t wires[2];
+    powerbolt_sim_deadbolt_t deadbolt;
+    powerbolt_sim_keypad_t keypad;
+    powerbolt_sim_schedule_t schedule;
+    sim_delivery_t deliveries[SIM_MAX_DELIVERIES];
+    size_t delivery_count;
+
+    powerbolt_receiver_t receivers[2];
+    powerbolt_sequence_t sequence;
+    sim_writer_t writer;
+
+    uint64_t accepted_us;
+    uint32_t frames;
+    uint32_t decode_errors;
+} sim_t;
+
+static volatile uint32_t bench_sink;
+
+static void bench_report(const char *name, uint32_t iterations, unsigned long elapsed_us) {
+    double ns = elapsed_us * 1000.0 / iterations;
+    printf("  %-24s %8.1f ns/op %12.0f ops/s\n", name, ns, ns > 0 ? 1e9 / ns : 0);
+}
+
+// One frame as the reader sees it, split into runs at nominal timing
+static size_t bench_frame_runs(uint8_t command, powerbolt_sim_run_t runs[]) {
+    powerbolt_sim_wire_t wire;
+    rmt_data_t buffer[POWERBOLT_KEY_SYMBOLS];
+    powerbolt_sim_wire_init(&wire, 1.0, 0, 1);
+    powerbolt_write_buffer_raw(buffer, command);
+    return powerbolt_sim_wire_transmit(&wire, buffer, POWERBOLT_KEY_SYMBOLS, POWERBOLT_SIM_WRITE_TICK_US, runs, POWERBOLT_SIM_MAX_RUNS);
+}
+
+static void bench_throughput() {
+    rmt_data_t buffer[POWERBOLT_KEY_SYMBOLS];
+    powerbolt_sim_run_t runs[POWERBOLT_SIM_MAX_RUNS];
+    size_t run_count = bench_frame_runs(0xC4, runs);
+
+    printf("throughput\n");
+
+    unsigned long start = micros();
+    for (uint32_t i = 0; i < BENCH_ITERATIONS; i++) {
+        powerbolt_write_buffer(buffer, (POWERBOLT_KEY_CODES) (i % sizeof(powerbolt_key_codes)));
+        bench_sink ^= buffer[i % POWERBOLT_KEY_SYMBOLS].val;
+    }
+    bench_report("encode key", BENCH_ITERATIONS, micros() - start);
+
+    start = micros();
+    for (uint32_t i = 0; i < BENCH_ITERATIONS; i++) {
+        powerbolt_write_buffer_raw(buffer, (uint8_t) i);
+        bench_sink ^= buffer[i % POWERBOLT_KEY_SYMBOLS].val;
+    }
+    bench_report("encode raw", BENCH_ITERATIONS, micros() - start);
+
+    // The 9 symbol run holding the first copy of the frame
+    size_t data_run = 0;
+    while (data_run < run_count && runs[data_run].len != 9)
+        data_run++;
+    if (data_run == run_count) {
+        printf("  no data run in the simulated frame\n");
+        return;
+    }
+
+    start = micros();
+    for (uint32_t i = 0; i < BENCH_ITERATIONS; i++)
+        bench_sink ^= powerbolt_parse_buffer(runs[data_run].symbols).data;
+    bench_report("parse buffer", BENCH_ITERATIONS, micros() - start);
+
+    // Both copies of the frame including the start bit runs, per decoded frame
+    powerbolt_decoder_t decoder;
+    powerbolt_read_t frames[4];
+    powerbolt_decoder_init(&decoder);
+    uint32_t decoded = 0;
+    start = micros();
+    for (uint32_t i = 0; i < BENCH_ITERATIONS / 2; i++) {
+        for (size_t r = 0; r < run_count; r++) {
+            size_t count = powerbolt_decoder_feed(&decoder, runs[r].symbols, runs[r].len, frames, 4);
+            for (size_t f = 0; f < count; f++)
+                decoded += frames[f].valid;
+        }
+    }
+    bench_report("decoder feed", decoded ? decoded : 1, micros() - start);
+    bench_sink ^= decoded;
+}
+
+// Puts a transmit buffer on a wire, its runs reach the readers later
+static void sim_transmit(sim_t *sim, uint8_t port, const rmt_data_t buffer[], size_t len, uint64_t time_us) {
+    static powerbolt_sim_run_t runs[POWERBOLT_SIM_MAX_RUNS];
+    size_t count = powerbolt_sim_wire_transmit(&sim->wires[port], buffer, len, POWERBOLT_SIM_WRITE_TICK_US, runs, POWERBOLT_SIM_MAX_RUNS);
+
+    for (size_t r = 0; r < count && sim->delivery_count < SIM_MAX_DELIVERIES; r++) {
+        uint64_t delivery_us = time_us + runs[r].end_us;
+        size_t i = sim->delivery_count++;
+        while (i > 0 && sim->deliveries[i - 1].time_us > delivery_us) {
+            sim->deliveries[i] = sim->deliveries[i - 1];
+            i--;
+        }
+        sim->deliveries[i].time_us = delivery_us;
+        sim->deliveries[i].port = port;
+        sim->deliveries[i].run = runs[r];
+    }
+}
+
+static void sim_write_next_key(sim_t *sim, uint64_t time_us) {
+    rmt_data_t buffer[POWERBOLT_KEY_SYMBOLS];
+    powerbolt_write_buffer(buffer, unlock_keys[powerbolt_pacing_next_key(&sim->writer.pacing)]);
+    sim->writer.state = WRITE_TRANSMITTING;
+    sim->writer.timer_us = time_us + powerbolt_sim_duration_us(buffer, POWERBOLT_KEY_SYMBOLS, POWERBOLT_SIM_WRITE_TICK_US);
+    sim_transmit(sim, 1, buffer, POWERBOLT_KEY_SYMBOLS, time_us);
+}
+
+static void sim_write_start(sim_t *sim, bool paced) {
+    size_t count = sizeof(unlock_keys) / sizeof(unlock_keys[0]);
+    sim->writer.paced = paced;
+    powerbolt_pacing_start(&sim->writer.pacing, count);
+    if (paced) {
+        sim_write_next_key(sim, 0);
+        return;
+    }
+
+    // The whole code as one transmission, like trinket_powerbolt_write_async
+    static rmt_data_t buffer[POWERBOLT_SIM_MAX_SYMBOLS];
+    uint32_t gap_ticks = POWERBOLT_WRITE_WAIT_MS * 1000 / POWERBOLT_SIM_WRITE_TICK_US;
+    size_t len = powerbolt_write_sequence_buffer(buffer, unlock_keys, count, gap_ticks);
+    sim->writer.state = WRITE_TRANSMITTING;
+    sim->writer.timer_us = powerbolt_sim_duration_us(buffer, len, POWERBOLT_SIM_WRITE_TICK_US);
+    sim_transmit(sim, 1, buffer, len, 0);
+}
+
+// Same as rmt_write_pace() in the driver, a key that is due goes out straight away as the writer is
+// never shared here
+static void sim_write_pace(sim_t *sim, POWERBOLT_PACING_ACTIONS action, uint64_t time_us) {
+    sim_writer_t *writer = &sim->writer;
+    switch (action) {
+    case POWERBOLT_PACING_WAIT_ACK:
+        writer->state = WRITE_WAITING_ACK;
+        writer->timer_us = time_us + POWERBOLT_ACK_TIMEOUT_MS * 1000;
+        break;
+
+    case POWERBOLT_PACING_GAP:
+        writer->state = WRITE_GAP;
+        writer->timer_us = time_us + writer->pacing.gap->gap_ms * 1000;
+        break;
+
+    case POWERBOLT_PACING_NEXT_KEY:
+        sim_write_next_key(sim, time_us);
+        break;
+
+    case POWERBOLT_PACING_FINISH:
+        writer->state = WRITE_IDLE;
+        break;
+
+    default:
+        break;
+    }
+}
+
+static void sim_write_timer(sim_t *sim, uint64_t time_us) {
+    sim_writer_t *writer = &sim->writer;
+    POWERBOLT_PACING_ACTIONS action = POWERBOLT_PACING_NONE;
+    writer->timer_us = SIM_NEVER;
+
+    switch (writer->state) {
+    case WRITE_TRANSMITTING:
+        action = writer->paced ? powerbolt_pacing_sent(&writer->pacing, time_us) : POWERBOLT_PACING_FINISH;
+        break;
+
+    case WRITE_WAITING_ACK:
+        action = powerbolt_pacing_ack_timeout(&writer->pacing);
+        break;
+
+    case WRITE_GAP:
+        action = powerbolt_pacing_gap_elapsed(&writer->pacing, time_us);
+        break;
+
+    default:
+        break;
+    }
+    sim_write_pace(sim, action, time_us);
+}
+
+static void sim_write_response(sim_t *sim, uint8_t data, uint64_t time_us) {
+    sim_writer_t *writer = &sim->writer;
+    if (!writer->paced || writer->state == WRITE_IDLE)
+        return;
+
+    POWERBOLT_PACING_ACTIONS action = powerbolt_pacing_response(&writer->pacing, data,
+        writer->state == WRITE_TRANSMITTING, writer->state == WRITE_WAITING_ACK, time_us);
+    sim_write_pace(sim, action, time_us);
+}
+
+// A logical frame with its repeat removed, as the driver and the deadbolt would see it
+static void sim_on_frame(sim_t *sim, uint8_t port, powerbolt_read_t frame, uint64_t time_us) {
+    if (!frame.valid) {
+        sim->decode_errors++;
+        return;
+    }
+    sim->frames++;
+
+    if (port == 1)
+        powerbolt_sim_deadbolt_key(&sim->deadbolt, frame.data, time_us, &sim->schedule);
+    else
+        sim_write_response(sim, frame.data, time_us);
+    powerbolt_sim_keypad_frame(&sim->keypad, port, frame.data, time_us);
+
+    POWERBOLT_EVENTS event = powerbolt_sequence_feed(&sim->sequence, port, frame.data);
+    if (event == POWERBOLT_EVENT_CODE_ACCEPTED && sim->accepted_us == SIM_NEVER)
+        sim->accepted_us = time_us;
+}
+
+static void sim_init(sim_t *sim, const sim_scenario_t *scenario, uint32_t seed, powerbolt_pacing_gap_t ack_gap) {
+    memset(sim, 0, sizeof(sim_t));
+    powerbolt_sim_wire_init(&sim->wires[0], scenario->drift, scenario->jitter_us, seed);
+    powerbolt_sim_wire_init(&sim->wires[1], 1.0, scenario->jitter_us, seed * 7 + 1);
+    sim->wires[0].glitch_rate = scenario->glitch_rate;
+    sim->wires[1].glitch_rate = scenario->glitch_rate;
+
+    powerbolt_sim_deadbolt_init(&sim->deadbolt, unlock_code, sizeof(unlock_code), true);
+    powerbolt_sim_keypad_init(&sim->keypad, KEYPAD_TIMEOUT_US);
+    powerbolt_sim_schedule_init(&sim->schedule);
+    powerbolt_receiver_init(&sim->receivers[0]);
+    powerbolt_receiver_init(&sim->receivers[1]);
+    powerbolt_sequence_init(&sim->sequence);
+
+    sim->writer.ack_gap = ack_gap;
+    powerbolt_pacing_init(&sim->writer.pacing, &sim->writer.ack_gap);
+    sim->writer.timer_us = SIM_NEVER;
+    sim->accepted_us = SIM_NEVER;
+}
+
+// Runs the event queues until the code is accepted or nothing is left to happen
+static void sim_unlock(sim_t *sim, bool paced) {
+    sim_write_start(sim, paced);
+
+    while (sim->accepted_us == SIM_NEVER) {
+        const powerbolt_sim_frame_t *frame = powerbolt_sim_schedule_peek(&sim->schedule);
+        uint64_t frame_us = frame != NULL ? frame->time_us : SIM_NEVER;
+        uint64_t delivery_us = sim->delivery_count > 0 ? sim->deliveries[0].time_us : SIM_NEVER;
+        uint64_t keypad_us = sim->keypad.waiting ? sim->keypad.last_activity_us + sim->keypad.timeout_us : SIM_NEVER;
+        uint64_t time_us = frame_us;
+        if (delivery_us < time_us)
+            time_us = delivery_us;
+        if (sim->writer.timer_us < time_us)
+            time_us = sim->writer.timer_us;
+        if (keypad_us < time_us)
+            time_us = keypad_us;
+
+        if (time_us == SIM_NEVER || time_us > SIM_TIMEOUT_US)
+            break;
+
+        if (time_us == delivery_us) {
+            sim_delivery_t delivery = sim->deliveries[0];
+            sim->delivery_count--;
+            memmove(&sim->deliveries[0], &sim->deliveries[1], sim->delivery_count * sizeof(sim_delivery_t));
+
+            powerbolt_read_t frames[4];
+            size_t count = powerbolt_receiver_feed(&sim->receivers[delivery.port], delivery.run.symbols, delivery.run.len,
+                time_us, frames, 4);
+            for (size_t i = 0; i < count; i++)
+                sim_on_frame(sim, delivery.port, frames[i], time_us);
+        }
+        else if (time_us == frame_us) {
+            powerbolt_sim_frame_t next;
+            rmt_data_t buffer[POWERBOLT_KEY_SYMBOLS];
+            powerbolt_sim_schedule_next(&sim->schedule, &next);
+            powerbolt_write_buffer_raw(buffer, next.data);
+            sim_transmit(sim, next.port, buffer, POWERBOLT_KEY_SYMBOLS, time_us);
+        }
+        else if (time_us == sim->writer.timer_us)
+            sim_write_timer(sim, time_us);
+        else
+            powerbolt_sim_keypad_poll(&sim->keypad, time_us, &sim->schedule);
+    }
+}
+
+static void sim_latency(bool paced) {
+    printf("%s\n", paced ? "unlock latency, ack paced" : "unlock latency, fixed 750ms gap");
+    printf("  %-18s %8s %10s %10s %8s %8s %8s %8s\n", "scenario", "accepted", "mean ms", "max ms", "timeouts", "errors", "gap ms", "floor ms");
+
+    for (size_t s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); s++) {
+        powerbolt_pacing_gap_t ack_gap = { POWERBOLT_ACK_INITIAL_GAP_MS, 0 };
+        uint32_t accepted = 0;
+        uint32_t timeouts = 0;
+        uint32_t errors = 0;
+        uint64_t total_us = 0;
+        uint64_t max_us = 0;
+
+        // The learned gap carries over between unlocks like it does in RTC memory
+        for (uint32_t n = 0; n < SIM_UNLOCKS; n++) {
+            static sim_t sim;
+            sim_init(&sim, &scenarios[s], n + 1, ack_gap);
+            sim_unlock(&sim, paced);
+
+            ack_gap = sim.writer.ack_gap;
+            timeouts += sim.writer.pacing.timeouts;
+            errors += sim.decode_errors;
+            if (sim.accepted_us == SIM_NEVER)
+                continue;
+            accepted++;
+            total_us += sim.accepted_us;
+            if (sim.accepted_us > max_us)
+                max_us = sim.accepted_us;
+        }
+
+        printf("  %-18s %5u/%-2u %10.1f %10.1f %8u %8u %8u %8u\n", scenarios[s].name, accepted, SIM_UNLOCKS,
+            accepted ? total_us / 1000.0 / accepted : 0.0, max_us / 1000.0, timeouts, errors, ack_gap.gap_ms,
+            ack_gap.floor_ms);
+    }
+}
+
+// The ULP runs off the RTC fast clock, so its real sample period differs from the nominal one the
+// records are decoded with. Error is real over nominal period
+static const double capture_errors[] = { 0.7, 0.8, 0.9, 1.0, 1.1, 1.2, 1.3 };
+
+typedef struct {
+    powerbolt_decoder_t decoder;
+    uint8_t data;
+    uint32_t copies;
+    uint32_t errors;
+    uint64_t end_ns[POWERBOLT_SIM_MAX_RUNS];
+    size_t runs;
+} capture_sim_t;
+
+// powerbolt_capture_runs() takes a plain callback
+static capture_sim_t capture_sim;
+
+static void capture_on_run(uint8_t port, uint32_t *symbols, size_t len, uint64_t end_ns) {
+    powerbolt_read_t frames[4];
+    size_t count = powerbolt_decoder_feed(&capture_sim.decoder, symbols, len, frames, 4);
+    for (size_t f = 0; f < count; f++) {
+        if (frames[f].valid && frames[f].data == capture_sim.data)
+            capture_sim.copies++;
+        else
+            capture_sim.errors++;
+    }
+    if (capture_sim.runs < POWERBOLT_SIM_MAX_RUNS)
+        capture_sim.end_ns[capture_sim.runs++] = end_ns;
+}
+
+// Every frame is sampled, turned back into runs and decoded. Run times rebuilt from the sample counts
+// are compared with when the RMT reader would have delivered the same runs. The count saturates 12ms
+// into the 30ms start high, so most of the error is the rest of it. The last run is left out because capture
+// ends at its last edge instead of after the idle threshold
+static void sim_ulp_capture() {
+    printf("ulp capture, %u frames, %uns nominal sample period\n", CAPTURE_FRAMES, POWERBOLT_CAPTURE_SAMPLE_NS);
+    printf("  %-18s %8s %8s %16s\n", "sample error", "frames", "errors", "max time err ms");
+
+    for (size_t e = 0; e < sizeof(capture_errors) / sizeof(capture_errors[0]); e++) {
+        uint32_t decoded = 0;
+        uint32_t errors = 0;
+        double max_error_us = 0;
+        for (uint32_t n = 0; n < CAPTURE_FRAMES; n++) {
+            uint8_t data = (uint8_t) (n * 37 + 1);
+            rmt_data_t buffer[POWERBOLT_KEY_SYMBOLS];
+            powerbolt_write_buffer_raw(buffer, data);
+
+            // The same seed gives both wires the same jitter
+            powerbolt_sim_wire_t wire;
+            powerbolt_sim_run_t runs[POWERBOLT_SIM_MAX_RUNS];
+            powerbolt_sim_wire_init(&wire, 1.0, 20, n + 1);
+            size_t run_count = powerbolt_sim_wire_transmit(&wire, buffer, POWERBOLT_KEY_SYMBOLS,
+                POWERBOLT_SIM_WRITE_TICK_US, runs, POWERBOLT_SIM_MAX_RUNS);
+
+            uint32_t records[CAPTURE_MAX_RECORDS];
+            powerbolt_sim_wire_init(&wire, 1.0, 20, n + 1);
+            size_t record_count = powerbolt_sim_wire_capture(&wire, buffer, POWERBOLT_KEY_SYMBOLS, POWERBOLT_SIM_WRITE_TICK_US,
+                POWERBOLT_CAPTURE_SAMPLE_NS * capture_errors[e] / 1000.0, POWERBOLT_CAPTURE_PORT0, records, CAPTURE_MAX_RECORDS);
+
+            powerbolt_decoder_init(&capture_sim.decoder);
+            capture_sim.data = data;
+            capture_sim.copies = 0;
+            capture_sim.errors = 0;
+            capture_sim.runs = 0;
+            powerbolt_capture_runs(records, record_count, POWERBOLT_CAPTURE_SAMPLE_NS, POWERBOLT_SIM_READ_TICK_US * 1000,
+                POWERBOLT_CAPTURE_IDLE_TICKS, capture_on_run);
+
+            // Both copies of the frame have to come through
+            decoded += capture_sim.copies >= 2;
+            errors += capture_sim.errors;
+            for (size_t r = 0; r + 1 < capture_sim.runs && r + 1 < run_count; r++) {
+                double error_us = capture_sim.end_ns[r] / 1000.0 - (double) runs[r].end_us;
+                if (error_us < 0)
+                    error_us = -error_us;
+                if (error_us > max_error_us)
+                    max_error_us = error_us;
+            }
+        }
+
+        printf("  %-18.2f %5u/%-2u %8u %16.1f\n", capture_errors[e], decoded, CAPTURE_FRAMES, errors, max_error_us / 1000);
+    }
+}
+
+int main() {
+    bench_throughput();
+    sim_latency(false);
+    sim_latency(true);
+    sim_ulp_capture();
+    return 0;
+}
@@ -1,75 +1,856 @@
 #include "trinket-powerbolt.h"
 
 #include "esp32-hal.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "esp_sleep.h"
+#include "esp32/ulp.h"
+#include "driver/rtc_io.h"
+#include "soc/rtc_cntl_reg.h"
+#include "soc/rtc_io_reg.h"
+#if CONFIG_PM_ENABLE
+#include "esp_pm.h"
+#endif
+#include "powerbolt-capture.h"
+#include "powerbolt-pacing.h"
 #include "powerbolt-protocol.h"
+#include "powerbolt-receiver.h"
+#include "spsc-ring.h"
+
+// RMT tick lengths in ns
+// Write is 10x slower than read because it needs to output very long start/stop pulses
+#define RMT_READ_TICK_NS        TRINKET_POWERBOLT_READ_TICK_NS
+#define RMT_WRITE_TICK_NS       100000
+
+// Protocol engine task, kept off core 1 where loop() runs TLS and MQTT and can hold the CPU for a long time
+// Core 0 runs the WiFi driver and lwIP. The engine sits between them in priority and only works for a
+// few microseconds per run, so neither is held up noticeably
+// RMT interrupts are allocated on the core that sets the channels up, so they follow the engine
+#define ENGINE_CORE             0
+#define ENGINE_PRIORITY         (configMAX_PRIORITIES - 5)  // Above lwIP, below the WiFi driver
+#define ENGINE_STACK            3072
+#define ENGINE_RUN_SYMBOLS      TRINKET_POWERBOLT_MAX_RUN   // Longest run copied out of the interrupt, a frame is 9 symbols
+#define ENGINE_RUN_QUEUE_SIZE   16      // Per port, must be a power of two
+#define ENGINE_NOTIFY_RX        (1 << 0)
+#define ENGINE_NOTIFY_WRITE     (1 << 1)
+#define ENGINE_NOTIFY_SETUP     (1 << 2)
+#define ENGINE_NOTIFY_READ      (1 << 3)
+
+// A run that has not finished a frame keeps the CPU out of light sleep this long, enough to reach the
+// stop bit from the start bit run with the deadbolt's clock 1.4x slow
+#define READ_FRAME_US           60000
+
+// ULP capture during deep sleep, see powerbolt-capture.h for the record layout
+// One register read samples both lines, so they must be RTC GPIO 5 (GPIO35) and 9 (GPIO32)
+#define ULP_PORT0_RTC_GPIO      5
+#define ULP_PORT1_RTC_GPIO      9
+#define ULP_LEVEL_MASK          (1 | 1 << (ULP_PORT1_RTC_GPIO - ULP_PORT0_RTC_GPIO))
+#define ULP_CAPTURE_EDGES       320     // About four keys with their acks
+#define ULP_WAKE_EDGES          18      // Most of one frame copy (20 edges), shorter bursts are noise
+#define ULP_POLL_US             10000   // The start bit is 30ms high, the ULP only has to see part of it
+#define ULP_SAMPLE_NS           POWERBOLT_CAPTURE_SAMPLE_NS
+#define ULP_REPLAY_IDLE_TICKS   POWERBOLT_CAPTURE_IDLE_TICKS
+
+// Each reader has one RMT memory block, the smallest size, which would hold both copies of a frame
+#define RMT_READ_MEMORY         RMT_MEM_64
+#define RMT_READ_BLOCK_SYMBOLS  64
+
+static_assert(POWERBOLT_KEY_SYMBOLS <= RMT_READ_BLOCK_SYMBOLS && POWERBOLT_KEY_SYMBOLS <= ENGINE_RUN_SYMBOLS,
+    "Both copies of a frame must fit the reader memory and the engine queue");
+static_assert((ULP_LEVEL_MASK << POWERBOLT_CAPTURE_LEVEL_SHIFT) == (POWERBOLT_CAPTURE_PORT0 | POWERBOLT_CAPTURE_PORT1),
+    "ULP record layout does not match powerbolt-capture.h");
 
 // Private declarations
-static void rmt_on_receive_from_powerbolt(uint32_t *data, size_t len);
-static void rmt_on_receive_from_keypad(uint32_t *data, size_t len);
+static void rmt_on_write_timer(void *arg);
+#if CONFIG_PM_ENABLE
+static void rmt_on_read_timer(void *arg);
+#endif
+static void engine_main(void *arg);
+
+// Raw runs copied out of the RMT interrupt for the engine task, in order per port
+typedef struct {
+    int64_t timestamp;
+    uint8_t len;
+    uint32_t symbols[ENGINE_RUN_SYMBOLS];
+} rmt_run_t;
+
+// Asynchronous write state
+// A fixed-gap sequence is one RMT transmission and the timer fires when it has been played back.
+// An ack-paced sequence is one transmission per key, the timer also covers the ack timeout and gap.
+// A write is claimed by the caller (STARTING), queued for the shared writer (QUEUED) and put on the
+// wire by the engine task once no other lock is transmitting
+enum WRITE_STATES {
+    WRITE_IDLE, WRITE_STARTING, WRITE_QUEUED, WRITE_TRANSMITTING, WRITE_WAITING_ACK, WRITE_GAP
+};
+
+// Port 0 reads the deadbolt on the keypad read pin, port 1 reads the keypad on the read/write pin
+struct trinket_powerbolt_s {
+    bool allocated;
+    bool ready;
+    uint8_t index;
+    trinket_powerbolt_config_t config;
+
+    // Readers, decoders and repeat merging, the decoders are only touched by the engine task
+    rmt_obj_t *readers[2];
+    powerbolt_receiver_t receivers[2];
+    spsc_ring<rmt_run_t, ENGINE_RUN_QUEUE_SIZE> runs[2];
+    volatile uint32_t runs_truncated;
+    volatile uint32_t runs_spurious[2];
+    volatile uint32_t frames_received;
+#if CONFIG_PM_ENABLE
+    // Light sleep is held off until the frame on each port and its repeat are done, engine task only
+    esp_timer_handle_t read_timer;
+    int64_t read_awake_until[2];
+    bool read_awake;
+#endif
+
+    // Write state, shared between the caller, the engine task and the esp_timer task under write_mux
+    esp_timer_handle_t write_timer;
+    volatile WRITE_STATES write_state;
+    rmt_data_t send_buffer[TRINKET_POWERBOLT_MAX_SEQUENCE * POWERBOLT_KEY_SYMBOLS];
+    size_t send_len;
+    POWERBOLT_KEY_CODES write_sequence[TRINKET_POWERBOLT_MAX_SEQUENCE];
+    POWERBOLT_KEY_CODES write_key;
+    bool write_paced;
+    powerbolt_pacing_t pacing;
+
+    size_t ulp_captured;
+    size_t ulp_runs;
+};
 
 // Private variables
-rmt_obj_t *rmt_writer = NULL; 
-rmt_data_t rmt_send_buffer[20];
-rmt_obj_t *rmt_reader_from_powerbolt = NULL;
-rmt_obj_t *rmt_reader_from_keypad = NULL;
-rmt_data_t rmt_read_from_powerbolt_buffer[20];
-rmt_data_t rmt_read_from_keypad_buffer[20];
-void (*read_callback)(uint8_t, powerbolt_read_t) = NULL;
-
-void trinket_powerbolt_setup(int keypad_read_pin, int powerbolt_read_write_pin) {
-    // Configure RMT writer to interface with Powerbolt, but detach the writer from the pin
-    rmt_writer = rmtInit(powerbolt_read_write_pin, true, RMT_MEM_64);
-    pinMatrixOutDetach(powerbolt_read_write_pin, 0, 0);
-
-    // Configure RMT reader to interface with Powerbolt
-    rmt_reader_from_powerbolt = rmtInit(keypad_read_pin, false, RMT_MEM_128);
-    rmt_reader_from_keypad = rmtInit(powerbolt_read_write_pin, false, RMT_MEM_128);
-
-    // Set RMT tick rates
-    // Write is 10x slower than read because it needs to output very long start/stop pulses
-    rmtSetTick(rmt_reader_from_powerbolt, 10000);
-    rmtSetTick(rmt_reader_from_keypad, 10000);
-    rmtSetTick(rmt_writer, 100000);
+static trinket_powerbolt_t powerbolts[TRINKET_POWERBOLT_MAX_LOCKS];
+
+// One writer for every lock, attached to a lock's read/write pin through the GPIO matrix only while
+// that lock transmits
+static rmt_obj_t *rmt_writer = NULL;
+static portMUX_TYPE write_mux = portMUX_INITIALIZER_UNLOCKED;
+static trinket_powerbolt_t *write_owner = NULL;
+static uint8_t write_last_owner = 0;
+
+static TaskHandle_t engine_task = NULL;
+static SemaphoreHandle_t engine_ready = NULL;
+static trinket_powerbolt_t *engine_setup_request = NULL;
+static volatile uint32_t engine_busy_us = 0;
+static volatile uint32_t engine_wakeups = 0;
+
+// Written by the ULP while the main cores sleep, only the low 16 bits of each word are ULP data
+// Only one lock can have the ULP pins, it owns the capture
+typedef struct {
+    uint32_t count;
+    uint32_t records[ULP_CAPTURE_EDGES];
+} ulp_capture_t;
+RTC_DATA_ATTR static ulp_capture_t ulp_capture;
+
+// The RMT clock stops in light sleep, so the CPU is kept awake from the first key to the end of a write
+// and from the start bit of a received frame until it is decoded. The locks count, every lock with a
+// write or a frame in progress holds them once
+#if CONFIG_PM_ENABLE
+static esp_pm_lock_handle_t write_pm_lock = NULL;
+static esp_pm_lock_handle_t read_pm_lock = NULL;
+#endif
+
+// Learned gap after an ack and its floor per lock, kept across deep sleep, 0 until the lock is first set up
+RTC_DATA_ATTR static powerbolt_pacing_gap_t ack_gaps[TRINKET_POWERBOLT_MAX_LOCKS];
+
+// An empty run or one whose levels all ended before noise_ticks, which no part of a frame does
+// A level that timed out has a duration of 0, a run with nothing else is the start bit or its low
+static bool rmt_run_spurious(const uint32_t *data, size_t len, uint16_t noise_ticks) {
+    bool ended = false;
+    for (size_t i = 0; i < len; i++) {
+        const uint32_t durations[2] = { data[i] & 0x7FFF, data[i] >> 16 & 0x7FFF };
+        for (uint8_t half = 0; half < 2; half++) {
+            if (durations[half] >= noise_ticks)
+                return false;
+            ended |= durations[half] > 0;
+        }
+    }
+    return len == 0 || ended;
+}
+
+// Runs in the RMT interrupt, only copies the run out of the channel memory and wakes the engine
+// Spurious runs are counted and dropped here, so noise does not wake the engine
+static void rmt_capture(trinket_powerbolt_t *powerbolt, uint8_t port, uint32_t *data, size_t len) {
+    if (rmt_run_spurious(data, len, powerbolt->config.rx_profile.noise_ticks)) {
+        powerbolt->runs_spurious[port]++;
+        return;
+    }
+
+    rmt_run_t run;
+    run.timestamp = esp_timer_get_time();
+    run.len = len > ENGINE_RUN_SYMBOLS ? ENGINE_RUN_SYMBOLS : len;
+    if (len > ENGINE_RUN_SYMBOLS)
+        powerbolt->runs_truncated++;
+    memcpy(run.symbols, data, run.len * sizeof(uint32_t));
+    powerbolt->runs[port].push(run, (uint32_t) (run.timestamp / 1000));
+
+    BaseType_t higher_priority_woken = pdFALSE;
+    xTaskNotifyFromISR(engine_task, ENGINE_NOTIFY_RX, eSetBits, &higher_priority_woken);
+    if (higher_priority_woken)
+        portYIELD_FROM_ISR();
+}
+
+// The HAL read callback has no argument, so every reader gets its own entry point
+template <uint8_t READER>
+static void rmt_on_receive_isr(uint32_t *data, size_t len) {
+    rmt_capture(&powerbolts[READER / 2], READER % 2, data, len);
+}
+
+static void (* const rmt_receive_isrs[])(uint32_t *, size_t) = {
+    rmt_on_receive_isr<0>, rmt_on_receive_isr<1>, rmt_on_receive_isr<2>,
+    rmt_on_receive_isr<3>, rmt_on_receive_isr<4>, rmt_on_receive_isr<5>
+};
+static_assert(sizeof(rmt_receive_isrs) / sizeof(rmt_receive_isrs[0]) == TRINKET_POWERBOLT_MAX_LOCKS * 2,
+    "One receive entry point per reader");
+
+// Runs on the engine task, false when the RMT has run out of channels
+static bool rmt_setup(trinket_powerbolt_t *powerbolt) {
+    int keypad_read_pin = powerbolt->config.keypad_read_pin;
+    int powerbolt_read_write_pin = powerbolt->config.powerbolt_read_write_pin;
+
+    // The first lock configures the writer shared by every lock, detached from the pin until a write
+    if (rmt_writer == NULL) {
+        rmt_writer = rmtInit(powerbolt_read_write_pin, true, RMT_MEM_64);
+        if (rmt_writer == NULL)
+            return false;
+        pinMatrixOutDetach(powerbolt_read_write_pin, 0, 0);
+        rmtSetTick(rmt_writer, RMT_WRITE_TICK_NS);
+#if CONFIG_PM_ENABLE
+        esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "powerbolt-write", &write_pm_lock);
+        esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "powerbolt-read", &read_pm_lock);
+#endif
+    }
+
+    // Configure RMT readers to interface with Powerbolt, one memory block each so three locks fit
+    // A run ends at the first level over the idle threshold, which every frame has in its start bit
+    powerbolt->readers[0] = rmtInit(keypad_read_pin, false, RMT_READ_MEMORY);
+    powerbolt->readers[1] = rmtInit(powerbolt_read_write_pin, false, RMT_READ_MEMORY);
+    if (powerbolt->readers[0] == NULL || powerbolt->readers[1] == NULL) {
+        for (uint8_t port = 0; port < 2; port++) {
+            if (powerbolt->readers[port] != NULL)
+                rmtDeinit(powerbolt->readers[port]);
+        }
+        return false;
+    }
+    const trinket_powerbolt_rx_profile_t *profile = &powerbolt->config.rx_profile;
+    for (uint8_t port = 0; port < 2; port++) {
+        rmtSetTick(powerbolt->readers[port], RMT_READ_TICK_NS);
+        rmtSetFilter(powerbolt->readers[port], true, profile->filter_ticks);
+        rmtSetRxThreshold(powerbolt->readers[port], profile->idle_ticks);
+    }
+
+    // The HAL does not report the end of a transmission, so a timer is armed for the
+    // exact length of the waveform instead of sleeping the caller
+    const esp_timer_create_args_t write_timer_args = {
+        .callback = rmt_on_write_timer,
+        .arg = powerbolt,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "powerbolt-write"
+    };
+    esp_timer_create(&write_timer_args, &powerbolt->write_timer);
+
+#if CONFIG_PM_ENABLE
+    const esp_timer_create_args_t read_timer_args = {
+        .callback = rmt_on_read_timer,
+        .arg = powerbolt,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "powerbolt-read"
+    };
+    esp_timer_create(&read_timer_args, &powerbolt->read_timer);
+#endif
 
     // Start RMT reading on both ports
-    rmtRead(rmt_reader_from_powerbolt, rmt_on_receive_from_powerbolt);
-    rmtRead(rmt_reader_from_keypad, rmt_on_receive_from_keypad);
+    powerbolt_receiver_init(&powerbolt->receivers[0]);
+    powerbolt_receiver_init(&powerbolt->receivers[1]);
+    rmtRead(powerbolt->readers[0], rmt_receive_isrs[powerbolt->index * 2]);
+    rmtRead(powerbolt->readers[1], rmt_receive_isrs[powerbolt->index * 2 + 1]);
+    return true;
 }
 
-void trinket_powerbolt_write(POWERBOLT_KEY_CODES key_code) {
-    powerbolt_write_buffer(rmt_send_buffer, key_code);
+// Starts the engine task with the first lock, then has it set up the RMT channels and waits until it has
+trinket_powerbolt_t *trinket_powerbolt_setup(const trinket_powerbolt_config_t *config) {
+    trinket_powerbolt_t *powerbolt = NULL;
+    for (uint8_t i = 0; i < TRINKET_POWERBOLT_MAX_LOCKS && powerbolt == NULL; i++) {
+        if (!powerbolts[i].allocated)
+            powerbolt = &powerbolts[i];
+    }
+    if (powerbolt == NULL)
+        return NULL;
 
-    // Temporarily assign the RMT channel as an output
-    pinMatrixOutAttach(rmt_writer->pin, RMT_SIG_OUT0_IDX + rmt_writer->channel, 0, 0);
-    rmtWrite(rmt_writer, rmt_send_buffer, 20);
+    powerbolt->allocated = true;
+    powerbolt->index = powerbolt - powerbolts;
+    powerbolt->config = *config;
+    trinket_powerbolt_rx_profile_t *profile = &powerbolt->config.rx_profile;
+    if (profile->filter_ticks == 0)
+        profile->filter_ticks = TRINKET_POWERBOLT_RX_FILTER_TICKS;
+    if (profile->idle_ticks == 0)
+        profile->idle_ticks = TRINKET_POWERBOLT_RX_IDLE_TICKS;
+    if (profile->noise_ticks == 0)
+        profile->noise_ticks = TRINKET_POWERBOLT_RX_NOISE_TICKS;
+    powerbolt->write_state = WRITE_IDLE;
+    powerbolt_pacing_init(&powerbolt->pacing, &ack_gaps[powerbolt->index]);
 
-    // Wait for write to complete... this could be improved
-    delay(100);
+    if (engine_task == NULL) {
+        engine_ready = xSemaphoreCreateBinary();
+        xTaskCreatePinnedToCore(engine_main, "powerbolt", ENGINE_STACK, NULL, ENGINE_PRIORITY, &engine_task, ENGINE_CORE);
+    }
+    engine_setup_request = powerbolt;
+    xTaskNotify(engine_task, ENGINE_NOTIFY_SETUP, eSetBits);
+    xSemaphoreTake(engine_ready, portMAX_DELAY);
 
-    // Set the RMT channel back to read mode so the keypad can continue to work
-    pinMatrixOutDetach(rmt_writer->pin, 0, 0);
-    pinMode(rmt_writer->pin, INPUT);
+    if (!powerbolt->ready) {
+        powerbolt->allocated = false;
+        return NULL;
+    }
+    return powerbolt;
+}
+
+// Total playback time of an RMT buffer in us
+static uint64_t rmt_buffer_duration_us(rmt_data_t rmt_buffer[], size_t len) {
+    uint64_t ticks = 0;
+    for (size_t i = 0; i < len; i++)
+        ticks += rmt_buffer[i].duration0 + rmt_buffer[i].duration1;
+    return ticks * RMT_WRITE_TICK_NS / 1000;
+}
+
+// Restarts the write timer, it may still be armed from an earlier state
+static void rmt_arm_write_timer(trinket_powerbolt_t *powerbolt, uint64_t timeout_us) {
+    esp_timer_stop(powerbolt->write_timer);
+    esp_timer_start_once(powerbolt->write_timer, timeout_us);
+}
+
+// Wakes the engine task to hand the writer to the next lock waiting for it
+static void rmt_write_notify() {
+    xTaskNotify(engine_task, ENGINE_NOTIFY_WRITE, eSetBits);
+}
+
+static void rmt_release_pin(trinket_powerbolt_t *powerbolt) {
+    // Set the pin back to read mode so the keypad can continue to work, then let the other locks write
+    pinMatrixOutDetach(powerbolt->config.powerbolt_read_write_pin, 0, 0);
+    pinMode(powerbolt->config.powerbolt_read_write_pin, INPUT);
+
+    portENTER_CRITICAL(&write_mux);
+    write_owner = NULL;
+    portEXIT_CRITICAL(&write_mux);
+    rmt_write_notify();
+}
+
+static void rmt_write_stay_awake(bool awake) {
+#if CONFIG_PM_ENABLE
+    if (awake)
+        esp_pm_lock_acquire(write_pm_lock);
+    else
+        esp_pm_lock_release(write_pm_lock);
+#endif
+}
+
+// The lock is held exactly while the state is not idle, a failed write has already released it
+static void rmt_write_finish(trinket_powerbolt_t *powerbolt) {
+    if (powerbolt->write_state != WRITE_IDLE)
+        rmt_write_stay_awake(false);
+    powerbolt->write_state = WRITE_IDLE;
+    if (powerbolt->config.on_write_done != NULL)
+        (*powerbolt->config.on_write_done)(powerbolt->config.arg);
+}
+
+// Plays back the next key of a paced write or the whole encoded buffer, attaching the pin once for
+// the whole buffer. The caller has made this lock the owner of the writer
+static bool rmt_write_transmit(trinket_powerbolt_t *powerbolt) {
+    size_t len = powerbolt->send_len;
+    if (powerbolt->write_paced) {
+        powerbolt_write_buffer(powerbolt->send_buffer, powerbolt->write_key);
+        len = POWERBOLT_KEY_SYMBOLS;
+    }
+
+    // Temporarily route the RMT channel to this lock's pin as an output
+    pinMatrixOutAttach(powerbolt->config.powerbolt_read_write_pin, RMT_SIG_OUT0_IDX + rmt_writer->channel, 0, 0);
+    if (!rmtWrite(rmt_writer, powerbolt->send_buffer, len)) {
+        rmt_release_pin(powerbolt);
+        rmt_write_finish(powerbolt);
+        return false;
+    }
+
+    rmt_arm_write_timer(powerbolt, rmt_buffer_duration_us(powerbolt->send_buffer, len));
+    return true;
+}
+
+// Runs on the engine task whenever a write is queued or the writer is released
+// Locks waiting for the writer take turns, so the keys of a paced write on one lock go out in the
+// gaps while another lock waits for its acks
+static void rmt_write_schedule() {
+    for (;;) {
+        trinket_powerbolt_t *next = NULL;
+        portENTER_CRITICAL(&write_mux);
+        if (write_owner == NULL) {
+            for (uint8_t i = 1; i <= TRINKET_POWERBOLT_MAX_LOCKS && next == NULL; i++) {
+                trinket_powerbolt_t *powerbolt = &powerbolts[(write_last_owner + i) % TRINKET_POWERBOLT_MAX_LOCKS];
+                if (powerbolt->ready && powerbolt->write_state == WRITE_QUEUED)
+                    next = powerbolt;
+            }
+        }
+        if (next != NULL) {
+            write_owner = next;
+            write_last_owner = next->index;
+            next->write_state = WRITE_TRANSMITTING;
+            if (next->write_paced)
+                next->write_key = next->write_sequence[powerbolt_pacing_next_key(&next->pacing)];
+        }
+        portEXIT_CRITICAL(&write_mux);
+
+        // A failed transmission has already finished its write and released the writer
+        if (next == NULL || rmt_write_transmit(next))
+            return;
+    }
 }
 
-void trinket_powerbolt_on_read(void (*callback)(uint8_t, powerbolt_read_t)) {
-    read_callback = callback;
+// Moves the write state along for a pacing decision and arms the timer it needs, under write_mux
+static void rmt_write_pace(trinket_powerbolt_t *powerbolt, POWERBOLT_PACING_ACTIONS action) {
+    switch (action) {
+    case POWERBOLT_PACING_WAIT_ACK:
+        powerbolt->write_state = WRITE_WAITING_ACK;
+        esp_timer_start_once(powerbolt->write_timer, (uint64_t) POWERBOLT_ACK_TIMEOUT_MS * 1000);
+        break;
+
+    case POWERBOLT_PACING_GAP:
+        powerbolt->write_state = WRITE_GAP;
+        esp_timer_stop(powerbolt->write_timer);
+        esp_timer_start_once(powerbolt->write_timer, (uint64_t) powerbolt->pacing.gap->gap_ms * 1000);
+        break;
+
+    // The next key waits for the writer like any other transmission
+    case POWERBOLT_PACING_NEXT_KEY:
+        powerbolt->write_state = WRITE_QUEUED;
+        break;
+
+    default:
+        break;
+    }
+}
+
+// Ends a paced write with nothing on the wire, the timer task finishes it like any other write
+static void rmt_write_end_paced(trinket_powerbolt_t *powerbolt) {
+    powerbolt->write_state = WRITE_GAP;
+    esp_timer_stop(powerbolt->write_timer);
+    esp_timer_start_once(powerbolt->write_timer, 1);
+}
+
+// Runs on the esp_timer task, state changes are shared with the engine task
+static void rmt_on_write_timer(void *arg) {
+    trinket_powerbolt_t *powerbolt = (trinket_powerbolt_t *) arg;
+    POWERBOLT_PACING_ACTIONS action = POWERBOLT_PACING_NONE;
+    bool release_pin = false;
+
+    portENTER_CRITICAL(&write_mux);
+    switch (powerbolt->write_state) {
+    case WRITE_TRANSMITTING:
+        release_pin = true;
+        action = powerbolt->write_paced ? powerbolt_pacing_sent(&powerbolt->pacing, esp_timer_get_time()) : POWERBOLT_PACING_FINISH;
+        break;
+
+    case WRITE_WAITING_ACK:
+        action = powerbolt_pacing_ack_timeout(&powerbolt->pacing);
+        break;
+
+    // The engine task can restart the gap just as an ack timeout was being dispatched
+    case WRITE_GAP:
+        action = powerbolt_pacing_gap_elapsed(&powerbolt->pacing, esp_timer_get_time());
+        break;
+
+    default:
+        break;
+    }
+    rmt_write_pace(powerbolt, action);
+    portEXIT_CRITICAL(&write_mux);
+
+    if (release_pin)
+        rmt_release_pin(powerbolt);
+
+    if (action == POWERBOLT_PACING_NEXT_KEY)
+        rmt_write_notify();
+    if (action == POWERBOLT_PACING_FINISH)
+        rmt_write_finish(powerbolt);
 }
 
-static void rmt_on_receive(uint8_t port, uint32_t *data, size_t len) {
-    if (len != 9)
+// Called from the engine task for every frame from the deadbolt
+static void rmt_on_write_response(trinket_powerbolt_t *powerbolt, powerbolt_read_t received) {
+    if (!received.valid)
         return;
 
-    powerbolt_read_t received_byte = powerbolt_parse_buffer(data);
+    portENTER_CRITICAL(&write_mux);
+    if (powerbolt->write_paced && powerbolt->write_state != WRITE_IDLE) {
+        POWERBOLT_PACING_ACTIONS action = powerbolt_pacing_response(&powerbolt->pacing, received.data,
+            powerbolt->write_state == WRITE_TRANSMITTING, powerbolt->write_state == WRITE_WAITING_ACK, esp_timer_get_time());
+        if (action == POWERBOLT_PACING_FINISH)
+            rmt_write_end_paced(powerbolt);
+        else
+            rmt_write_pace(powerbolt, action);
+    }
+    portEXIT_CRITICAL(&write_mux);
+}
 
-    if (read_callback != NULL) {
-        (*read_callback)(port, received_byte);
+// Claims the lock's write state for a new sequence, false when a write is already in progress
+static bool rmt_write_claim(trinket_powerbolt_t *powerbolt) {
+    bool claimed = false;
+    portENTER_CRITICAL(&write_mux);
+    if (powerbolt->write_state == WRITE_IDLE) {
+        powerbolt->write_state = WRITE_STARTING;
+        claimed = true;
     }
+    portEXIT_CRITICAL(&write_mux);
+
+    if (claimed)
+        rmt_write_stay_awake(true);
+    return claimed;
+}
+
+// Queues a claimed write for the writer, len is the encoded buffer length or 0 for a paced write
+// A cancel may already have moved the write on
+static void rmt_write_post(trinket_powerbolt_t *powerbolt, size_t len) {
+    powerbolt->send_len = len;
+    portENTER_CRITICAL(&write_mux);
+    if (powerbolt->write_state == WRITE_STARTING)
+        powerbolt->write_state = WRITE_QUEUED;
+    portEXIT_CRITICAL(&write_mux);
+    rmt_write_notify();
+}
+
+bool trinket_powerbolt_write_async(trinket_powerbolt_t *powerbolt, const POWERBOLT_KEY_CODES key_codes[], size_t count,
+    uint32_t key_gap_ms) {
+    if (count == 0 || count > TRINKET_POWERBOLT_MAX_SEQUENCE || !rmt_write_claim(powerbolt))
+        return false;
+
+    // Encode every key and the gaps between them up front, the HAL refills the channel memory
+    // from this buffer while the sequence plays
+    powerbolt->write_paced = false;
+    uint32_t gap_ticks = (uint64_t) key_gap_ms * 1000000 / RMT_WRITE_TICK_NS;
+    rmt_write_post(powerbolt, powerbolt_write_sequence_buffer(powerbolt->send_buffer, key_codes, count, gap_ticks));
+    return true;
+}
+
+bool trinket_powerbolt_write_paced_async(trinket_powerbolt_t *powerbolt, const POWERBOLT_KEY_CODES key_codes[], size_t count) {
+    if (count == 0 || count > TRINKET_POWERBOLT_MAX_SEQUENCE || !rmt_write_claim(powerbolt))
+        return false;
+
+    memcpy(powerbolt->write_sequence, key_codes, count * sizeof(POWERBOLT_KEY_CODES));
+    powerbolt_pacing_start(&powerbolt->pacing, count);
+    powerbolt->write_paced = true;
+    rmt_write_post(powerbolt, 0);
+    return true;
+}
+
+bool trinket_powerbolt_write_raw_async(trinket_powerbolt_t *powerbolt, const uint8_t commands[], size_t count,
+    uint32_t key_gap_ms) {
+    if (count == 0 || count > TRINKET_POWERBOLT_MAX_SEQUENCE || !rmt_write_claim(powerbolt))
+        return false;
+
+    powerbolt->write_paced = false;
+    uint32_t gap_ticks = (uint64_t) key_gap_ms * 1000000 / RMT_WRITE_TICK_NS;
+    rmt_write_post(powerbolt, powerbolt_write_raw_sequence_buffer(powerbolt->send_buffer, commands, count, gap_ticks));
+    return true;
 }
 
-static void rmt_on_receive_from_powerbolt(uint32_t *data, size_t len) {
-    rmt_on_receive(0, data, len);
+bool trinket_powerbolt_write(trinket_powerbolt_t *powerbolt, POWERBOLT_KEY_CODES key_code) {
+    return trinket_powerbolt_write_async(powerbolt, &key_code, 1, 0);
 }
 
-static void rmt_on_receive_from_keypad(uint32_t *data, size_t len) {
-    rmt_on_receive(1, data, len);
-}
\ No newline at end of file
+// Paced writes stop after the key being sent, a single transmission can not be stopped part way
+bool trinket_powerbolt_write_cancel(trinket_powerbolt_t *powerbolt) {
+    bool cancelled = false;
+    portENTER_CRITICAL(&write_mux);
+    if (powerbolt->write_paced && powerbolt->write_state != WRITE_IDLE && powerbolt_pacing_cancel(&powerbolt->pacing)) {
+        cancelled = true;
+
+        // Nothing is on the wire while waiting, finish straight away
+        if (powerbolt->write_state != WRITE_TRANSMITTING)
+            rmt_write_end_paced(powerbolt);
+    }
+    portEXIT_CRITICAL(&write_mux);
+    return cancelled;
+}
+
+bool trinket_powerbolt_write_busy(trinket_powerbolt_t *powerbolt) {
+    return powerbolt->write_state != WRITE_IDLE;
+}
+
+// Engine figures are shared by every lock
+void trinket_powerbolt_get_stats(trinket_powerbolt_t *powerbolt, trinket_powerbolt_stats_t *stats) {
+    powerbolt_receiver_t *receivers = powerbolt->receivers;
+    stats->frames = powerbolt->frames_received;
+    stats->repeats_seen = receivers[0].repeats_seen + receivers[1].repeats_seen;
+    stats->repeats_missing = receivers[0].repeats_missing + receivers[1].repeats_missing;
+    stats->decode_errors = receivers[0].decoder.errors + receivers[1].decoder.errors;
+    stats->symbols_discarded = receivers[0].decoder.discarded + receivers[1].decoder.discarded;
+    stats->ack_timeouts = powerbolt->pacing.timeouts;
+    stats->ack_gap_ms = powerbolt->pacing.gap->gap_ms;
+    stats->ack_gap_floor_ms = powerbolt->pacing.gap->floor_ms;
+    stats->runs_dropped = powerbolt->runs[0].overflow_count() + powerbolt->runs[1].overflow_count();
+    stats->runs_truncated = powerbolt->runs_truncated;
+    stats->run_queue_watermark = powerbolt->runs[0].high_watermark() > powerbolt->runs[1].high_watermark() ?
+        powerbolt->runs[0].high_watermark() : powerbolt->runs[1].high_watermark();
+    stats->engine_busy_us = engine_busy_us;
+    stats->engine_wakeups = engine_wakeups;
+    stats->engine_stack_free = engine_task != NULL ? uxTaskGetStackHighWaterMark(engine_task) : 0;
+    stats->ulp_edges = powerbolt->ulp_captured;
+    stats->ulp_runs = powerbolt->ulp_runs;
+    stats->runs_spurious[0] = powerbolt->runs_spurious[0];
+    stats->runs_spurious[1] = powerbolt->runs_spurious[1];
+
+    // A frame whose window has closed without a repeat is missing even if nothing has arrived since
+    int64_t timestamp = esp_timer_get_time();
+    for (uint8_t port = 0; port < 2; port++) {
+        bool expired = powerbolt_receiver_repeat_expired(&receivers[port], timestamp);
+        stats->repeats_missing += expired;
+        stats->last_repeat_seen[port] = receivers[port].last_repeat_seen && !expired;
+        stats->bit_period[port] = receivers[port].decoder.bit_period;
+    }
+}
+
+#if CONFIG_PM_ENABLE
+// Only wakes the engine, which owns the read state
+static void rmt_on_read_timer(void *arg) {
+    xTaskNotify(engine_task, ENGINE_NOTIFY_READ, eSetBits);
+}
+#endif
+
+// Holds the read PM lock until the later port is done and rearms the timer for that, engine task only
+static void rmt_read_stay_awake(trinket_powerbolt_t *powerbolt) {
+#if CONFIG_PM_ENABLE
+    int64_t until = powerbolt->read_awake_until[0] > powerbolt->read_awake_until[1] ?
+        powerbolt->read_awake_until[0] : powerbolt->read_awake_until[1];
+    int64_t now = esp_timer_get_time();
+
+    esp_timer_stop(powerbolt->read_timer);
+    if (until > now) {
+        if (!powerbolt->read_awake)
+            esp_pm_lock_acquire(read_pm_lock);
+        powerbolt->read_awake = true;
+        esp_timer_start_once(powerbolt->read_timer, until - now);
+    }
+    else if (powerbolt->read_awake) {
+        esp_pm_lock_release(read_pm_lock);
+        powerbolt->read_awake = false;
+    }
+#endif
+}
+
+// A run that decoded nothing may be the start of a frame, one that did is done once its repeat has
+// arrived or the repeat window has closed. Replayed ULP runs are in the past and never hold the lock
+static void rmt_read_activity(trinket_powerbolt_t *powerbolt, uint8_t port, bool decoded, int64_t timestamp) {
+#if CONFIG_PM_ENABLE
+    const powerbolt_receiver_t *receiver = &powerbolt->receivers[port];
+    int64_t until = decoded ? 0 : timestamp + READ_FRAME_US;
+    if (receiver->awaiting_repeat && receiver->timestamp + POWERBOLT_REPEAT_WINDOW_US > until)
+        until = receiver->timestamp + POWERBOLT_REPEAT_WINDOW_US;
+    powerbolt->read_awake_until[port] = until;
+    rmt_read_stay_awake(powerbolt);
+#endif
+}
+
+// Runs can hold part of a frame, several frames or noise, the decoder keeps state between them
+// Runs on the engine task, the timestamp is when the interrupt received the run
+static void rmt_on_receive(trinket_powerbolt_t *powerbolt, uint8_t port, uint32_t *data, size_t len, int64_t timestamp) {
+    void *arg = powerbolt->config.arg;
+    if (powerbolt->config.on_trace != NULL)
+        (*powerbolt->config.on_trace)(arg, port, data, len, timestamp);
+
+    powerbolt_read_t received[4];
+    const powerbolt_decoder_t *decoder = &powerbolt->receivers[port].decoder;
+    uint32_t decodes = decoder->frames + decoder->errors;
+    size_t count = powerbolt_receiver_feed(&powerbolt->receivers[port], data, len, timestamp, received, 4);
+    rmt_read_activity(powerbolt, port, decoder->frames + decoder->errors != decodes, timestamp);
+
+    for (size_t i = 0; i < count; i++) {
+        if (port == 0)
+            rmt_on_write_response(powerbolt, received[i]);
+
+        if (received[i].valid)
+            powerbolt->frames_received++;
+
+        if (powerbolt->config.on_read != NULL) {
+            (*powerbolt->config.on_read)(arg, port, received[i]);
+        }
+    }
+}
+
+// Word address of RTC slow memory as the ULP sees it
+static uint32_t ulp_address(const void *pointer) {
+    return ((uintptr_t) pointer - (uintptr_t) RTC_SLOW_MEM) / sizeof(uint32_t);
+}
+
+static bool ulp_pins_supported(const trinket_powerbolt_t *powerbolt) {
+    int pins[2] = { powerbolt->config.keypad_read_pin, powerbolt->config.powerbolt_read_write_pin };
+    return rtc_gpio_is_valid_gpio((gpio_num_t) pins[0]) && rtc_gpio_is_valid_gpio((gpio_num_t) pins[1])
+        && rtc_gpio_desc[pins[0]].rtc_num == ULP_PORT0_RTC_GPIO
+        && rtc_gpio_desc[pins[1]].rtc_num == ULP_PORT1_RTC_GPIO;
+}
+
+// The ULP polls both lines every ULP_POLL_US and halts straight away while they are low
+// Once a line is high it samples continuously, storing a record for every edge, until both lines have
+// been low for POWERBOLT_CAPTURE_SAMPLES_MAX samples. Bursts that never reach ULP_WAKE_EDGES are
+// dropped, the first burst that does wakes the main cores and capture carries on while they boot
+// Registers: R0 scratch, R1 levels after the last edge, R2 samples since the last edge, R3 capture base
+bool trinket_powerbolt_ulp_arm(trinket_powerbolt_t *powerbolt) {
+    if (!ulp_pins_supported(powerbolt))
+        return false;
+
+    for (uint8_t port = 0; port < 2; port++) {
+        gpio_num_t pin = (gpio_num_t) (port == 0 ? powerbolt->config.keypad_read_pin : powerbolt->config.powerbolt_read_write_pin);
+        rtc_gpio_init(pin);
+        rtc_gpio_set_direction(pin, RTC_GPIO_MODE_INPUT_ONLY);
+        rtc_gpio_pullup_dis(pin);
+        rtc_gpio_pulldown_dis(pin);
+    }
+
+    enum { LABEL_LOOP, LABEL_SAME, LABEL_IDLE, LABEL_END_BURST, LABEL_KEEP, LABEL_FULL };
+    const uint32_t base = ulp_address(&ulp_capture);
+    const uint32_t records = ulp_address(ulp_capture.records) - base;
+    const ulp_insn_t program[] = {
+        I_MOVI(R3, base),
+        I_LD(R0, R3, 0),
+        M_BGE(LABEL_FULL, ULP_CAPTURE_EDGES),
+
+        // Both lines low, sleep until the next poll
+        I_RD_REG(RTC_GPIO_IN_REG, RTC_GPIO_IN_NEXT_S + ULP_PORT0_RTC_GPIO, RTC_GPIO_IN_NEXT_S + ULP_PORT1_RTC_GPIO),
+        I_ANDI(R0, R0, ULP_LEVEL_MASK),
+        M_BXZ(LABEL_END_BURST),
+        I_MOVI(R1, 0),
+        I_MOVI(R2, POWERBOLT_CAPTURE_SAMPLES_MAX),
+
+        M_LABEL(LABEL_LOOP),
+        I_RD_REG(RTC_GPIO_IN_REG, RTC_GPIO_IN_NEXT_S + ULP_PORT0_RTC_GPIO, RTC_GPIO_IN_NEXT_S + ULP_PORT1_RTC_GPIO),
+        I_ANDI(R0, R0, ULP_LEVEL_MASK),
+        I_SUBR(R0, R0, R1),
+        M_BXZ(LABEL_SAME),
+
+        // Edge, store the new levels with the samples since the last edge
+        I_ADDR(R1, R0, R1),
+        I_LSHI(R0, R1, POWERBOLT_CAPTURE_LEVEL_SHIFT),
+        I_ORR(R2, R2, R0),
+        I_LD(R0, R3, 0),
+        M_BGE(LABEL_FULL, ULP_CAPTURE_EDGES),
+        I_ADDR(R0, R0, R3),
+        I_ST(R2, R0, records),
+        I_SUBR(R0, R0, R3),
+        I_ADDI(R0, R0, 1),
+        I_ST(R0, R3, 0),
+        I_MOVI(R2, 0),
+        M_BL(LABEL_LOOP, ULP_WAKE_EDGES),
+        M_BGE(LABEL_LOOP, ULP_WAKE_EDGES + 1),
+        I_WAKE(),
+        M_BX(LABEL_LOOP),
+
+        // Same levels, count the sample until the count saturates
+        M_LABEL(LABEL_SAME),
+        I_MOVR(R0, R2),
+        M_BGE(LABEL_IDLE, POWERBOLT_CAPTURE_SAMPLES_MAX),
+        I_ADDI(R2, R2, 1),
+        M_BX(LABEL_LOOP),
+
+        // A long high (the start bit) keeps sampling, a long low ends the burst
+        M_LABEL(LABEL_IDLE),
+        I_MOVR(R0, R1),
+        M_BXZ(LABEL_END_BURST),
+        M_BX(LABEL_LOOP),
+
+        M_LABEL(LABEL_END_BURST),
+        I_LD(R0, R3, 0),
+        M_BGE(LABEL_KEEP, ULP_WAKE_EDGES),
+        I_MOVI(R0, 0),
+        I_ST(R0, R3, 0),
+        M_LABEL(LABEL_KEEP),
+        I_HALT(),
+
+        // Buffer full, stop polling until the main cores replay it and arm again
+        M_LABEL(LABEL_FULL),
+        I_END(),
+        I_HALT()
+    };
+
+    ulp_capture.count = 0;
+    size_t size = sizeof(program) / sizeof(ulp_insn_t);
+    if (ulp_process_macros_and_load(0, program, &size) != ESP_OK)
+        return false;
+    ulp_set_wakeup_period(0, ULP_POLL_US);
+
+    esp_sleep_pd_config(ESP_PD_DOMAIN_RTC_PERIPH, ESP_PD_OPTION_ON);
+    esp_sleep_enable_ulp_wakeup();
+    return ulp_run(0) == ESP_OK;
+}
+
+// Takes what the ULP captured and hands the pins back before the RMT is set up
+// A capture that is still running stops at its next edge
+static void ulp_capture_stop(trinket_powerbolt_t *powerbolt) {
+    if (!ulp_pins_supported(powerbolt))
+        return;
+
+    CLEAR_PERI_REG_MASK(RTC_CNTL_STATE0_REG, RTC_CNTL_ULP_CP_SLP_TIMER_EN);
+    size_t count = ulp_capture.count & 0xFFFF;
+    ulp_capture.count = ULP_CAPTURE_EDGES;
+    if (count >= ULP_WAKE_EDGES)
+        powerbolt->ulp_captured = count > ULP_CAPTURE_EDGES ? ULP_CAPTURE_EDGES : count;
+
+    rtc_gpio_deinit((gpio_num_t) powerbolt->config.keypad_read_pin);
+    rtc_gpio_deinit((gpio_num_t) powerbolt->config.powerbolt_read_write_pin);
+}
+
+// Runs are replayed on the engine task during setup, one lock at a time
+static trinket_powerbolt_t *ulp_replay_target = NULL;
+static int64_t ulp_replay_start_us = 0;
+
+static void ulp_on_replay_run(uint8_t port, uint32_t *symbols, size_t len, uint64_t end_ns) {
+    rmt_on_receive(ulp_replay_target, port, symbols, len, ulp_replay_start_us + (int64_t) (end_ns / 1000));
+}
+
+// Frames that arrived while the main cores were asleep or booting go through the normal read path
+static void ulp_capture_replay(trinket_powerbolt_t *powerbolt) {
+    if (powerbolt->ulp_captured == 0)
+        return;
+
+    // The ULP has no clock, so run times are rebuilt from the sample counts and counted back from now, when
+    // capture stopped. Runs from before boot come out with negative times. A gap the ULP slept through
+    // counts as its saturated length, runs on either side of one end up closer together than they were
+    ulp_replay_target = powerbolt;
+    ulp_replay_start_us = esp_timer_get_time()
+        - (int64_t) (powerbolt_capture_duration_ns(ulp_capture.records, powerbolt->ulp_captured, ULP_SAMPLE_NS) / 1000);
+    powerbolt->ulp_runs = powerbolt_capture_runs(ulp_capture.records, powerbolt->ulp_captured, ULP_SAMPLE_NS,
+        RMT_READ_TICK_NS, ULP_REPLAY_IDLE_TICKS, ulp_on_replay_run);
+}
+
+// Protocol engine: channel setup, decoding, repeat merging, ack pacing, the read callbacks (sequence
+// tracking) and scheduling writes all run here for every lock, pinned to its own core at high priority
+static void engine_main(void *arg) {
+    for (;;) {
+        uint32_t notified = 0;
+        xTaskNotifyWait(0, UINT32_MAX, &notified, portMAX_DELAY);
+        int64_t start = esp_timer_get_time();
+        engine_wakeups++;
+
+        // RMT interrupts are allocated on the core that sets the channels up, so every lock is set up here
+        if (notified & ENGINE_NOTIFY_SETUP) {
+            trinket_powerbolt_t *powerbolt = engine_setup_request;
+            ulp_capture_stop(powerbolt);
+            powerbolt->ready = rmt_setup(powerbolt);
+            if (powerbolt->ready)
+                ulp_capture_replay(powerbolt);
+            xSemaphoreGive(engine_ready);
+        }
+
+        if (notified & ENGINE_NOTIFY_WRITE)
+            rmt_write_schedule();
+
+        spsc_ring<rmt_run_t, ENGINE_RUN_QUEUE_SIZE>::entry_t entry;
+        for (uint8_t i = 0; i < TRINKET_POWERBOLT_MAX_LOCKS; i++) {
+            trinket_powerbolt_t *powerbolt = &powerbolts[i];
+            if (!powerbolt->ready)
+                continue;
+            for (uint8_t port = 0; port < 2; port++) {
+                while (powerbolt->runs[port].pop(entry))
+                    rmt_on_receive(powerbolt, port, entry.value.symbols, entry.value.len, entry.value.timestamp);
+            }
+            if (notified & ENGINE_NOTIFY_READ)
+                rmt_read_stay_awake(powerbolt);
+        }
+
+        engine_busy_us += esp_timer_get_time() - start;
+    }
+}
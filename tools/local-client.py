@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+"""Local endpoint client, for trying commands over the LAN and timing them
+
+    tools/local-client.py <device ip> <psk> DBL@1 "back DB1234@2"
+
+Authenticates with the pre-shared key, sends each command once the previous one has its result and
+prints everything the device sends with the ms since the last command went out.
+Every line after auth is tagged and checked as described in lib/local-endpoint/local-endpoint.h.
+With no commands it stays connected and prints events until interrupted.
+"""
+
+import argparse
+import hashlib
+import hmac
+import socket
+import sys
+import time
+
+
+TAG_SIZE = 16
+
+
+def read_line(stream):
+    line = stream.readline()
+    if not line:
+        sys.exit("connection closed")
+    return line.decode(errors="replace").rstrip("\r\n")
+
+
+class Session:
+    """Line tags for one session, both directions count their own lines"""
+
+    def __init__(self, psk, nonce):
+        self.psk = psk.encode()
+        self.nonce = nonce
+        self.counts = {"c": 0, "d": 0}
+
+    def tag(self, direction, line):
+        message = self.nonce + direction.encode() + self.counts[direction].to_bytes(4, "big") + line.encode()
+        self.counts[direction] += 1
+        return hmac.new(self.psk, message, hashlib.sha256).digest()[:TAG_SIZE].hex()
+
+    def seal(self, line):
+        return (self.tag("c", line) + " " + line + "\n").encode()
+
+    def open(self, line):
+        if line == "> denied":
+            sys.exit("denied")
+        tag, _, text = line.partition(" ")
+        if not hmac.compare_digest(tag, self.tag("d", text)):
+            sys.exit("bad tag: " + line)
+        return text
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("host")
+    parser.add_argument("psk")
+    parser.add_argument("commands", nargs="*")
+    parser.add_argument("--port", type=int, default=7070)
+    parser.add_argument("--timeout", type=float, default=15, help="seconds to wait for each result")
+    args = parser.parse_args()
+
+    connection = socket.create_connection((args.host, args.port), timeout=5)
+    connection.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    stream = connection.makefile("rb")
+
+    challenge = read_line(stream)
+    if not challenge.startswith("> challenge "):
+        sys.exit("unexpected greeting: " + challenge)
+    nonce = bytes.fromhex(challenge.split()[2])
+    response = hmac.new(args.psk.encode(), nonce, hashlib.sha256).hexdigest()
+    connection.sendall(("auth " + response + "\n").encode())
+    reply = read_line(stream)
+    if reply != "> ok":
+        sys.exit("not authenticated: " + reply)
+    session = Session(args.psk, nonce)
+
+    connection.settimeout(args.timeout)
+    for command in args.commands:
+        sent = time.monotonic()
+        connection.sendall(session.seal(command))
+        while True:
+            try:
+                line = session.open(read_line(stream))
+            except socket.timeout:
+                print("%s: no result" % command)
+                break
+            print("%8.1f ms  %s" % ((time.monotonic() - sent) * 1000, line))
+            if "> result " in line:
+                break
+
+    if not args.commands:
+        connection.settimeout(None)
+        start = time.monotonic()
+        while True:
+            print("%8.1f ms  %s" % ((time.monotonic() - start) * 1000, session.open(read_line(stream))))
+
+
+if __name__ == "__main__":
+    main()